@@ -24,6 +24,11 @@ bool bu::read_config_from_file(bunsen_config &cfg, const std::string &path)
 		value = ini->GetReal(section, name, value);
 	};
 
+	auto get_bool = [&section, &ini](bool &value, const std::string &name)
+	{
+		value = ini->GetBoolean(section, name, value);
+	};
+
 	// [general]
 	section = "general";
 	get_int(cfg.general.resx, "resx");
@@ -37,5 +42,52 @@ bool bu::read_config_from_file(bunsen_config &cfg, const std::string &path)
 	get_flt(cfg.theme.g, "g");
 	get_flt(cfg.theme.b, "b");
 
+	// [rt]
+	section = "rt";
+	auto &rt = cfg.rt;
+	get_int(rt.thread_count, "threads");
+	get_int(rt.tile_size, "tile_size");
+	get_int(rt.bucket_count, "buckets");
+	get_int(rt.max_bounces, "max_bounces");
+	get_int(rt.roulette_depth, "roulette_depth");
+	get_int(rt.target_samples, "target_spp");
+	get_flt(rt.time_budget, "time_budget");
+	get_flt(rt.adaptive_threshold, "adaptive_threshold");
+	get_int(rt.adaptive_min_samples, "adaptive_min_spp");
+	get_bool(rt.packet_tracing, "packets");
+	get_bool(rt.denoise, "denoise");
+
+	std::string integrator = ini->GetString(section, "integrator", "");
+	if (integrator == "megakernel")
+		rt.integrator = bu::rt::integrator_type::MEGAKERNEL;
+	else if (integrator == "streams")
+		rt.integrator = bu::rt::integrator_type::RAY_STREAMS;
+	else if (integrator == "wavefront")
+		rt.integrator = bu::rt::integrator_type::WAVEFRONT;
+
+	std::string sampler = ini->GetString(section, "sampler", "");
+	if (sampler == "random")
+		rt.sampler = bu::rt::sampler_type::RANDOM;
+	else if (sampler == "sobol")
+		rt.sampler = bu::rt::sampler_type::SOBOL;
+
+	std::string bvh_build_mode = ini->GetString(section, "bvh_build_mode", "");
+	if (bvh_build_mode == "sweep_sah")
+		rt.bvh_build_mode = bu::rt::bvh_build_mode::SWEEP_SAH;
+	else if (bvh_build_mode == "binned_sah")
+		rt.bvh_build_mode = bu::rt::bvh_build_mode::BINNED_SAH;
+	else if (bvh_build_mode == "lbvh")
+		rt.bvh_build_mode = bu::rt::bvh_build_mode::LBVH;
+	else if (bvh_build_mode == "sbvh")
+		rt.bvh_build_mode = bu::rt::bvh_build_mode::SBVH;
+
+	std::string bvh_format = ini->GetString(section, "bvh_format", "");
+	if (bvh_format == "full")
+		rt.bvh_format = bu::rt::bvh_node_format::FULL;
+	else if (bvh_format == "quantized")
+		rt.bvh_format = bu::rt::bvh_node_format::QUANTIZED;
+
+	rt.sanitize();
+
 	return true;
 }
@@ -1,5 +1,6 @@
 #pragma once
 #include <string>
+#include "renderers/rt/settings.hpp"
 
 namespace bu {
 
@@ -24,6 +25,9 @@ struct bunsen_config
 		float g = 0.333;
 		float b = 0.449;
 	} theme;
+
+	//! Path tracer settings
+	bu::rt_settings rt;
 };
 
 /**
@@ -3,8 +3,6 @@
 
 bu::rt::aabb bu::rt::triangle_aabb(const bu::rt::triangle &t)
 {
-	ZoneScopedN("triangle_aabb");
-	
 	bu::rt::aabb box;
 	box.max = glm::max(glm::max(t.vertices[0], t.vertices[1]), t.vertices[2]);
 	box.min = glm::min(glm::min(t.vertices[0], t.vertices[1]), t.vertices[2]);
@@ -23,4 +21,27 @@ bu::rt::aabb bu::rt::triangles_aabb(const bu::rt::triangle *arr, unsigned int si
 		box.add_aabb(triangle_aabb(arr[i]));
 
 	return box;
+}
+
+/**
+	\brief Computes bounds of a transformed box
+*/
+bu::rt::aabb bu::rt::transform_aabb(const bu::rt::aabb &box, const glm::mat4 &transform)
+{
+	bu::rt::aabb result;
+	for (int i = 0; i < 8; i++)
+	{
+		glm::vec3 corner{
+			i & 1 ? box.max.x : box.min.x,
+			i & 2 ? box.max.y : box.min.y,
+			i & 4 ? box.max.z : box.min.z};
+		glm::vec3 p{transform * glm::vec4{corner, 1}};
+
+		if (i == 0)
+			result = bu::rt::aabb{p, p};
+		else
+			result.add_point(p);
+	}
+
+	return result;
 }
\ No newline at end of file
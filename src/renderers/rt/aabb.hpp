@@ -123,5 +123,6 @@ private:
 
 aabb triangle_aabb(const bu::rt::triangle &t);
 aabb triangles_aabb(const bu::rt::triangle *arr, unsigned int size);
+aabb transform_aabb(const aabb &box, const glm::mat4 &transform);
 
 }
\ No newline at end of file
@@ -3,54 +3,140 @@
 
 using bu::rt::bvh_tree;
 
-bvh_tree::bvh_tree(unsigned int height, unsigned int tris) :
-	node_count(std::exp2(height)),
+bvh_tree::bvh_tree(unsigned int node_count, unsigned int tris) :
+	node_count(node_count),
 	triangle_count(tris)
 {
 	// We're doing this ugly way for now, because cudaMalloc() is no prettier
 	triangles = reinterpret_cast<triangle*>(calloc(sizeof(triangle), triangle_count));
+	intersections = reinterpret_cast<triangle_intersection*>(calloc(sizeof(triangle_intersection), triangle_count));
 	nodes = reinterpret_cast<bvh_node*>(calloc(sizeof(bvh_node), node_count));
 }
 
 bvh_tree::~bvh_tree()
 {
 	free(triangles);
+	free(intersections);
 	free(nodes);
 }
 
-bool bvh_tree::test_ray(const rt::ray &r, rt::ray_hit &hit) const
+/**
+	\brief Returns parent of each node of a binary BVH in depth-first layout (the root has none)
+*/
+std::vector<unsigned int> bu::rt::get_bvh_parents(const bvh_node *nodes, unsigned int node_count)
 {
-	bu::rt::linear_stack<std::pair<unsigned int, float>, 32> st;
+	std::vector<unsigned int> parents(node_count, bvh_no_node);
+	for (unsigned int i = 0; i < node_count; i++)
+		if (nodes[i].count == 0)
+			parents[i + 1] = parents[nodes[i].index] = i;
+	return parents;
+}
+
+/**
+	\brief Finds the node closest hit traversal visits after it's done with the subtree of node id
+
+	Walks up the tree until it finds an ancestor whose second visited child is still pending.
+	The child order is recomputed the same way the traversal chose it, so this exactly
+	recovers entries dropped from a short stack.
+
+	\returns bvh_no_node if the traversal is finished
+*/
+unsigned int bu::rt::get_next_bvh_node(const bvh_node *nodes, const unsigned int *parents, unsigned int id, const rt::ray &r, float t_max)
+{
+	for (; id != 0; id = parents[id])
+	{
+		auto id_l = parents[id] + 1;
+		auto id_r = nodes[parents[id]].index;
+
+		float tl, tr;
+		bool hit_l = nodes[id_l].aabb.test_ray(r, tl);
+		bool hit_r = nodes[id_r].aabb.test_ray(r, tr);
+
+		// The left child is visited first only if it's closer
+		if (id == id_l && hit_r && tr < t_max && tl < tr)
+			return id_r;
+		if (id == id_r && hit_l && tl < t_max && !(tl < tr))
+			return id_l;
+	}
+
+	return bvh_no_node;
+}
+
+/**
+	\brief Like get_next_bvh_node(), but for any hit traversal which always visits the left child first
+*/
+unsigned int bu::rt::get_next_bvh_node_any_hit(const bvh_node *nodes, const unsigned int *parents, unsigned int id, const rt::ray &r, float t_max)
+{
+	for (; id != 0; id = parents[id])
+	{
+		if (id != parents[id] + 1)
+			continue;
+
+		auto id_r = nodes[parents[id]].index;
+		float t;
+		if (nodes[id_r].aabb.test_ray(r, t) && t < t_max)
+			return id_r;
+	}
+
+	return bvh_no_node;
+}
+
+/**
+	\brief Finds the closest intersection closer than t_max
+*/
+bool bvh_tree::test_ray(const rt::ray &r, rt::ray_hit &hit, float t_max) const
+{
+	if (format == bvh_node_format::QUANTIZED)
+	{
+		if (width == 8)
+			return test_ray_quantized8(r, hit, t_max);
+		else if (width == 4)
+			return test_ray_quantized4(r, hit, t_max);
+	}
+	else if (width == 8)
+		return test_ray8(r, hit, t_max);
+	else if (width == 4)
+		return test_ray4(r, hit, t_max);
+
+	bu::rt::short_stack<unsigned int, 16> st;
 	
 	// Check intersection with the root node
 	{
 		float t;
-		if (nodes[1].aabb.test_ray(r, t))
-			st.push({1, t});
+		if (nodes[0].aabb.test_ray(r, t) && t < t_max)
+			st.push(0);
 		else
 			return false;
 	}
 
 	ray_hit best;
-	best.t = HUGE_VALF;
+	best.t = t_max;
 	best.triangle = nullptr;
 
-	while (!st.empty())
+	unsigned int node_id = 0;
+	while (true)
 	{
+		// Recover from stack overflow
+		if (st.empty())
+		{
+			if (!st.overflowed()) break;
+			node_id = get_next_bvh_node(nodes, parents.data(), node_id, r, best.t);
+			if (node_id == bvh_no_node) break;
+			st.push(node_id);
+		}
+
 		// Get node
-		auto [node_id, node_t] = st.top();
+		node_id = st.top();
 		auto &node = nodes[node_id];
 		st.pop();
 
-		if (node_t >= best.t) continue;
-
 		// Negative count indicates no children an no triangles
 		// Zero count indicates node with children
 		// Positive count indicates node with triangles
 		if (node.count == 0)
 		{
-			auto id_l = 2 * node_id;
-			auto id_r = 2 * node_id + 1;
+			auto id_l = node_id + 1;
+			auto id_r = node.index;
 			auto &nl = nodes[id_l];
 			auto &nr = nodes[id_r];
 
@@ -65,22 +151,22 @@ bool bvh_tree::test_ray(const rt::ray &r, rt::ray_hit &hit) const
 				// Check the closer child first
 				if (tl < tr)
 				{
-					st.push({id_r, tr});
-					st.push({id_l, tl});
+					st.push(id_r);
+					st.push(id_l);
 				}
 				else
 				{
-					st.push({id_l, tl});
-					st.push({id_r, tr});
+					st.push(id_l);
+					st.push(id_r);
 				}
 			}
 			else if (hit_l)
 			{
-				st.push({id_l, tl});
+				st.push(id_l);
 			}
 			else if (hit_r)
 			{
-				st.push({id_r, tr});
+				st.push(id_r);
 			}
 		}
 		else if (node.count > 0) // Leaf node
@@ -88,7 +174,7 @@ bool bvh_tree::test_ray(const rt::ray &r, rt::ray_hit &hit) const
 			for (unsigned int i = node.index; i < node.index + node.count; i++)
 			{
 				float t, u, v;
-				if (ray_intersect_triangle(r, triangles[i], t, u, v) && t < best.t)
+				if (ray_intersect_triangle(r, intersections[i], t, u, v) && t < best.t)
 				{
 					best.t = t;
 					best.u = u;
@@ -99,11 +185,64 @@ bool bvh_tree::test_ray(const rt::ray &r, rt::ray_hit &hit) const
 		}
 	}
 
-	if (best.t != HUGE_VALF)
+	if (best.triangle)
 	{
 		hit = best;
 		return true;
 	}
 	else
 		return false;
+}
+
+/**
+	\brief Checks whether the ray hits any triangle closer than t_max
+
+	Traversal stops at the first hit found. Children are not ordered and
+	no hit data is produced, so this is much cheaper than test_ray() for
+	shadow and visibility rays.
+*/
+bool bvh_tree::test_occlusion(const rt::ray &r, float t_max) const
+{
+	if (width != 2)
+		return test_occlusion_wide(r, t_max);
+
+	bu::rt::short_stack<unsigned int, 16> st;
+	st.push(0);
+
+	unsigned int node_id = 0;
+	while (true)
+	{
+		if (st.empty())
+		{
+			if (!st.overflowed()) break;
+			node_id = get_next_bvh_node_any_hit(nodes, parents.data(), node_id, r, t_max);
+			if (node_id == bvh_no_node) break;
+			st.push(node_id);
+		}
+
+		node_id = st.top();
+		auto &node = nodes[node_id];
+		st.pop();
+
+		float t;
+		if (node.count < 0 || !node.aabb.test_ray(r, t) || t >= t_max)
+			continue;
+
+		if (node.count == 0)
+		{
+			st.push(node.index);
+			st.push(node_id + 1);
+		}
+		else
+		{
+			for (unsigned int i = node.index; i < node.index + node.count; i++)
+			{
+				float u, v;
+				if (ray_intersect_triangle(r, intersections[i], t, u, v) && t < t_max)
+					return true;
+			}
+		}
+	}
+
+	return false;
 }
\ No newline at end of file
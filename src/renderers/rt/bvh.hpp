@@ -1,13 +1,22 @@
 #pragma once
+#include <cmath>
+#include <cstdint>
+#include <vector>
 #include "aabb.hpp"
+#include "bvh_types.hpp"
 
 namespace bu::rt {
 
 class bvh_draft;
+struct ray_packet;
+struct ray_packet_hit;
 
 /**
 	\note If count is positive, this node contains triangles. If count is zero, this
 	node has children. If count is negative, node doesn't have niether children nor triangles.
+
+	Nodes are stored in depth-first order. The left child of an inner node immediately
+	follows its parent and index holds the right child. In leaves, index is the first triangle.
 */
 struct bvh_node
 {
@@ -16,20 +25,132 @@ struct bvh_node
 	int count;
 };
 
+/**
+	\brief Node of a wide BVH - bounds of all N children are stored in SoA layout,
+	so they can be tested against a ray with a single SIMD slab test
+
+	index and count have the same meaning as in bvh_node and refer to the child,
+	except that index of a leaf is its first bvh_triangle_block (count is still
+	the number of triangles). Unused child slots have negative count.
+*/
+template <int N>
+struct alignas(N * sizeof(float)) bvh_wide_node
+{
+	float min_x[N], min_y[N], min_z[N];
+	float max_x[N], max_y[N], max_z[N];
+	unsigned int index[N];
+	int count[N];
+};
+
+using bvh_node4 = bvh_wide_node<4>;
+using bvh_node8 = bvh_wide_node<8>;
+
+/**
+	\brief Intersection data of N triangles of a leaf in SoA layout, so they can
+	be tested against a ray with a single SIMD Moller-Trumbore test
+
+	Lanes hold triangles first, first + 1, ... of the leaf. Unused lanes have
+	zero edges, so they are never hit.
+*/
+template <int N>
+struct alignas(N * sizeof(float)) bvh_triangle_block
+{
+	float v0_x[N], v0_y[N], v0_z[N];
+	float e1_x[N], e1_y[N], e1_z[N];
+	float e2_x[N], e2_y[N], e2_z[N];
+	unsigned int first;
+};
+
+using bvh_triangle_block4 = bvh_triangle_block<4>;
+using bvh_triangle_block8 = bvh_triangle_block<8>;
+
+/**
+	\brief Compressed node of a wide BVH - child bounds are quantized to 8 bits
+
+	Children are stored relative to a frame given by origin and a power-of-two
+	scale per axis (only the biased float exponent is stored). Quantized bounds
+	are rounded outwards, so decoded boxes always contain the original ones.
+*/
+template <int N>
+struct alignas(16) bvh_quantized_node
+{
+	glm::vec3 origin;
+	std::uint8_t exponent[3];
+	std::uint8_t min_x[N], min_y[N], min_z[N];
+	std::uint8_t max_x[N], max_y[N], max_z[N];
+	unsigned int index[N];
+	int count[N];
+};
+
+using bvh_qnode4 = bvh_quantized_node<4>;
+using bvh_qnode8 = bvh_quantized_node<8>;
+
+int get_bvh_width();
+
+constexpr unsigned int bvh_no_node = ~0u;
+
+std::vector<unsigned int> get_bvh_parents(const bvh_node *nodes, unsigned int node_count);
+unsigned int get_next_bvh_node(const bvh_node *nodes, const unsigned int *parents, unsigned int id, const rt::ray &r, float t_max);
+unsigned int get_next_bvh_node_any_hit(const bvh_node *nodes, const unsigned int *parents, unsigned int id, const rt::ray &r, float t_max);
+
+/**
+	\brief Bottom-level BVH over triangles
+
+	Traversal only reads the intersection data (intersections or the triangle
+	blocks) - the triangles with shading
+	data are only accessed through the final hit.
+
+	The binary nodes are always present. Depending on the width selected in
+	populate(), they are also collapsed into 4-wide or 8-wide nodes which are
+	then used for traversal. The wide nodes are kept either in full precision
+	or quantized, depending on the selected format. Leaves of the wide nodes
+	are intersected in blocks of 4 or 8 triangles.
+
+	Traversal uses a short stack. If it overflows on a deep tree, the dropped
+	entries are recovered by walking up the tree using the parent links, so
+	trees of any depth are handled without a larger stack.
+*/
 struct bvh_tree
 {
-	bvh_tree(unsigned int height, unsigned int tris);
+	bvh_tree(unsigned int node_count, unsigned int tris);
 	bvh_tree(const bvh_tree &) = delete;
 	bvh_tree &operator=(const bvh_tree &) = delete;
 	~bvh_tree();
 
 	triangle *triangles = nullptr;
+	triangle_intersection *intersections = nullptr; //!< Intersection data of triangles - used during traversal
 	bvh_node *nodes = nullptr;
 	unsigned int node_count = 0;
 	unsigned int triangle_count = 0;
 
-	void populate(const bvh_draft &draft);
-	bool test_ray(const rt::ray &r, rt::ray_hit &hit) const;
+	//! Source triangle of each triangle - SBVH can reference a source triangle from multiple leaves
+	std::vector<unsigned int> source_triangles;
+	unsigned int source_triangle_count = 0;
+
+	int width = 2; //!< Branching factor used by test_ray()
+	bvh_node_format format = bvh_node_format::FULL;
+	std::vector<bvh_node4> nodes4;
+	std::vector<bvh_node8> nodes8;
+	std::vector<bvh_qnode4> qnodes4;
+	std::vector<bvh_qnode8> qnodes8;
+	std::vector<bvh_triangle_block4> blocks4; //!< Leaf triangles of 4-wide nodes
+	std::vector<bvh_triangle_block8> blocks8; //!< Leaf triangles of 8-wide nodes
+	std::vector<unsigned int> parents;        //!< Parent of each binary node
+	std::vector<unsigned int> wide_parents;   //!< Parent of each wide node (either width)
+
+	void populate(const bvh_draft &draft, int width = get_bvh_width(), bvh_node_format format = bvh_node_format::FULL);
+	bool test_ray(const rt::ray &r, rt::ray_hit &hit, float t_max = HUGE_VALF) const;
+	bool test_occlusion(const rt::ray &r, float t_max = HUGE_VALF) const;
+	void test_packet(const rt::ray_packet &packet, rt::ray_packet_hit &hit, int first = 0) const;
+	void test_stream(const rt::ray *rays, rt::ray_hit *hits, int count) const;
+
+private:
+	void collapse(int width, bvh_node_format format);
+	bool test_ray4(const rt::ray &r, rt::ray_hit &hit, float t_max) const;
+	bool test_ray8(const rt::ray &r, rt::ray_hit &hit, float t_max) const;
+	bool test_ray_quantized4(const rt::ray &r, rt::ray_hit &hit, float t_max) const;
+	bool test_ray_quantized8(const rt::ray &r, rt::ray_hit &hit, float t_max) const;
+	bool test_occlusion_wide(const rt::ray &r, float t_max) const;
 };
 
 }
\ No newline at end of file
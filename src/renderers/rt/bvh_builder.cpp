@@ -1,6 +1,6 @@
 #include "bvh_builder.hpp"
 #include <algorithm>
-#include <future>
+#include <atomic>
 #include <tracy/Tracy.hpp>
 #include "aabb.hpp"
 #include "bvh.hpp"
@@ -8,445 +8,850 @@
 #include "scene_cache.hpp"
 #include "../../log.hpp"
 #include "../../async_task.hpp"
+#include "../../task_scheduler.hpp"
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 
 using bu::rt::bvh_draft_node;
 using bu::rt::bvh_draft;
+using bu::rt::bvh_build_params;
+using bu::rt::bvh_build_mode;
+using bu::rt::partition_references;
 
 /**
-	\brief A 'box' used in the partitioning process
+	\brief State shared by all node builds of a single BVH draft build
 */
-struct bvh_box
+struct bvh_build_state
 {
-	glm::vec3 pos;
-	bu::rt::aabb box;
-	unsigned int id;
+	const bu::async_stop_flag *stop_flag;
+	const bvh_build_params *params;
+	const std::vector<const bu::rt::triangle*> *triangles;
+	std::vector<bu::rt::aabb> *bounds;
+	std::vector<glm::vec3> *centroids;
+	std::vector<unsigned int> *ref_triangles;
+	std::vector<unsigned int> *refs;
+	std::vector<bvh_draft_node> *nodes;
+
+	std::atomic<unsigned int> node_count; //!< Number of used nodes
+	std::atomic<unsigned int> ref_count;  //!< Number of used references
+	float root_area;
+	std::atomic<int> split_budget; //!< Number of references spatial splits may still add
 };
 
-static bool partition_boxes_sah(
+/**
+	\brief Computes bounds of referenced boxes
+*/
+static bu::rt::aabb get_references_aabb(const bu::rt::aabb *bounds, const unsigned int *refs, int count)
+{
+	bu::rt::aabb box = bounds[refs[0]];
+	for (int i = 1; i < count; i++)
+		box.add_aabb(bounds[refs[i]]);
+	return box;
+}
+
+/**
+	\brief Returns the number of primitives actually intersected in a leaf of given size
+	- leaves are tested in whole blocks of params.leaf_block_size
+*/
+static inline float get_leaf_size(unsigned int count, const bu::rt::bvh_build_params &params)
+{
+	unsigned int block = std::max(params.leaf_block_size, 1);
+	return (count + block - 1) / block * block;
+}
+
+/**
+	\brief Sorts references along each axis and evaluates SAH for every possible split
+*/
+static int partition_references_sah(
 	const bu::async_stop_flag &stop_flag,
-	std::vector<bvh_box> &input, 
-	std::vector<unsigned int> &left, 
-	std::vector<unsigned int> &right,
-	float cost_intersect = 1,
-	float cost_traversal = 6)
+	const glm::vec3 *centroids,
+	const bu::rt::aabb *bounds,
+	unsigned int *refs,
+	int count,
+	const bvh_build_params &params)
 {
-	if (input.size() < 2)
-		throw std::runtime_error{"partition_boxes_sah() called on less than 2 objects"};
+	if (count < 2)
+		throw std::runtime_error{"partition_references_sah() called on less than 2 objects"};
 
 	ZoneScopedN("Partition BVH");
 
-	auto sort_in_axis = [&](std::vector<bvh_box> &input, float glm::vec3::* axis)
+	auto sort_in_axis = [&](std::vector<unsigned int> &buf, int axis)
 	{
-		// LOG_DEBUG << "sorting...";
 		ZoneScopedN("Sorting AABB");
-		std::sort(input.begin(), input.end(), [axis](auto &a, auto &b)
+		std::sort(buf.begin(), buf.end(), [centroids, axis](auto a, auto b)
 		{
-			return a.pos.*axis < b.pos.*axis;
+			return centroids[a][axis] < centroids[b][axis];
 		});
 	};
 
-	auto find_best_split = [&](const std::vector<bvh_box> &input, float &cost, int &index)
+	auto find_best_split = [&](const std::vector<unsigned int> &buf, float &cost, int &index)
 	{
 		ZoneScopedN("find_best_split()");
 
-		std::vector<glm::vec3> lmin(input.size());
-		std::vector<glm::vec3> lmax(input.size());
-		std::vector<glm::vec3> rmin(input.size());
-		std::vector<glm::vec3> rmax(input.size());
+		std::vector<glm::vec3> lmin(buf.size());
+		std::vector<glm::vec3> lmax(buf.size());
+		std::vector<glm::vec3> rmin(buf.size());
+		std::vector<glm::vec3> rmax(buf.size());
 
-		lmin[0] = input.front().box.min;
-		lmax[0] = input.front().box.max;
-		for (auto i = 1u; i < input.size(); i++)
+		lmin[0] = bounds[buf.front()].min;
+		lmax[0] = bounds[buf.front()].max;
+		for (auto i = 1u; i < buf.size(); i++)
 		{
-			lmin[i] = glm::min(lmin[i - 1], input[i].box.min);
-			lmax[i] = glm::max(lmax[i - 1], input[i].box.max);
+			lmin[i] = glm::min(lmin[i - 1], bounds[buf[i]].min);
+			lmax[i] = glm::max(lmax[i - 1], bounds[buf[i]].max);
 		}
 
-		rmin[0] = input.back().box.min;
-		rmax[0] = input.back().box.max;
-		for (auto i = 1u; i < input.size(); i++)
+		rmin[0] = bounds[buf.back()].min;
+		rmax[0] = bounds[buf.back()].max;
+		for (auto i = 1u; i < buf.size(); i++)
 		{
-			rmin[i] = glm::min(rmin[i - 1], input[input.size() - i - 1].box.min);
-			rmax[i] = glm::max(rmax[i - 1], input[input.size() - i - 1].box.max);
+			rmin[i] = glm::min(rmin[i - 1], bounds[buf[buf.size() - i - 1]].min);
+			rmax[i] = glm::max(rmax[i - 1], bounds[buf[buf.size() - i - 1]].max);
 		}
 
 		index = -1;
 
-		if (input.empty()) return;
-
 		// "Leave as is cost" - number of primitives times intersection cost
 		float sp = bu::rt::aabb{lmin.back(), lmax.back()}.get_area();
-		cost = cost_intersect * lmin.size();
+		cost = params.cost_intersect * get_leaf_size(lmin.size(), params);
 
+		ZoneScopedN("Best split search");
+		for (auto i = 0u; i < buf.size() - 1 && !stop_flag.should_stop(); i++)
 		{
-			ZoneScopedN("Best split search");
-			for (auto i = 0u; i < input.size() - 1 && !stop_flag.should_stop(); i++)
-			{
-				float sl = bu::rt::aabb{lmin[i], lmax[i]}.get_area();
-				float sr = bu::rt::aabb{rmin[rmin.size() - i - 2], rmax[rmin.size() - i - 2]}.get_area();
-				float c = cost_traversal + cost_intersect / sp * (sl * (i + 1) + sr * (rmin.size() - (i + 1)));
-
-				// LOG_DEBUG << "split " << i << " sl=" << sl << " sr=" << sr << " c=" << c << " best=" << cost;
+			float sl = bu::rt::aabb{lmin[i], lmax[i]}.get_area();
+			float sr = bu::rt::aabb{rmin[rmin.size() - i - 2], rmax[rmin.size() - i - 2]}.get_area();
+			float c = params.cost_traversal + params.cost_intersect / sp * (sl * get_leaf_size(i + 1, params) + sr * get_leaf_size(rmin.size() - (i + 1), params));
 
-				if (c < cost)
-				{
-					cost = c;
-					index = i;
-				}
+			if (c < cost)
+			{
+				cost = c;
+				index = i;
 			}
 		}
-
-		// LOG_DEBUG << "best cost " << cost << " index " << index;
 	};
 
-	std::vector<bvh_box> buf_x, buf_y, buf_z;
-	float cx, cy, cz;
-	int ix, iy, iz;
-	int best_index{};
-	std::vector<bvh_box> *best_buf{};
-
-	auto split_x = [
-		sort_in_axis,
-		find_best_split,
-		&stop_flag, input,
-		&buf_x, &cx, &ix]()
-	{
-		ZoneScopedN("X split");
-		buf_x = input;
-		sort_in_axis(buf_x, &glm::vec3::x);
-		if (stop_flag.should_stop()) return;
-		find_best_split(buf_x, cx, ix);
-	};
+	std::vector<unsigned int> bufs[3];
+	float costs[3];
+	int indices[3];
 
-	auto split_y = [
-		sort_in_axis,
-		find_best_split,
-		&stop_flag, input,
-		&buf_y, &cy, &iy]
+	auto split_axis = [&](int axis)
 	{
-		ZoneScopedN("Y split");
-		buf_y = input;
-		sort_in_axis(buf_y, &glm::vec3::y);
+		ZoneScopedN("Axis split");
+		bufs[axis].assign(refs, refs + count);
+		sort_in_axis(bufs[axis], axis);
 		if (stop_flag.should_stop()) return;
-		find_best_split(buf_y, cy, iy);
-	};
-
-	auto split_z = [
-		sort_in_axis,
-		find_best_split,
-		&stop_flag, input,
-		&buf_z, &cz, &iz]
-	{
-		ZoneScopedN("Z split");
-		buf_z = input;
-		sort_in_axis(buf_z, &glm::vec3::z);
-		if (stop_flag.should_stop()) return;
-		find_best_split(buf_z, cz, iz);
+		find_best_split(bufs[axis], costs[axis], indices[axis]);
 	};
 
 	// Depending on number of items to partition
 	// find splits in parallel or sequentially
-	if (input.size() > 10000)
+	if (count >= params.min_parallel_size)
 	{
-		auto fut_x = std::async(std::launch::async, split_x);
-		auto fut_y = std::async(std::launch::async, split_y);
-		split_z();
-		fut_x.wait();
-		fut_y.wait();
+		auto &scheduler = bu::task_scheduler::get();
+		bu::task_group group;
+		scheduler.run(group, [&]{split_axis(0);});
+		scheduler.run(group, [&]{split_axis(1);});
+		split_axis(2);
+		scheduler.wait(group);
 	}
 	else
 	{
-		split_x();
-		if (stop_flag.should_stop()) return false;
-		split_y();
-		if (stop_flag.should_stop()) return false;
-		split_z();
+		for (int axis = 0; axis < 3 && !stop_flag.should_stop(); axis++)
+			split_axis(axis);
 	}
 
-	if (stop_flag.should_stop()) return false;
+	if (stop_flag.should_stop()) return 0;
+
+	int best_axis = 2;
+	if (costs[0] < costs[1] && costs[0] < costs[2])
+		best_axis = 0;
+	else if (costs[1] < costs[0] && costs[1] < costs[2])
+		best_axis = 1;
+
+	if (indices[best_axis] < 0) return 0;
+
+	std::copy(bufs[best_axis].begin(), bufs[best_axis].end(), refs);
+	return indices[best_axis] + 1;
+}
+
+/**
+	\brief A SAH bin - accumulates bounds and number of boxes
 
-	if (cx < cy && cx < cz)
+	With SSE available, bounds are kept in vector registers so merging
+	bins and boxes takes just two instructions.
+*/
+struct bvh_sah_bin
+{
+#ifdef __SSE__
+	__m128 min = _mm_set1_ps(HUGE_VALF);
+	__m128 max = _mm_set1_ps(-HUGE_VALF);
+
+	void add_box(const bu::rt::aabb &box)
 	{
-		best_index = ix;
-		best_buf = &buf_x;
-		buf_y.clear();
-		buf_y.shrink_to_fit();
-		buf_z.clear();
-		buf_z.shrink_to_fit();
+		min = _mm_min_ps(min, _mm_setr_ps(box.min.x, box.min.y, box.min.z, 0.f));
+		max = _mm_max_ps(max, _mm_setr_ps(box.max.x, box.max.y, box.max.z, 0.f));
 	}
-	else if (cy < cx && cy < cz)
-	{
-		best_index = iy;
-		best_buf = &buf_y;
-		buf_x.clear();
-		buf_x.shrink_to_fit();
-		buf_z.clear();
-		buf_z.shrink_to_fit();
+
+	void add_bin(const bvh_sah_bin &bin)
+	{
+		min = _mm_min_ps(min, bin.min);
+		max = _mm_max_ps(max, bin.max);
+		count += bin.count;
 	}
-	else
+
+	float get_area() const
 	{
-		best_index = iz;
-		best_buf = &buf_z;
-		buf_x.clear();
-		buf_x.shrink_to_fit();
-		buf_y.clear();
-		buf_y.shrink_to_fit();
+		alignas(16) float d[4];
+		_mm_store_ps(d, _mm_sub_ps(max, min));
+		return (d[0] * d[1] + d[0] * d[2] + d[1] * d[2]) * 2.f;
 	}
+#else
+	bu::rt::aabb box{glm::vec3{HUGE_VALF}, glm::vec3{-HUGE_VALF}};
 
-	// LOG_DEBUG << "best index is " << best_index;
-	if (best_index < 0) return false;
+	void add_box(const bu::rt::aabb &b)
+	{
+		box.add_aabb(b);
+	}
 
-	for (int i = 0; i < static_cast<int>(best_buf->size()) && !stop_flag.should_stop(); i++)
+	void add_bin(const bvh_sah_bin &bin)
 	{
-		if (i <= best_index)
-			left.push_back((*best_buf)[i].id);
-		else
-			right.push_back((*best_buf)[i].id);
+		box.add_aabb(bin.box);
+		count += bin.count;
 	}
 
-	return !stop_flag.should_stop();
-}
+	float get_area() const
+	{
+		return box.get_area();
+	}
+#endif
+
+	unsigned int count = 0;
+};
+
+/**
+	\brief Binned SAH partitioning
+
+	Centroids of the boxes are assigned to params.bin_count equally sized bins in each axis
+	and SAH is only evaluated on bin boundaries. This makes partitioning O(n) and the
+	references are partitioned in place.
 
-static void partition_triangles(const bu::async_stop_flag *stop_flag, bu::rt::bvh_draft_node *node)
+	Falls back to partition_references_sah() if all centroids are located in the same point
+	and hence cannot be binned.
+*/
+static int partition_references_binned_sah(
+	const bu::async_stop_flag &stop_flag,
+	const glm::vec3 *centroids,
+	const bu::rt::aabb *bounds,
+	unsigned int *refs,
+	int count,
+	const bvh_build_params &params)
 {
-	ZoneScopedN("BVH triangle partitioning");
+	if (count < 2)
+		throw std::runtime_error{"partition_references_binned_sah() called on less than 2 objects"};
+
+	ZoneScopedN("Partition BVH (binned)");
 
-	std::vector<bvh_box> contents(node->triangles.size());
-	for (auto i = 0u; i < node->triangles.size(); i++)
+	const int bin_count = std::max(params.bin_count, 2);
+	const int n = count;
+
+	// Large nodes are processed in chunks in parallel
+	auto &scheduler = bu::task_scheduler::get();
+	const int grain = n >= params.min_parallel_size ? std::max(n / (4 * scheduler.get_thread_count()), 4096) : n;
+	const int chunk_count = (n + grain - 1) / grain;
+
+	// Centroid bounds and the bounds of the entire node
+	std::vector<bu::rt::aabb> chunk_centroid_bounds(chunk_count);
+	std::vector<bu::rt::aabb> chunk_node_bounds(chunk_count);
+	scheduler.parallel_for(0, n, grain, [&](int begin, int end)
 	{
-		auto aabb = bu::rt::triangle_aabb(node->triangles[i]);
-		contents[i] = bvh_box{aabb.get_center(), aabb, i};
-		
-		if (i == 0)
-			node->aabb = aabb;
-		else
-			node->aabb.add_aabb(aabb);
+		auto &cb = chunk_centroid_bounds[begin / grain];
+		auto &nb = chunk_node_bounds[begin / grain];
+		cb = bu::rt::aabb{centroids[refs[begin]], centroids[refs[begin]]};
+		nb = bounds[refs[begin]];
+		for (int i = begin + 1; i < end; i++)
+		{
+			cb.add_point(centroids[refs[i]]);
+			nb.add_aabb(bounds[refs[i]]);
+		}
+	});
+
+	bu::rt::aabb centroid_bounds = chunk_centroid_bounds[0];
+	bu::rt::aabb node_bounds = chunk_node_bounds[0];
+	for (int i = 1; i < chunk_count; i++)
+	{
+		centroid_bounds.add_aabb(chunk_centroid_bounds[i]);
+		node_bounds.add_aabb(chunk_node_bounds[i]);
 	}
 
-	std::vector<unsigned int> l, r;
-	bool should_split = node->triangles.size() > 1 && partition_boxes_sah(*stop_flag, contents, l, r);
-	bool split_valid = !l.empty() && !r.empty();
+	glm::vec3 extent = centroid_bounds.get_dimensions();
+	if (extent.x <= 0 && extent.y <= 0 && extent.z <= 0)
+		return partition_references_sah(stop_flag, centroids, bounds, refs, count, params);
+
+	// Maps position in given axis onto a bin index
+	auto get_bin_index = [&](const glm::vec3 &pos, int axis)
+	{
+		float k = bin_count / extent[axis];
+		int index = (pos[axis] - centroid_bounds.min[axis]) * k;
+		return std::clamp(index, 0, bin_count - 1);
+	};
 
-	if (should_split && split_valid)
+	// Bin all axes in one pass - each chunk fills its own set of bins
+	std::vector<bvh_sah_bin> chunk_bins(chunk_count * 3 * bin_count);
+	scheduler.parallel_for(0, n, grain, [&](int begin, int end)
 	{
-		// LOG_DEBUG << "splitting into " << l.size() + 1 << " and " << r.size() << " triangles";
+		ZoneScopedN("Binning");
+		auto bins = &chunk_bins[(begin / grain) * 3 * bin_count];
+		for (int axis = 0; axis < 3; axis++)
+		{
+			if (extent[axis] <= 0 || stop_flag.should_stop()) continue;
+			for (int i = begin; i < end; i++)
+			{
+				auto &bin = bins[axis * bin_count + get_bin_index(centroids[refs[i]], axis)];
+				bin.add_box(bounds[refs[i]]);
+				bin.count++;
+			}
+		}
+	});
 
-		node->left = std::make_unique<bu::rt::bvh_draft_node>();
-		node->right = std::make_unique<bu::rt::bvh_draft_node>();
+	if (stop_flag.should_stop()) return 0;
 
-		for (auto id : l)
-			node->left->triangles.emplace_back(std::move(node->triangles[id]));
-		
-		for (auto id : r)
-			node->right->triangles.emplace_back(std::move(node->triangles[id]));
+	// Merge bins from all chunks
+	std::vector<bvh_sah_bin> bins(chunk_bins.begin(), chunk_bins.begin() + 3 * bin_count);
+	for (int c = 1; c < chunk_count; c++)
+		for (int i = 0; i < 3 * bin_count; i++)
+			bins[i].add_bin(chunk_bins[c * 3 * bin_count + i]);
 
-		node->triangles.clear();
-		node->triangles.shrink_to_fit();
+	// "Leave as is cost" - number of primitives times intersection cost
+	const float sp = node_bounds.get_area();
+	float best_cost = params.cost_intersect * get_leaf_size(n, params);
+	int best_axis = -1;
+	int best_bin = -1;
+
+	std::vector<float> right_area(bin_count);
+	std::vector<unsigned int> right_count(bin_count);
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		if (extent[axis] <= 0) continue;
+		auto axis_bins = &bins[axis * bin_count];
+
+		// Sweep from the right - right_*[i] describe bins i..bin_count-1
+		bvh_sah_bin acc;
+		for (int i = bin_count - 1; i > 0; i--)
+		{
+			acc.add_bin(axis_bins[i]);
+			right_area[i] = acc.count ? acc.get_area() : 0.f;
+			right_count[i] = acc.count;
+		}
+
+		// Sweep from the left and evaluate split after bin i
+		acc = bvh_sah_bin{};
+		for (int i = 0; i < bin_count - 1; i++)
+		{
+			acc.add_bin(axis_bins[i]);
+			unsigned int nl = acc.count;
+			unsigned int nr = right_count[i + 1];
+			if (!nl || !nr) continue;
+
+			float c = params.cost_traversal + params.cost_intersect / sp * (acc.get_area() * get_leaf_size(nl, params) + right_area[i + 1] * get_leaf_size(nr, params));
+			if (c < best_cost)
+			{
+				best_cost = c;
+				best_axis = axis;
+				best_bin = i;
+			}
+		}
 	}
+
+	if (stop_flag.should_stop() || best_axis < 0) return 0;
+
+	auto mid = std::partition(refs, refs + count, [&](unsigned int r)
+	{
+		return get_bin_index(centroids[r], best_axis) <= best_bin;
+	});
+
+	return mid - refs;
 }
 
 /**
-	\returns true if the the meshes in this node should be dissolved
+	\brief Partitions references using the method selected in build parameters
+
+	The referenced boxes are reordered in place, so that the ones
+	belonging to the left child come first.
+
+	\returns number of references in the left child or 0 if the node should not be split
 */
-static bool partition_meshes(const bu::async_stop_flag *stop_flag, bu::rt::bvh_draft_node *node)
+int bu::rt::partition_references(
+	const bu::async_stop_flag &stop_flag,
+	const glm::vec3 *centroids,
+	const rt::aabb *bounds,
+	unsigned int *refs,
+	int count,
+	const bvh_build_params &params)
 {
-	ZoneScopedN("BVH mesh partitioning");
-
-	std::vector<bvh_box> contents(node->meshes.size());
-	for (auto i = 0u; i < node->meshes.size(); i++)
+	switch (params.mode)
 	{
-		auto aabb = node->meshes[i]->aabb;
-		contents[i] = bvh_box{aabb.get_center(), aabb, i};
-		
-		if (i == 0)
-			node->aabb = node->meshes[i]->aabb;
-		else
-			node->aabb.add_aabb(node->meshes[i]->aabb);
+		case bvh_build_mode::SWEEP_SAH:
+			return partition_references_sah(stop_flag, centroids, bounds, refs, count, params);
+
+		default:
+		case bvh_build_mode::BINNED_SAH:
+			return partition_references_binned_sah(stop_flag, centroids, bounds, refs, count, params);
 	}
+}
 
-	std::vector<unsigned int> l, r;
-	bool should_split = node->meshes.size() > 1 && partition_boxes_sah(*stop_flag, contents, l, r);
-	bool split_valid = !l.empty() && !r.empty();
+/**
+	\brief Computes bounds of the part of the triangle between two planes perpendicular
+	to the given axis. The result is also limited to the current reference bounds.
+
+	If the triangle doesn't intersect the slab, the returned box is invalid (min > max).
+*/
+static bu::rt::aabb clip_triangle_bounds(const bu::rt::triangle &t, int axis, float lo, float hi, const bu::rt::aabb &bounds)
+{
+	bu::rt::aabb box{glm::vec3{HUGE_VALF}, glm::vec3{-HUGE_VALF}};
 
-	if (should_split && split_valid)
+	for (int i = 0; i < 3; i++)
 	{
-		// LOG_DEBUG << "splitting into " << l.size() + 1 << " and " << r.size() << " meshes";
-		node->left = std::make_unique<bu::rt::bvh_draft_node>();
-		node->right = std::make_unique<bu::rt::bvh_draft_node>();
+		const auto &a = t.vertices[i];
+		const auto &b = t.vertices[(i + 1) % 3];
+		float pa = a[axis];
+		float pb = b[axis];
 
-		for (auto id : l)
-			node->left->meshes.emplace_back(std::move(node->meshes[id]));
-		
-		for (auto id : r)
-			node->right->meshes.emplace_back(std::move(node->meshes[id]));
+		if (pa >= lo && pa <= hi)
+			box.add_point(a);
 
-		node->meshes.clear();
-		node->meshes.shrink_to_fit();
+		// Points where the edge crosses the planes
+		for (float plane : {lo, hi})
+			if ((pa < plane && pb > plane) || (pa > plane && pb < plane))
+			{
+				glm::vec3 p = a + (b - a) * ((plane - pa) / (pb - pa));
+				p[axis] = plane;
+				box.add_point(p);
+			}
 	}
 
-	return !should_split || !split_valid;
+	box.min = glm::max(box.min, bounds.min);
+	box.max = glm::min(box.max, bounds.max);
+	return box;
+}
+
+static bool is_valid_aabb(const bu::rt::aabb &box)
+{
+	return box.min.x <= box.max.x && box.min.y <= box.max.y && box.min.z <= box.max.z;
 }
 
 /**
-	Recursively processes BVH nodes.
+	\brief Bin used for evaluating spatial splits
+*/
+struct bvh_spatial_bin
+{
+	bu::rt::aabb box{glm::vec3{HUGE_VALF}, glm::vec3{-HUGE_VALF}};
+	int entries = 0; //!< Number of references starting in this bin
+	int exits = 0;   //!< Number of references ending in this bin
+};
 
-	Nodes containing multiple meshes are partitioned and can be split up. If splitting
-	is infeasible the, the meshes are dissolved into triangles.
+/**
+	\brief Considers splitting the node with a plane instead of partitioning the triangles.
+	Triangles straddling the plane are referenced by both children with clipped bounds.
+
+	Spatial splits are only evaluated if the children of the object split overlap
+	significantly, and only as long as the duplication budget lasts. The children
+	must fit into the capacity reserved for the node in the reference array.
 
-	Nodes containing triangles are recursively partitioned too.
+	On input, nl and nr describe the object split. If the spatial split is performed,
+	they are updated and the references are rewritten.
 
-	\todo Split this into more functions
+	\note Based on: Stich et al., "Spatial Splits in Bounding Volume Hierarchies" (2009)
+	\returns true if the spatial split is cheaper than the object split and has been performed
 */
-bool process_bvh_node(const bu::async_stop_flag *stop_flag, bu::rt::bvh_draft_node *node, int depth = 0)
+static bool try_spatial_split(
+	bvh_build_state &state,
+	const bu::rt::aabb &node_bounds,
+	unsigned int begin,
+	unsigned int capacity,
+	unsigned int &nl,
+	unsigned int &nr)
 {
-	if (!node) return false;
-	ZoneScopedN("BVH node processing");
-	// LOG_DEBUG << "Processing BVH node...";
+	const auto &params = *state.params;
+	const auto &triangles = *state.triangles;
+	auto &bounds = *state.bounds;
+	auto &centroids = *state.centroids;
+	auto &ref_triangles = *state.ref_triangles;
+	auto refs = state.refs->data() + begin;
+	const unsigned int n = nl + nr;
+
+	if (state.split_budget <= 0 || state.root_area <= 0)
+		return false;
+
+	// Cost of the object split and the overlap of its children
+	auto lb = get_references_aabb(bounds.data(), refs, nl);
+	auto rb = get_references_aabb(bounds.data(), refs + nl, nr);
+	float best_cost = lb.get_area() * nl + rb.get_area() * nr;
+
+	bu::rt::aabb overlap{glm::max(lb.min, rb.min), glm::min(lb.max, rb.max)};
+	if (!is_valid_aabb(overlap) || overlap.get_area() / state.root_area < params.sbvh_min_overlap)
+		return false;
+
+	ZoneScopedN("BVH spatial split");
 
-	/*
-		Dissolve nodes where AABBs of all meshes have surface area greater than
-		the entire model's AABB. Dissolve nodes containing single meshes too.
-	*/
-	if (!node->meshes.empty())
+	// Find the best plane on bin boundaries
+	const int bin_count = std::max(params.sbvh_bin_count, 2);
+	int best_axis = -1;
+	float best_plane = 0;
+
+	for (int axis = 0; axis < 3; axis++)
 	{
-		bu::rt::aabb_collection col;
-		float total_surf = 0;
+		float lo = node_bounds.min[axis];
+		float bin_size = (node_bounds.max[axis] - lo) / bin_count;
+		if (!(bin_size > 0)) continue;
 
-		for (auto &mesh : node->meshes)
+		auto get_bin = [&](float x)
 		{
-			col.add(mesh->aabb);
-			total_surf = mesh->aabb.get_area();
+			return std::clamp(static_cast<int>((x - lo) / bin_size), 0, bin_count - 1);
+		};
+
+		std::vector<bvh_spatial_bin> bins(bin_count);
+		for (unsigned int i = 0; i < n; i++)
+		{
+			const auto &b = bounds[refs[i]];
+			int first = get_bin(b.min[axis]);
+			int last = std::max(get_bin(b.max[axis]), first);
+			bins[first].entries++;
+			bins[last].exits++;
+
+			if (first == last)
+			{
+				bins[first].box.add_aabb(b);
+				continue;
+			}
+
+			const auto &t = *triangles[ref_triangles[refs[i]]];
+			for (int k = first; k <= last; k++)
+			{
+				auto clipped = clip_triangle_bounds(t, axis, lo + k * bin_size, lo + (k + 1) * bin_size, b);
+				if (is_valid_aabb(clipped))
+					bins[k].box.add_aabb(clipped);
+			}
 		}
-		
-		if (col.get_aabb().get_area() <= total_surf || node->meshes.size() == 1) 
-			node->dissolve_meshes();
-	}
 
-	if (!node->triangles.empty() && !node->meshes.empty()) 
-	{
-		LOG_ERROR << "BVH node with both meshes and triangles!";
-		throw std::runtime_error("BVH node with both meshes and triangles encountered!");
+		// Sweep from the right, then from the left
+		std::vector<float> right_area(bin_count);
+		std::vector<int> right_count(bin_count);
+		bvh_spatial_bin acc;
+		for (int k = bin_count - 1; k > 0; k--)
+		{
+			acc.box.add_aabb(bins[k].box);
+			acc.exits += bins[k].exits;
+			right_area[k] = is_valid_aabb(acc.box) ? acc.box.get_area() : 0;
+			right_count[k] = acc.exits;
+		}
+
+		acc = bvh_spatial_bin{};
+		for (int k = 0; k < bin_count - 1; k++)
+		{
+			acc.box.add_aabb(bins[k].box);
+			acc.entries += bins[k].entries;
+			if (!acc.entries || !right_count[k + 1]) continue;
+
+			float cost = acc.box.get_area() * acc.entries + right_area[k + 1] * right_count[k + 1];
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = axis;
+				best_plane = lo + (k + 1) * bin_size;
+			}
+		}
 	}
-	else if (!node->triangles.empty()) // Has triangles - partition triangles
+
+	if (best_axis < 0)
+		return false;
+
+	// Classify references - the straddling ones get clipped bounds for each side
+	struct straddling_ref
 	{
-		partition_triangles(stop_flag, node);
-	}
-	else if (!node->meshes.empty()) // Has meshes - try to partition them
+		unsigned int ref;
+		bu::rt::aabb left, right;
+	};
+
+	std::vector<unsigned int> left_refs, right_refs;
+	std::vector<straddling_ref> straddling;
+	unsigned int new_left = 0, new_right = 0;
+	for (unsigned int i = 0; i < n; i++)
 	{
-		// If splitting fails, dissolve meshes
-		if (partition_meshes(stop_flag, node))
+		const auto &b = bounds[refs[i]];
+		if (b.max[best_axis] <= best_plane)
+			left_refs.push_back(refs[i]);
+		else if (b.min[best_axis] >= best_plane)
+			right_refs.push_back(refs[i]);
+		else
 		{
-			node->dissolve_meshes();
-			return !stop_flag->should_stop() && process_bvh_node(stop_flag, node, depth);
+			const auto &t = *triangles[ref_triangles[refs[i]]];
+			auto &s = straddling.emplace_back(straddling_ref{
+				refs[i],
+				clip_triangle_bounds(t, best_axis, -HUGE_VALF, best_plane, b),
+				clip_triangle_bounds(t, best_axis, best_plane, HUGE_VALF, b)});
+			new_left += is_valid_aabb(s.left);
+			new_right += is_valid_aabb(s.right);
 		}
 	}
-	else // Empty node
-	{
-		return false;
-	}
 
-	// Bail out if requested
-	if (stop_flag->should_stop())
+	// Check the space and the budget
+	unsigned int total_left = left_refs.size() + new_left;
+	unsigned int total_right = right_refs.size() + new_right;
+	int duplicates = total_left + total_right - n;
+	if (!total_left || !total_right || total_left + total_right > capacity)
 		return false;
 
-	/*
-		Partition recursively and asynchronously on the first 4 levels.
-	*/
-	if (depth < 4)
+	if (state.split_budget.fetch_sub(duplicates) < duplicates)
 	{
-		auto async_policy = std::launch::async;
-
-		std::future<bool> lfut;
-		if (node->left) lfut = std::async(async_policy, process_bvh_node, stop_flag, node->left.get(), depth + 1);
-		if (node->right) process_bvh_node(stop_flag, node->right.get(), depth + 1);
-		if (node->left) lfut.wait();
+		state.split_budget += duplicates;
+		return false;
 	}
-	else
+
+	// Update the straddling references - the right side gets a new one if both sides are valid
+	for (const auto &s : straddling)
 	{
-		if (node->left) process_bvh_node(stop_flag, node->left.get(), depth + 1);
-		if (node->right) process_bvh_node(stop_flag, node->right.get(), depth + 1);
+		bool valid_left = is_valid_aabb(s.left);
+		bool valid_right = is_valid_aabb(s.right);
+		unsigned int right_ref = s.ref;
+
+		if (valid_left)
+		{
+			bounds[s.ref] = s.left;
+			centroids[s.ref] = s.left.get_center();
+			left_refs.push_back(s.ref);
+			if (valid_right)
+			{
+				right_ref = state.ref_count++;
+				ref_triangles[right_ref] = ref_triangles[s.ref];
+			}
+		}
+
+		if (valid_right)
+		{
+			bounds[right_ref] = s.right;
+			centroids[right_ref] = s.right.get_center();
+			right_refs.push_back(right_ref);
+		}
 	}
 
+	std::copy(left_refs.begin(), left_refs.end(), refs);
+	std::copy(right_refs.begin(), right_refs.end(), refs + left_refs.size());
+	nl = left_refs.size();
+	nr = right_refs.size();
 	return true;
 }
 
-void bvh_draft_node::dissolve_meshes()
-{
-	ZoneScopedN("BVH meshes dissolve");
-	for (auto &mesh : meshes)
-		std::copy(mesh->triangles.begin(), mesh->triangles.end(), std::back_insert_iterator(triangles));
-	meshes.clear();
-	meshes.shrink_to_fit();
-}
+/**
+	Recursively processes BVH nodes.
 
-std::vector<bu::rt::aabb> bu::rt::bvh_draft::get_tree_aabbs() const
+	The node owns references [begin, begin + count) and may use the reference array up
+	to begin + capacity. The extra space is only reserved for spatial splits (SBVH) and
+	is distributed between the children proportionally to their sizes.
+
+	Children with large enough subtrees are processed as separate tasks on the global
+	task_scheduler, so the work is split at any depth and idle workers steal it.
+*/
+static void process_bvh_node(bvh_build_state *state, unsigned int node_id, unsigned int begin, unsigned int count, unsigned int capacity)
 {
-	std::vector<aabb> aabbs;
+	ZoneScopedN("BVH node processing");
+
+	const auto &params = *state->params;
+	auto &scheduler = bu::task_scheduler::get();
+	auto &node = (*state->nodes)[node_id];
+	auto refs = state->refs->data() + begin;
+	auto bounds = state->bounds->data();
 
-	std::stack<bu::rt::bvh_draft_node*> node_stack;
-	node_stack.push(m_root_node.get());
-	while (!node_stack.empty())
+	// Compute node bounds - in parallel for large nodes
+	if (static_cast<int>(count) >= params.min_parallel_size)
 	{
-		auto node = node_stack.top();
-		node_stack.pop();
+		const int grain = std::max<int>(count / (4 * scheduler.get_thread_count()), 4096);
+		std::vector<bu::rt::aabb> chunk_bounds((count + grain - 1) / grain);
+		scheduler.parallel_for(0, count, grain, [&](int b, int e)
+		{
+			chunk_bounds[b / grain] = get_references_aabb(bounds, refs + b, e - b);
+		});
 
-		if (!node) continue;
+		node.aabb = chunk_bounds[0];
+		for (const auto &cb : chunk_bounds)
+			node.aabb.add_aabb(cb);
+	}
+	else
+		node.aabb = get_references_aabb(bounds, refs, count);
 
-		if (node->meshes.size() && node->triangles.size())
-			LOG_ERROR << "get_tree_aabbs() found node with meshes and triangles";
+	unsigned int nl = count > 1 ? partition_references(*state->stop_flag, state->centroids->data(), bounds, refs, count, params) : 0;
+	unsigned int nr = count - nl;
 
-		aabbs.push_back(node->aabb);
-		node_stack.push(node->left.get());
-		node_stack.push(node->right.get());
+	// Bail out if requested
+	if (!nl || !nr || state->stop_flag->should_stop())
+	{
+		node.first = begin;
+		node.count = count;
+		return;
 	}
 
-	return aabbs;
-}
+	if (params.mode == bvh_build_mode::SBVH)
+		try_spatial_split(*state, node.aabb, begin, capacity, nl, nr);
 
-const bvh_draft_node &bvh_draft::get_root_node() const
-{
-	return *m_root_node;
+	// Distribute the free space between the children and move the right one if necessary
+	unsigned int slack = capacity - nl - nr;
+	unsigned int capacity_l = nl + static_cast<unsigned int>(static_cast<std::uint64_t>(slack) * nl / (nl + nr));
+	unsigned int capacity_r = capacity - capacity_l;
+	if (capacity_l != nl)
+		std::copy_backward(refs + nl, refs + nl + nr, refs + capacity_l + nr);
+
+	unsigned int children = state->node_count.fetch_add(2);
+	node.left = children;
+	node.right = children + 1;
+
+	bu::task_group group;
+	if (static_cast<int>(nl) >= params.min_task_size)
+		scheduler.run(group, [=]{process_bvh_node(state, children, begin, nl, capacity_l);});
+	else
+		process_bvh_node(state, children, begin, nl, capacity_l);
+
+	process_bvh_node(state, children + 1, begin + capacity_l, nr, capacity_r);
+	scheduler.wait(group);
 }
 
-int bvh_draft_node::height() const
+std::vector<bu::rt::aabb> bu::rt::bvh_draft::get_tree_aabbs() const
 {
-	int hl = 0, hr = 0;
-	if (left) hl = left->height();
-	if (right) hr = right->height();
-	return 1 + std::max(hl, hr);
+	std::vector<aabb> aabbs;
+	aabbs.reserve(m_nodes.size());
+	for (const auto &node : m_nodes)
+		aabbs.push_back(node.aabb);
+	return aabbs;
 }
 
 int bvh_draft::get_height() const
 {
-	return get_root_node().height();
+	std::vector<std::pair<unsigned int, int>> st{{0, 1}};
+	int height = 0;
+
+	while (!st.empty())
+	{
+		auto [id, depth] = st.back();
+		st.pop_back();
+
+		height = std::max(height, depth);
+		if (!m_nodes[id].is_leaf())
+		{
+			st.push_back({m_nodes[id].left, depth + 1});
+			st.push_back({m_nodes[id].right, depth + 1});
+		}
+	}
+
+	return height;
 }
 
+/**
+	\returns number of triangle references in leaves - triangles split by SBVH are counted multiple times
+*/
 int bvh_draft::get_triangle_count() const
 {
 	int n = 0;
-	std::stack<bvh_draft_node*> st;
-	st.push(m_root_node.get());
+	for (const auto &node : m_nodes)
+		if (node.is_leaf())
+			n += node.count;
+	return n;
+}
 
-	while (!st.empty())
+/**
+	\brief Computes SAH cost of the whole tree relative to the root node surface area
+*/
+float bvh_draft::get_sah_cost() const
+{
+	float root_area = m_nodes[0].aabb.get_area();
+	if (root_area <= 0) return 0;
+
+	float cost = 0;
+	for (const auto &node : m_nodes)
 	{
-		auto node_ptr = st.top();
-		st.pop();
-		n += node_ptr->triangles.size();
-		if (node_ptr->left) st.push(node_ptr->left.get());
-		if (node_ptr->right) st.push(node_ptr->right.get());
+		float p = node.aabb.get_area() / root_area;
+		if (!node.is_leaf())
+			cost += m_params.cost_traversal * p;
+		else
+			cost += m_params.cost_intersect * p * get_leaf_size(node.count, m_params);
 	}
 
-	return n;
+	return cost;
 }
 
-void bvh_draft::build(const scene_cache &cache, const bu::async_stop_flag &stop_flag)
+void bvh_draft::build(
+	const std::vector<std::shared_ptr<const scene_cache_mesh>> &meshes,
+	const bu::async_stop_flag &stop_flag,
+	const bvh_build_params &params)
 {
 	ZoneScopedN("BVH draft build");
 
-	m_root_node = std::make_unique<bu::rt::bvh_draft_node>();
-	for (const auto &[id, mesh] : cache.get_meshes())
-		if (mesh->visible && !mesh->triangles.empty())
-			m_root_node->meshes.push_back(mesh);
+	m_params = params;
+	m_meshes.clear();
+	m_triangles.clear();
+	for (const auto &mesh : meshes)
+	{
+		if (mesh->triangles.empty()) continue;
+		m_meshes.push_back(mesh);
+		for (const auto &t : mesh->triangles)
+			m_triangles.push_back(&t);
+	}
+
+	// Reserve space for the references added by spatial splits
+	const unsigned int n = m_triangles.size();
+	const int split_budget = m_params.mode == bvh_build_mode::SBVH ? static_cast<int>(m_params.sbvh_max_duplication * n) : 0;
+	const unsigned int capacity = n + split_budget;
+
+	m_bounds.resize(capacity);
+	m_centroids.resize(capacity);
+	m_ref_triangles.resize(capacity);
+	m_refs.resize(capacity);
+	m_nodes.assign(std::max(2 * capacity, 1u), bvh_draft_node{});
+
+	{
+		ZoneScopedN("Reference bounds");
+		const int grain = std::max(m_params.min_parallel_size / 4, 1024);
+		bu::task_scheduler::get().parallel_for(0, n, grain, [&](int begin, int end)
+		{
+			for (int i = begin; i < end; i++)
+			{
+				m_bounds[i] = bu::rt::triangle_aabb(*m_triangles[i]);
+				m_centroids[i] = m_bounds[i].get_center();
+				m_ref_triangles[i] = i;
+				m_refs[i] = i;
+			}
+		});
+	}
+
+	if (!n)
+	{
+		m_nodes.resize(1);
+		return;
+	}
+
+	if (m_params.mode == bvh_build_mode::LBVH)
+	{
+		build_lbvh(stop_flag);
+		return;
+	}
 
-	process_bvh_node(&stop_flag, m_root_node.get());
+	bvh_build_state state{
+		&stop_flag,
+		&m_params,
+		&m_triangles,
+		&m_bounds,
+		&m_centroids,
+		&m_ref_triangles,
+		&m_refs,
+		&m_nodes,
+		1,
+		n,
+		0,
+		split_budget};
+
+	// Spatial splits are compared against the root area
+	state.root_area = get_references_aabb(m_bounds.data(), m_refs.data(), n).get_area();
+
+	process_bvh_node(&state, 0, 0, n, capacity);
+	m_nodes.resize(state.node_count);
 }
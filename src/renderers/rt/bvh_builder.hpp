@@ -4,6 +4,7 @@
 #include "../../async_task.hpp"
 #include "../../scene.hpp"
 #include "aabb.hpp"
+#include "bvh_types.hpp"
 
 namespace bu::rt {
 class scene_cache;
@@ -12,31 +13,98 @@ struct scene_cache_mesh;
 /**
 	\brief Node of the BVH tree draft
 
-	Can either contain references to bvh_builder_mesh or triangles.
-	dissolve_meshes() transforms referenced meshes to triangles.
+	Nodes are stored in a single array owned by bvh_draft. Leaves reference
+	a contiguous range of the draft's reference array.
 */
 struct bvh_draft_node
 {
-	void dissolve_meshes();
-	int height() const;
-	
+	bool is_leaf() const {return !left;}
+
 	rt::aabb aabb;
-	std::unique_ptr<bvh_draft_node> left, right;
-	std::vector<std::shared_ptr<const scene_cache_mesh>> meshes;
-	std::vector<rt::triangle> triangles;
+	unsigned int left = 0;  //!< Index of the left child - 0 in leaves, since the root is never a child
+	unsigned int right = 0; //!< Index of the right child
+	unsigned int first = 0; //!< First reference of a leaf
+	unsigned int count = 0; //!< Number of references in a leaf
 };
 
+/**
+	\brief Parameters of the BVH draft build
+*/
+struct bvh_build_params
+{
+	bvh_build_mode mode = bvh_build_mode::BINNED_SAH;
+	int bin_count = 32;        //!< Number of bins per axis used by BINNED_SAH
+	float cost_intersect = 1;  //!< SAH cost of intersecting a single primitive
+	float cost_traversal = 6;  //!< SAH cost of traversing a node
+	int leaf_block_size = 1;   //!< Leaves are intersected in blocks of this many triangles (SIMD width) - SAH rounds leaf sizes up to a multiple of it
+	int min_task_size = 1024;       //!< Smaller subtrees are built without spawning new tasks
+	int min_parallel_size = 65536;  //!< Larger nodes are partitioned in parallel
+	int lbvh_leaf_size = 4;         //!< Maximum number of triangles in LBVH leaves
+	int morton_bits = 0;            //!< Morton code length in LBVH mode (30 or 63, 0 for automatic)
+	int sbvh_bin_count = 16;           //!< Number of bins per axis used for spatial splits (SBVH)
+	float sbvh_max_duplication = 0.3f; //!< Number of extra references SBVH can create, relative to the triangle count
+	float sbvh_min_overlap = 1e-5f;    //!< Spatial splits are only considered if object split children overlap more than this (relative to root area)
+};
+
+int partition_references(
+	const bu::async_stop_flag &stop_flag,
+	const glm::vec3 *centroids,
+	const rt::aabb *bounds,
+	unsigned int *refs,
+	int count,
+	const bvh_build_params &params);
+
+/**
+	\brief BVH draft - built from the meshes and then used to populate a bvh_tree
+
+	Triangles are never copied during the build. Every triangle gets a reference with
+	precomputed bounds and centroid and the partitioning only permutes the reference
+	array in place. Spatial splits (SBVH) can add references with clipped bounds.
+*/
 class bvh_draft
 {
 public:
-	void build(const scene_cache &cache, const bu::async_stop_flag &stop_flag);
+	void build(
+		const std::vector<std::shared_ptr<const scene_cache_mesh>> &meshes,
+		const bu::async_stop_flag &stop_flag,
+		const bvh_build_params &params = {});
 	std::vector<rt::aabb> get_tree_aabbs() const;
-	const bvh_draft_node &get_root_node() const;
+	const std::vector<bvh_draft_node> &get_nodes() const {return m_nodes;}
 	int get_height() const;
+	unsigned int get_node_count() const {return m_nodes.size();}
 	int get_triangle_count() const;
+	float get_sah_cost() const;
+	const bvh_build_params &get_params() const {return m_params;}
+
+	/**
+		\brief Returns triangle referenced by given element of the reference array
+	*/
+	const rt::triangle &get_reference_triangle(unsigned int index) const
+	{
+		return *m_triangles[m_ref_triangles[m_refs[index]]];
+	}
+
+	/**
+		\brief Returns index of the source triangle referenced by given element of the reference array
+	*/
+	unsigned int get_reference_source(unsigned int index) const
+	{
+		return m_ref_triangles[m_refs[index]];
+	}
+
+	unsigned int get_source_triangle_count() const {return m_triangles.size();}
 
 private:
-	std::unique_ptr<bvh_draft_node> m_root_node ;
+	void build_lbvh(const bu::async_stop_flag &stop_flag);
+
+	std::vector<std::shared_ptr<const scene_cache_mesh>> m_meshes; //!< Keep the referenced triangles alive
+	std::vector<const rt::triangle*> m_triangles;
+	std::vector<rt::aabb> m_bounds;            //!< Bounds of each reference - clipped in SBVH mode
+	std::vector<glm::vec3> m_centroids;        //!< Centers of the reference bounds
+	std::vector<unsigned int> m_ref_triangles; //!< Triangle index of each reference
+	std::vector<unsigned int> m_refs;          //!< Reference indices - permuted during the build
+	std::vector<bvh_draft_node> m_nodes;       //!< All nodes - the root is the first one
+	bvh_build_params m_params;
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,287 @@
+#include "bvh_builder.hpp"
+#include <atomic>
+#include <cstdint>
+#include <tracy/Tracy.hpp>
+#include "aabb.hpp"
+#include "scene_cache.hpp"
+#include "../../task_scheduler.hpp"
+
+using bu::rt::bvh_draft;
+using bu::rt::bvh_draft_node;
+using bu::rt::bvh_build_params;
+
+/**
+	\brief Inserts two zero bits between each of the 10 lower bits of x
+*/
+static std::uint32_t expand_bits(std::uint32_t x)
+{
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x030000ff;
+	x = (x | (x << 8)) & 0x0300f00f;
+	x = (x | (x << 4)) & 0x030c30c3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+/**
+	\brief Inserts two zero bits between each of the 21 lower bits of x
+*/
+static std::uint64_t expand_bits(std::uint64_t x)
+{
+	x &= 0x1fffff;
+	x = (x | (x << 32)) & 0x001f00000000ffffull;
+	x = (x | (x << 16)) & 0x001f0000ff0000ffull;
+	x = (x | (x << 8)) & 0x100f00f00f00f00full;
+	x = (x | (x << 4)) & 0x10c30c30c30c30c3ull;
+	x = (x | (x << 2)) & 0x1249249249249249ull;
+	return x;
+}
+
+/**
+	\brief Computes 30-bit or 63-bit Morton code of a point in the unit cube
+*/
+template <typename T>
+static T morton_code(const glm::vec3 &p)
+{
+	constexpr int bits = sizeof(T) == 4 ? 10 : 21;
+	constexpr float scale = 1 << bits;
+	glm::vec3 q = glm::clamp(p * scale, 0.f, scale - 1.f);
+	return (expand_bits(T(q.x)) << 2) | (expand_bits(T(q.y)) << 1) | expand_bits(T(q.z));
+}
+
+template <typename T>
+static int count_leading_zeros(T x)
+{
+	if constexpr (sizeof(T) == 4)
+		return x ? __builtin_clz(x) : 32;
+	else
+		return x ? __builtin_clzll(x) : 64;
+}
+
+/**
+	\brief Parallel LSD radix sort of keys and corresponding values (8 bits per pass)
+
+	Every chunk of the input builds its own digit histogram, so the scatter
+	can be done in parallel and the sort stays stable.
+*/
+template <typename K>
+static void radix_sort(std::vector<K> &keys, std::vector<unsigned int> &values, int key_bits, int grain)
+{
+	ZoneScopedN("Radix sort");
+
+	auto &scheduler = bu::task_scheduler::get();
+	const int n = keys.size();
+	const int chunk_count = std::max((n + grain - 1) / grain, 1);
+	const int passes = (key_bits + 7) / 8;
+
+	std::vector<K> keys_tmp(n);
+	std::vector<unsigned int> values_tmp(n);
+	std::vector<unsigned int> offsets(chunk_count * 256);
+
+	for (int pass = 0; pass < passes; pass++)
+	{
+		const int shift = pass * 8;
+		std::fill(offsets.begin(), offsets.end(), 0);
+
+		// Histograms
+		scheduler.parallel_for(0, n, grain, [&](int begin, int end)
+		{
+			auto hist = &offsets[(begin / grain) * 256];
+			for (int i = begin; i < end; i++)
+				hist[(keys[i] >> shift) & 0xff]++;
+		});
+
+		// Exclusive prefix sum - digit-major, chunk-minor
+		unsigned int sum = 0;
+		for (int d = 0; d < 256; d++)
+			for (int c = 0; c < chunk_count; c++)
+			{
+				unsigned int count = offsets[c * 256 + d];
+				offsets[c * 256 + d] = sum;
+				sum += count;
+			}
+
+		// Scatter
+		scheduler.parallel_for(0, n, grain, [&](int begin, int end)
+		{
+			auto offs = &offsets[(begin / grain) * 256];
+			for (int i = begin; i < end; i++)
+			{
+				auto dest = offs[(keys[i] >> shift) & 0xff]++;
+				keys_tmp[dest] = keys[i];
+				values_tmp[dest] = values[i];
+			}
+		});
+
+		keys.swap(keys_tmp);
+		values.swap(values_tmp);
+	}
+}
+
+/**
+	\brief Data shared by all LBVH node builds
+*/
+template <typename K>
+struct lbvh_context
+{
+	const bu::async_stop_flag &stop_flag;
+	const bvh_build_params &params;
+	const std::vector<bu::rt::aabb> &bounds;
+	const std::vector<unsigned int> &refs;
+	const std::vector<K> &keys;
+	std::vector<bvh_draft_node> &nodes;
+	std::atomic<unsigned int> &node_count;
+};
+
+/**
+	\brief Finds the last primitive sharing the longest common Morton code prefix with the first one
+*/
+template <typename K>
+static int find_lbvh_split(const std::vector<K> &keys, int first, int last)
+{
+	K first_key = keys[first];
+	K last_key = keys[last];
+
+	// Identical codes - split in the middle
+	if (first_key == last_key)
+		return (first + last) / 2;
+
+	int common_prefix = count_leading_zeros(first_key ^ last_key);
+
+	// Binary search for the highest object sharing more than common_prefix bits with the first one
+	int split = first;
+	int step = last - first;
+	do
+	{
+		step = (step + 1) >> 1;
+		int new_split = split + step;
+		if (new_split < last && count_leading_zeros(first_key ^ keys[new_split]) > common_prefix)
+			split = new_split;
+	}
+	while (step > 1);
+
+	return split;
+}
+
+/**
+	\brief Recursively builds LBVH nodes for sorted references in range [first, last]
+*/
+template <typename K>
+static void build_lbvh_node(const lbvh_context<K> &ctx, unsigned int node_id, int first, int last)
+{
+	auto &node = ctx.nodes[node_id];
+	int count = last - first + 1;
+	if (count <= std::max({ctx.params.lbvh_leaf_size, ctx.params.leaf_block_size, 1}) || ctx.stop_flag.should_stop())
+	{
+		node.first = first;
+		node.count = count;
+		node.aabb = ctx.bounds[ctx.refs[first]];
+		for (int i = first + 1; i <= last; i++)
+			node.aabb.add_aabb(ctx.bounds[ctx.refs[i]]);
+		return;
+	}
+
+	int split = find_lbvh_split(ctx.keys, first, last);
+	unsigned int children = ctx.node_count.fetch_add(2);
+	node.left = children;
+	node.right = children + 1;
+
+	auto &scheduler = bu::task_scheduler::get();
+	bu::task_group group;
+
+	if (split - first + 1 >= ctx.params.min_task_size)
+		scheduler.run(group, [&ctx, children, first, split]{build_lbvh_node(ctx, children, first, split);});
+	else
+		build_lbvh_node(ctx, children, first, split);
+
+	build_lbvh_node(ctx, children + 1, split + 1, last);
+	scheduler.wait(group);
+
+	node.aabb = ctx.nodes[children].aabb;
+	node.aabb.add_aabb(ctx.nodes[children + 1].aabb);
+}
+
+template <typename K>
+static unsigned int build_lbvh(
+	const bu::async_stop_flag &stop_flag,
+	const bvh_build_params &params,
+	const std::vector<glm::vec3> &centroids,
+	const std::vector<bu::rt::aabb> &bounds,
+	const bu::rt::aabb &centroid_bounds,
+	std::vector<unsigned int> &refs,
+	std::vector<bvh_draft_node> &nodes)
+{
+	auto &scheduler = bu::task_scheduler::get();
+	const int n = refs.size();
+	const int grain = std::max(params.min_parallel_size / 4, 1024);
+
+	// Map centroids onto unit cube and compute their codes
+	glm::vec3 extent = centroid_bounds.get_dimensions();
+	glm::vec3 scale{
+		extent.x > 0 ? 1.f / extent.x : 0.f,
+		extent.y > 0 ? 1.f / extent.y : 0.f,
+		extent.z > 0 ? 1.f / extent.z : 0.f};
+
+	std::vector<K> keys(n);
+	{
+		ZoneScopedN("Morton codes");
+		scheduler.parallel_for(0, n, grain, [&](int begin, int end)
+		{
+			for (int i = begin; i < end; i++)
+				keys[i] = morton_code<K>((centroids[refs[i]] - centroid_bounds.min) * scale);
+		});
+	}
+
+	if (!stop_flag.should_stop())
+		radix_sort(keys, refs, sizeof(K) == 4 ? 30 : 63, grain);
+
+	ZoneScopedN("LBVH hierarchy");
+	std::atomic<unsigned int> node_count = 1;
+	lbvh_context<K> ctx{stop_flag, params, bounds, refs, keys, nodes, node_count};
+	build_lbvh_node(ctx, 0, 0, n - 1);
+	return node_count;
+}
+
+/**
+	\brief Builds a linear BVH - references are sorted along a Morton curve
+	and the hierarchy is derived from the common prefixes of their codes.
+
+	This is much faster than the SAH builds, but produces trees of lower quality.
+	Meant for interactive scene edits.
+*/
+void bvh_draft::build_lbvh(const bu::async_stop_flag &stop_flag)
+{
+	ZoneScopedN("LBVH draft build");
+
+	auto &scheduler = bu::task_scheduler::get();
+	const int n = m_refs.size();
+
+	// Compute centroid bounds
+	const int grain = std::max(m_params.min_parallel_size / 4, 1024);
+	const int chunk_count = (n + grain - 1) / grain;
+	std::vector<rt::aabb> chunk_bounds(chunk_count);
+	scheduler.parallel_for(0, n, grain, [&](int begin, int end)
+	{
+		auto &cb = chunk_bounds[begin / grain];
+		cb = rt::aabb{m_centroids[begin], m_centroids[begin]};
+		for (int i = begin + 1; i < end; i++)
+			cb.add_point(m_centroids[i]);
+	});
+
+	rt::aabb centroid_bounds = chunk_bounds[0];
+	for (const auto &cb : chunk_bounds)
+		centroid_bounds.add_aabb(cb);
+
+	// 30-bit codes suffice unless there are very many primitives
+	int bits = m_params.morton_bits;
+	if (bits != 30 && bits != 63)
+		bits = n > (1 << 20) ? 63 : 30;
+
+	unsigned int node_count;
+	if (bits == 30)
+		node_count = ::build_lbvh<std::uint32_t>(stop_flag, m_params, m_centroids, m_bounds, centroid_bounds, m_refs, m_nodes);
+	else
+		node_count = ::build_lbvh<std::uint64_t>(stop_flag, m_params, m_centroids, m_bounds, centroid_bounds, m_refs, m_nodes);
+
+	m_nodes.resize(node_count);
+}
@@ -0,0 +1,584 @@
+#include "bvh.hpp"
+#include "tlas.hpp"
+#include "ray_packet.hpp"
+#include "linear_stack.hpp"
+#include <algorithm>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BU_BVH_X86
+#endif
+
+using bu::rt::bvh_tree;
+using bu::rt::tlas;
+using bu::rt::ray_packet;
+using bu::rt::ray_packet_hit;
+using bu::rt::ray_packet_size;
+
+/**
+	\brief Per-packet data precomputed for traversal
+*/
+struct packet_traversal
+{
+	const ray_packet *packet;
+	alignas(32) float inv_x[ray_packet_size];
+	alignas(32) float inv_y[ray_packet_size];
+	alignas(32) float inv_z[ray_packet_size];
+
+	bool avx2;             //!< Whether the 8-wide kernels can be used - see get_bvh_width()
+	bool coherent;         //!< All directions have the same signs in each axis - interval culling is possible
+	glm::bvec3 negative;   //!< Signs of the directions (only valid if coherent)
+	glm::vec3 inv_lo;      //!< Lower bounds of the reciprocal directions
+	glm::vec3 inv_hi;      //!< Upper bounds of the reciprocal directions
+};
+
+/**
+	\brief Prepares traversal of rays [first, size) of the packet
+*/
+static void init_packet_traversal(packet_traversal &p, const ray_packet &packet, int first)
+{
+	p.packet = &packet;
+	p.avx2 = bu::rt::get_bvh_width() == 8;
+	for (int i = first; i < packet.size; i++)
+	{
+		p.inv_x[i] = 1.f / packet.dir_x[i];
+		p.inv_y[i] = 1.f / packet.dir_y[i];
+		p.inv_z[i] = 1.f / packet.dir_z[i];
+	}
+
+	p.inv_lo = glm::vec3{HUGE_VALF};
+	p.inv_hi = glm::vec3{-HUGE_VALF};
+	p.negative = glm::lessThan(packet.get_direction(first), glm::vec3{0.f});
+	p.coherent = true;
+	for (int i = first; i < packet.size; i++)
+	{
+		glm::vec3 inv{p.inv_x[i], p.inv_y[i], p.inv_z[i]};
+		glm::vec3 d = packet.get_direction(i);
+		p.inv_lo = glm::min(p.inv_lo, inv);
+		p.inv_hi = glm::max(p.inv_hi, inv);
+		for (int axis = 0; axis < 3; axis++)
+			p.coherent = p.coherent && d[axis] != 0 && (d[axis] < 0) == p.negative[axis];
+	}
+}
+
+/**
+	\brief Finds the first of rays [first, size) hitting the box closer than its current hit (portable version)
+	\returns index of the ray or -1
+*/
+static int packet_test_rays_aabb(const packet_traversal &p, const bu::rt::aabb &box, const float *t_best, int first)
+{
+	const auto &packet = *p.packet;
+	for (int i = first; i < packet.size; i++)
+	{
+		float tx0 = (box.min.x - packet.origin.x) * p.inv_x[i];
+		float tx1 = (box.max.x - packet.origin.x) * p.inv_x[i];
+		float ty0 = (box.min.y - packet.origin.y) * p.inv_y[i];
+		float ty1 = (box.max.y - packet.origin.y) * p.inv_y[i];
+		float tz0 = (box.min.z - packet.origin.z) * p.inv_z[i];
+		float tz1 = (box.max.z - packet.origin.z) * p.inv_z[i];
+		float tmin = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::min(tz0, tz1));
+		float tmax = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::max(tz0, tz1));
+		if (tmax >= 0 && tmin <= tmax && tmin < t_best[i])
+			return i;
+	}
+
+	return -1;
+}
+
+/**
+	\brief Intersects a triangle with rays [first, size) of the packet (portable version)
+
+	Thanks to the common origin, the parts of the test depending only on the origin
+	are computed once per triangle. Hits record the triangle index in hit_index.
+*/
+static void packet_intersect_triangle(const packet_traversal &p, const bu::rt::triangle_intersection &tri, std::int32_t index, ray_packet_hit &hit, std::int32_t *hit_index, int first)
+{
+	const auto &packet = *p.packet;
+	const glm::vec3 &E1 = tri.e1;
+	const glm::vec3 &E2 = tri.e2;
+	const glm::vec3 T = packet.origin - tri.v0;
+	const glm::vec3 Q = glm::cross(T, E1);
+	const float QE2 = glm::dot(Q, E2);
+
+	for (int i = first; i < packet.size; i++)
+	{
+		glm::vec3 d{packet.dir_x[i], packet.dir_y[i], packet.dir_z[i]};
+		glm::vec3 P = glm::cross(d, E2);
+		float det = glm::dot(P, E1);
+		float inv_det = 1.f / det;
+		float t = QE2 * inv_det;
+		float u = glm::dot(P, T) * inv_det;
+		float v = glm::dot(Q, d) * inv_det;
+
+		if (det != 0.f && u >= 0.f && v >= 0.f && u + v <= 1.f && t >= 0.f && t < hit.t[i])
+		{
+			hit.t[i] = t;
+			hit.u[i] = u;
+			hit.v[i] = v;
+			hit_index[i] = index;
+		}
+	}
+}
+
+#ifdef __SSE2__
+/**
+	\brief Mask of lanes base, base + 1, ... which fall into [first, size)
+*/
+static inline __m128 packet_lane_mask_sse(int base, int first, int size)
+{
+	__m128i lane = _mm_add_epi32(_mm_set1_epi32(base), _mm_set_epi32(3, 2, 1, 0));
+	__m128i active = _mm_and_si128(
+		_mm_cmpgt_epi32(lane, _mm_set1_epi32(first - 1)),
+		_mm_cmplt_epi32(lane, _mm_set1_epi32(size)));
+	return _mm_castsi128_ps(active);
+}
+
+/**
+	\brief Like packet_test_rays_aabb(), but tests 4 rays at once using SSE
+*/
+static int packet_test_rays_aabb_sse(const packet_traversal &p, const bu::rt::aabb &box, const float *t_best, int first)
+{
+	const auto &packet = *p.packet;
+	const __m128 min_x = _mm_set1_ps(box.min.x - packet.origin.x);
+	const __m128 min_y = _mm_set1_ps(box.min.y - packet.origin.y);
+	const __m128 min_z = _mm_set1_ps(box.min.z - packet.origin.z);
+	const __m128 max_x = _mm_set1_ps(box.max.x - packet.origin.x);
+	const __m128 max_y = _mm_set1_ps(box.max.y - packet.origin.y);
+	const __m128 max_z = _mm_set1_ps(box.max.z - packet.origin.z);
+
+	for (int base = first & ~3; base < packet.size; base += 4)
+	{
+		__m128 ix = _mm_load_ps(p.inv_x + base);
+		__m128 iy = _mm_load_ps(p.inv_y + base);
+		__m128 iz = _mm_load_ps(p.inv_z + base);
+		__m128 tx0 = _mm_mul_ps(min_x, ix), tx1 = _mm_mul_ps(max_x, ix);
+		__m128 ty0 = _mm_mul_ps(min_y, iy), ty1 = _mm_mul_ps(max_y, iy);
+		__m128 tz0 = _mm_mul_ps(min_z, iz), tz1 = _mm_mul_ps(max_z, iz);
+
+		__m128 tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_min_ps(tz0, tz1));
+		__m128 tmax = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)), _mm_max_ps(tz0, tz1));
+
+		__m128 hit = _mm_and_ps(
+			_mm_and_ps(_mm_cmpge_ps(tmax, _mm_setzero_ps()), _mm_cmple_ps(tmin, tmax)),
+			_mm_cmplt_ps(tmin, _mm_load_ps(t_best + base)));
+		hit = _mm_and_ps(hit, packet_lane_mask_sse(base, first, packet.size));
+
+		if (int mask = _mm_movemask_ps(hit))
+			return base + __builtin_ctz(mask);
+	}
+
+	return -1;
+}
+
+/**
+	\brief Like packet_intersect_triangle(), but tests 4 rays at once using SSE
+
+	Misses are blended out with the lane mask, so t, u, v and the triangle
+	indices of all lanes are updated without branching.
+*/
+static void packet_intersect_triangle_sse(const packet_traversal &p, const bu::rt::triangle_intersection &tri, std::int32_t index, ray_packet_hit &hit, std::int32_t *hit_index, int first)
+{
+	const auto &packet = *p.packet;
+	const glm::vec3 T = packet.origin - tri.v0;
+	const glm::vec3 Q = glm::cross(T, tri.e1);
+
+	const __m128 e1x = _mm_set1_ps(tri.e1.x), e1y = _mm_set1_ps(tri.e1.y), e1z = _mm_set1_ps(tri.e1.z);
+	const __m128 e2x = _mm_set1_ps(tri.e2.x), e2y = _mm_set1_ps(tri.e2.y), e2z = _mm_set1_ps(tri.e2.z);
+	const __m128 tx = _mm_set1_ps(T.x), ty = _mm_set1_ps(T.y), tz = _mm_set1_ps(T.z);
+	const __m128 qx = _mm_set1_ps(Q.x), qy = _mm_set1_ps(Q.y), qz = _mm_set1_ps(Q.z);
+	const __m128 qe2 = _mm_set1_ps(glm::dot(Q, tri.e2));
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.f);
+	const __m128i new_index = _mm_set1_epi32(index);
+
+	for (int base = first & ~3; base < packet.size; base += 4)
+	{
+		__m128 dx = _mm_load_ps(packet.dir_x + base);
+		__m128 dy = _mm_load_ps(packet.dir_y + base);
+		__m128 dz = _mm_load_ps(packet.dir_z + base);
+
+		// P = D x E2
+		__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(e2y, dz));
+		__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(e2z, dx));
+		__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(e2x, dy));
+		__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, e1x), _mm_mul_ps(py, e1y)), _mm_mul_ps(pz, e1z));
+		__m128 inv_det = _mm_div_ps(one, det);
+
+		__m128 t = _mm_mul_ps(qe2, inv_det);
+		__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(px, tx), _mm_mul_ps(py, ty)), _mm_mul_ps(pz, tz)), inv_det);
+		__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(qx, dx), _mm_mul_ps(qy, dy)), _mm_mul_ps(qz, dz)), inv_det);
+
+		__m128 t_best = _mm_load_ps(hit.t + base);
+		__m128 is_hit = _mm_and_ps(_mm_cmpneq_ps(det, zero), _mm_cmpge_ps(u, zero));
+		is_hit = _mm_and_ps(is_hit, _mm_cmpge_ps(v, zero));
+		is_hit = _mm_and_ps(is_hit, _mm_cmple_ps(_mm_add_ps(u, v), one));
+		is_hit = _mm_and_ps(is_hit, _mm_cmpge_ps(t, zero));
+		is_hit = _mm_and_ps(is_hit, _mm_cmplt_ps(t, t_best));
+		is_hit = _mm_and_ps(is_hit, packet_lane_mask_sse(base, first, packet.size));
+		if (!_mm_movemask_ps(is_hit))
+			continue;
+
+		auto blend = [is_hit](__m128 a, __m128 b){return _mm_or_ps(_mm_and_ps(is_hit, b), _mm_andnot_ps(is_hit, a));};
+		_mm_store_ps(hit.t + base, blend(t_best, t));
+		_mm_store_ps(hit.u + base, blend(_mm_load_ps(hit.u + base), u));
+		_mm_store_ps(hit.v + base, blend(_mm_load_ps(hit.v + base), v));
+
+		auto *index_ptr = reinterpret_cast<__m128i*>(hit_index + base);
+		__m128 old_index = _mm_castsi128_ps(_mm_load_si128(index_ptr));
+		_mm_store_si128(index_ptr, _mm_castps_si128(blend(old_index, _mm_castsi128_ps(new_index))));
+	}
+}
+#endif
+
+#ifdef BU_BVH_X86
+/**
+	\brief Mask of lanes base, base + 1, ... which fall into [first, size)
+*/
+__attribute__((target("avx2")))
+static inline __m256 packet_lane_mask_avx2(int base, int first, int size)
+{
+	__m256i lane = _mm256_add_epi32(_mm256_set1_epi32(base), _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+	__m256i active = _mm256_andnot_si256(
+		_mm256_cmpgt_epi32(_mm256_set1_epi32(first), lane),
+		_mm256_cmpgt_epi32(_mm256_set1_epi32(size), lane));
+	return _mm256_castsi256_ps(active);
+}
+
+/**
+	\brief Like packet_test_rays_aabb(), but tests 8 rays at once using AVX2
+
+	Only called when the CPU supports AVX2 - see get_bvh_width().
+*/
+__attribute__((target("avx2")))
+static int packet_test_rays_aabb_avx2(const packet_traversal &p, const bu::rt::aabb &box, const float *t_best, int first)
+{
+	const auto &packet = *p.packet;
+	const __m256 min_x = _mm256_set1_ps(box.min.x - packet.origin.x);
+	const __m256 min_y = _mm256_set1_ps(box.min.y - packet.origin.y);
+	const __m256 min_z = _mm256_set1_ps(box.min.z - packet.origin.z);
+	const __m256 max_x = _mm256_set1_ps(box.max.x - packet.origin.x);
+	const __m256 max_y = _mm256_set1_ps(box.max.y - packet.origin.y);
+	const __m256 max_z = _mm256_set1_ps(box.max.z - packet.origin.z);
+
+	for (int base = first & ~7; base < packet.size; base += 8)
+	{
+		__m256 ix = _mm256_load_ps(p.inv_x + base);
+		__m256 iy = _mm256_load_ps(p.inv_y + base);
+		__m256 iz = _mm256_load_ps(p.inv_z + base);
+		__m256 tx0 = _mm256_mul_ps(min_x, ix), tx1 = _mm256_mul_ps(max_x, ix);
+		__m256 ty0 = _mm256_mul_ps(min_y, iy), ty1 = _mm256_mul_ps(max_y, iy);
+		__m256 tz0 = _mm256_mul_ps(min_z, iz), tz1 = _mm256_mul_ps(max_z, iz);
+
+		__m256 tmin = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)), _mm256_min_ps(tz0, tz1));
+		__m256 tmax = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)), _mm256_max_ps(tz0, tz1));
+
+		__m256 hit = _mm256_and_ps(
+			_mm256_and_ps(_mm256_cmp_ps(tmax, _mm256_setzero_ps(), _CMP_GE_OQ), _mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ)),
+			_mm256_cmp_ps(tmin, _mm256_load_ps(t_best + base), _CMP_LT_OQ));
+		hit = _mm256_and_ps(hit, packet_lane_mask_avx2(base, first, packet.size));
+
+		if (int mask = _mm256_movemask_ps(hit))
+			return base + __builtin_ctz(mask);
+	}
+
+	return -1;
+}
+
+/**
+	\brief Like packet_intersect_triangle_sse(), but tests 8 rays at once using AVX2
+*/
+__attribute__((target("avx2")))
+static void packet_intersect_triangle_avx2(const packet_traversal &p, const bu::rt::triangle_intersection &tri, std::int32_t index, ray_packet_hit &hit, std::int32_t *hit_index, int first)
+{
+	const auto &packet = *p.packet;
+	const glm::vec3 T = packet.origin - tri.v0;
+	const glm::vec3 Q = glm::cross(T, tri.e1);
+
+	const __m256 e1x = _mm256_set1_ps(tri.e1.x), e1y = _mm256_set1_ps(tri.e1.y), e1z = _mm256_set1_ps(tri.e1.z);
+	const __m256 e2x = _mm256_set1_ps(tri.e2.x), e2y = _mm256_set1_ps(tri.e2.y), e2z = _mm256_set1_ps(tri.e2.z);
+	const __m256 tx = _mm256_set1_ps(T.x), ty = _mm256_set1_ps(T.y), tz = _mm256_set1_ps(T.z);
+	const __m256 qx = _mm256_set1_ps(Q.x), qy = _mm256_set1_ps(Q.y), qz = _mm256_set1_ps(Q.z);
+	const __m256 qe2 = _mm256_set1_ps(glm::dot(Q, tri.e2));
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.f);
+	const __m256 new_index = _mm256_castsi256_ps(_mm256_set1_epi32(index));
+
+	for (int base = first & ~7; base < packet.size; base += 8)
+	{
+		__m256 dx = _mm256_load_ps(packet.dir_x + base);
+		__m256 dy = _mm256_load_ps(packet.dir_y + base);
+		__m256 dz = _mm256_load_ps(packet.dir_z + base);
+
+		// P = D x E2
+		__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(e2y, dz));
+		__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(e2z, dx));
+		__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(e2x, dy));
+		__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, e1x), _mm256_mul_ps(py, e1y)), _mm256_mul_ps(pz, e1z));
+		__m256 inv_det = _mm256_div_ps(one, det);
+
+		__m256 t = _mm256_mul_ps(qe2, inv_det);
+		__m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, tx), _mm256_mul_ps(py, ty)), _mm256_mul_ps(pz, tz)), inv_det);
+		__m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(qx, dx), _mm256_mul_ps(qy, dy)), _mm256_mul_ps(qz, dz)), inv_det);
+
+		__m256 t_best = _mm256_load_ps(hit.t + base);
+		__m256 is_hit = _mm256_and_ps(_mm256_cmp_ps(det, zero, _CMP_NEQ_OQ), _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+		is_hit = _mm256_and_ps(is_hit, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+		is_hit = _mm256_and_ps(is_hit, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+		is_hit = _mm256_and_ps(is_hit, _mm256_cmp_ps(t, zero, _CMP_GE_OQ));
+		is_hit = _mm256_and_ps(is_hit, _mm256_cmp_ps(t, t_best, _CMP_LT_OQ));
+		is_hit = _mm256_and_ps(is_hit, packet_lane_mask_avx2(base, first, packet.size));
+		if (!_mm256_movemask_ps(is_hit))
+			continue;
+
+		_mm256_store_ps(hit.t + base, _mm256_blendv_ps(t_best, t, is_hit));
+		_mm256_store_ps(hit.u + base, _mm256_blendv_ps(_mm256_load_ps(hit.u + base), u, is_hit));
+		_mm256_store_ps(hit.v + base, _mm256_blendv_ps(_mm256_load_ps(hit.v + base), v, is_hit));
+
+		auto *index_ptr = reinterpret_cast<float*>(hit_index + base);
+		_mm256_store_ps(index_ptr, _mm256_blendv_ps(_mm256_load_ps(index_ptr), new_index, is_hit));
+	}
+}
+#endif
+
+/**
+	\brief Finds the first ray in the packet hitting the box
+
+	Rays before the first one are skipped - they already missed the parent node.
+	If the packet is coherent, the whole packet is first tested using interval
+	arithmetic and the individual rays are only tested if that fails to cull the box.
+
+	\returns index of the ray or -1 if no ray hits the box closer than its current hit
+*/
+static int packet_test_aabb(const packet_traversal &p, const bu::rt::aabb &box, const float *t_best, float t_far, int first)
+{
+	const auto &packet = *p.packet;
+
+	if (p.coherent)
+	{
+		float near_lo = -HUGE_VALF;
+		float far_hi = HUGE_VALF;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			float dn = (p.negative[axis] ? box.max[axis] : box.min[axis]) - packet.origin[axis];
+			float df = (p.negative[axis] ? box.min[axis] : box.max[axis]) - packet.origin[axis];
+			near_lo = std::max(near_lo, std::min(dn * p.inv_lo[axis], dn * p.inv_hi[axis]));
+			far_hi = std::min(far_hi, std::max(df * p.inv_lo[axis], df * p.inv_hi[axis]));
+		}
+
+		if (near_lo > far_hi || far_hi < 0 || near_lo >= t_far)
+			return -1;
+	}
+
+#ifdef BU_BVH_X86
+	if (p.avx2)
+		return packet_test_rays_aabb_avx2(p, box, t_best, first);
+#endif
+#ifdef __SSE2__
+	return packet_test_rays_aabb_sse(p, box, t_best, first);
+#else
+	return packet_test_rays_aabb(p, box, t_best, first);
+#endif
+}
+
+/**
+	\brief Intersects a triangle with the rays using the widest kernel available
+*/
+static void packet_test_triangle(const packet_traversal &p, const bu::rt::triangle_intersection &tri, std::int32_t index, ray_packet_hit &hit, std::int32_t *hit_index, int first)
+{
+#ifdef BU_BVH_X86
+	if (p.avx2)
+		return packet_intersect_triangle_avx2(p, tri, index, hit, hit_index, first);
+#endif
+#ifdef __SSE2__
+	packet_intersect_triangle_sse(p, tri, index, hit, hit_index, first);
+#else
+	packet_intersect_triangle(p, tri, index, hit, hit_index, first);
+#endif
+}
+
+/**
+	\brief Packet traversal of a binary BVH in depth-first layout
+
+	Each stack entry carries the index of the first active ray. The child
+	closer along the direction of that ray is visited first.
+
+	\returns false if the stack overflowed and some nodes were skipped - the
+	hits are then incomplete and the rays have to be finished one by one
+*/
+template <typename F>
+static bool traverse_packet(const bu::rt::bvh_node *nodes, const packet_traversal &p, ray_packet_hit &hit, int first, F &&process_leaf)
+{
+	const auto &packet = *p.packet;
+
+	auto get_t_far = [&]{
+		float t_far = 0;
+		for (int i = first; i < packet.size; i++)
+			t_far = std::max(t_far, hit.t[i]);
+		return t_far;
+	};
+
+	float t_far = get_t_far();
+	first = packet_test_aabb(p, nodes[0].aabb, hit.t, t_far, first);
+	if (first < 0) return true;
+
+	bu::rt::short_stack<std::pair<unsigned int, int>, 64> st;
+	st.push({0, first});
+
+	while (!st.empty())
+	{
+		auto [node_id, node_first] = st.top();
+		const auto &node = nodes[node_id];
+		st.pop();
+
+		if (node.count == 0)
+		{
+			auto id_l = node_id + 1;
+			auto id_r = node.index;
+			int first_l = packet_test_aabb(p, nodes[id_l].aabb, hit.t, t_far, node_first);
+			int first_r = packet_test_aabb(p, nodes[id_r].aabb, hit.t, t_far, node_first);
+
+			if (first_l >= 0 && first_r >= 0)
+			{
+				// Visit the child closer along the first active ray first
+				glm::vec3 d = packet.get_direction(node_first);
+				float dl = glm::dot(nodes[id_l].aabb.get_center() - packet.origin, d);
+				float dr = glm::dot(nodes[id_r].aabb.get_center() - packet.origin, d);
+				if (dl < dr)
+				{
+					st.push({id_r, first_r});
+					st.push({id_l, first_l});
+				}
+				else
+				{
+					st.push({id_l, first_l});
+					st.push({id_r, first_r});
+				}
+			}
+			else if (first_l >= 0)
+				st.push({id_l, first_l});
+			else if (first_r >= 0)
+				st.push({id_r, first_r});
+		}
+		else if (node.count > 0)
+		{
+			process_leaf(node, node_first);
+			t_far = get_t_far();
+		}
+	}
+
+	return !st.overflowed();
+}
+
+/**
+	\brief Finds the closest intersections of rays [first, size) in the packet
+
+	Only hits closer than the ones already stored in hit are recorded.
+	Packets are traversed through the binary nodes, regardless of the width
+	selected for single rays.
+*/
+void bvh_tree::test_packet(const rt::ray_packet &packet, rt::ray_packet_hit &hit, int first) const
+{
+	if (first >= packet.size)
+		return;
+
+	packet_traversal p;
+	init_packet_traversal(p, packet, first);
+
+	// The kernels only blend triangle indices - they are turned into pointers at the end
+	alignas(32) std::int32_t hit_index[ray_packet_size];
+	std::fill(std::begin(hit_index), std::end(hit_index), -1);
+
+	bool complete = traverse_packet(nodes, p, hit, first, [&](const bvh_node &node, int node_first)
+	{
+		for (unsigned int i = node.index; i < node.index + node.count; i++)
+			packet_test_triangle(p, intersections[i], i, hit, hit_index, node_first);
+	});
+
+	for (int i = first; i < packet.size; i++)
+		if (hit_index[i] >= 0)
+			hit.triangle[i] = &triangles[hit_index[i]];
+
+	// Very deep tree - finish the rays one by one
+	if (!complete)
+	{
+		for (int i = first; i < packet.size; i++)
+		{
+			rt::ray_hit h;
+			if (test_ray(packet.get_ray(i), h, hit.t[i]))
+			{
+				hit.t[i] = h.t;
+				hit.u[i] = h.u;
+				hit.v[i] = h.v;
+				hit.triangle[i] = h.triangle;
+			}
+		}
+	}
+}
+
+/**
+	\brief Finds the closest intersections of all rays in the packet with the instances
+
+	Like in test_ray(), the packet is transformed to object space of each
+	instance. The common origin is preserved by the transform.
+*/
+void tlas::test_packet(const rt::ray_packet &packet, rt::ray_packet_hit &hit) const
+{
+	hit.clear();
+	if (nodes.empty() || !packet.size)
+		return;
+
+	packet_traversal p;
+	init_packet_traversal(p, packet, 0);
+
+	ray_packet object_packet;
+	float prev_t[ray_packet_size];
+
+	bool complete = traverse_packet(nodes.data(), p, hit, 0, [&](const bvh_node &node, int node_first)
+	{
+		for (unsigned int i = node.index; i < node.index + node.count; i++)
+		{
+			const auto &inst = instances[i];
+
+			float t_far = 0;
+			for (int j = node_first; j < packet.size; j++)
+				t_far = std::max(t_far, hit.t[j]);
+
+			int first = node.count > 1 ? packet_test_aabb(p, inst.aabb, hit.t, t_far, node_first) : node_first;
+			if (first < 0) continue;
+
+			glm::mat3 m{inst.world_to_object};
+			object_packet.origin = glm::vec3{inst.world_to_object * glm::vec4{packet.origin, 1.f}};
+			object_packet.size = packet.size;
+			for (int j = first; j < packet.size; j++)
+			{
+				object_packet.set_direction(j, m * packet.get_direction(j));
+				prev_t[j] = hit.t[j];
+			}
+
+			inst.blas->test_packet(object_packet, hit, first);
+
+			// Compared by distance, since instances of a mesh share its BLAS and can hit the same triangle
+			for (int j = first; j < packet.size; j++)
+				if (hit.t[j] < prev_t[j])
+					hit.normal_matrix[j] = &inst.normal_matrix;
+		}
+	});
+
+	// Very deep tree - finish the rays one by one
+	if (!complete)
+	{
+		for (int i = 0; i < packet.size; i++)
+		{
+			rt::ray_hit h;
+			if (test_ray(packet.get_ray(i), h) && h.t < hit.t[i])
+			{
+				hit.t[i] = h.t;
+				hit.u[i] = h.u;
+				hit.v[i] = h.v;
+				hit.triangle[i] = h.triangle;
+				hit.normal_matrix[i] = h.normal_matrix;
+			}
+		}
+	}
+}
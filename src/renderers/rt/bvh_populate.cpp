@@ -7,56 +7,65 @@ using bu::rt::bvh_tree;
 using bu::rt::bvh_draft;
 using bu::rt::bvh_draft_node;
 
-void bvh_tree::populate(const bvh_draft &draft)
+void bvh_tree::populate(const bvh_draft &draft, int width, bvh_node_format format)
 {
 	ZoneScopedN("BVH populate");
 	
 	unsigned int t_count = 0;
+	source_triangles.resize(triangle_count);
+	source_triangle_count = draft.get_source_triangle_count();
 
-	std::stack<std::pair<unsigned int, const bvh_draft_node*>> st;
-	st.push({1, &draft.get_root_node()});
+	const auto &draft_nodes = draft.get_nodes();
+	unsigned int n_count = 0;
+
+	// Draft node index and the parent whose right child link should point to it
+	std::stack<std::pair<unsigned int, int>> st;
+	st.push({0, -1});
 
 	while (!st.empty())
 	{
-		auto [node_id, node_ptr] = st.top();
+		auto [draft_id, parent_id] = st.top();
+		const auto &draft_node = draft_nodes[draft_id];
 		st.pop();
 
-		nodes[node_id].aabb = node_ptr->aabb;
-		if (node_ptr->triangles.empty())
-		{
-			bool has_children = node_ptr->left || node_ptr->right;
-			if (has_children)
-			{
-				// This node has children
-				nodes[node_id].count = 0;
+		// Nodes are emitted in depth-first order
+		unsigned int node_id = n_count++;
+		if (parent_id >= 0)
+			nodes[parent_id].index = node_id;
 
-				// Check if children overlap
-				nodes[node_id].index = node_ptr->left->aabb.check_overlap(node_ptr->right->aabb);
+		nodes[node_id].aabb = draft_node.aabb;
+		if (!draft_node.is_leaf())
+		{
+			// This node has children - the right one sets index once it's emitted
+			nodes[node_id].count = 0;
 
-				// Process children
-				st.push({node_id * 2, node_ptr->left.get()});
-				st.push({node_id * 2 + 1, node_ptr->right.get()});
-			}
-			else
-			{
-				// No triangles and no children
-				nodes[node_id].count = -1;
-				nodes[node_id].index = 0;
-				nodes[node_id].aabb = rt::aabb{};
-			}
+			// The left child is processed first, so it's stored right after this node
+			st.push({draft_node.right, node_id});
+			st.push({draft_node.left, -1});
+		}
+		else if (!draft_node.count)
+		{
+			// No triangles and no children
+			nodes[node_id].count = -1;
+			nodes[node_id].index = 0;
+			nodes[node_id].aabb = rt::aabb{};
 		}
 		else // Leaf node
 		{
-			if (node_ptr->left || node_ptr->right)
-				LOG_ERROR << "BVH draft node has both triangles and children! (bvh_tree::populate())";
-
 			// Write triangle indices
 			nodes[node_id].index = t_count;
-			nodes[node_id].count = node_ptr->triangles.size();
+			nodes[node_id].count = draft_node.count;
 
 			// Copy triangles
-			for (const auto &t : node_ptr->triangles)
-				triangles[t_count++] = t;
-		}	
+			for (unsigned int i = 0; i < draft_node.count; i++, t_count++)
+			{
+				triangles[t_count] = draft.get_reference_triangle(draft_node.first + i);
+				source_triangles[t_count] = draft.get_reference_source(draft_node.first + i);
+				intersections[t_count] = get_triangle_intersection(triangles[t_count]);
+			}
+		}
 	}
-}
\ No newline at end of file
+
+	parents = get_bvh_parents(nodes, n_count);
+	collapse(width, format);
+}
@@ -0,0 +1,281 @@
+#include "bvh.hpp"
+#include "tlas.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <tracy/Tracy.hpp>
+
+using bu::rt::bvh_tree;
+using bu::rt::tlas;
+
+/**
+	\brief Ray with precomputed reciprocal direction used by stream traversal
+*/
+struct stream_ray
+{
+	glm::vec3 origin;
+	glm::vec3 inv_direction;
+};
+
+static inline bool stream_test_aabb(const bu::rt::aabb &box, const stream_ray &r, float t_max)
+{
+	glm::vec3 a = (box.min - r.origin) * r.inv_direction;
+	glm::vec3 b = (box.max - r.origin) * r.inv_direction;
+	float tmin = std::max(std::max(std::min(a.x, b.x), std::min(a.y, b.y)), std::min(a.z, b.z));
+	float tmax = std::min(std::min(std::max(a.x, b.x), std::max(a.y, b.y)), std::max(a.z, b.z));
+	return tmax >= 0 && tmin <= tmax && tmin < t_max;
+}
+
+/**
+	\brief Node on the stream traversal stack with its list of rays
+*/
+struct stream_entry
+{
+	unsigned int node;
+	unsigned int offset;
+	unsigned int count;
+};
+
+/**
+	\brief Scratch memory of stream traversal - reused between calls on the same thread
+*/
+struct stream_buffers
+{
+	std::vector<stream_ray> rays;
+	std::vector<unsigned int> ids;
+	std::vector<unsigned int> lists; //!< Ray lists of all nodes on the stack
+	std::vector<stream_entry> stack;
+};
+
+/**
+	\brief Traverses a binary BVH with a whole stream of rays
+
+	Every visited node gets a list of rays which hit it. The lists of the children
+	are filtered from the parent list, so each node is fetched once for all rays
+	instead of once per ray. Nodes are visited in the order given by a representative
+	direction of the stream.
+
+	All lists are stored in a single buffer in stack order. The far child's list
+	is always written first, so popping a node never discards a pending list.
+*/
+template <typename F>
+static void traverse_stream(
+	const bu::rt::bvh_node *nodes,
+	const stream_ray *rays,
+	const bu::rt::ray_hit *hits,
+	const unsigned int *ids,
+	int count,
+	const glm::vec3 &direction,
+	stream_buffers &buf,
+	F &&process_leaf)
+{
+	auto &lists = buf.lists;
+	auto &st = buf.stack;
+	st.clear();
+	lists.clear();
+	for (int i = 0; i < count; i++)
+		if (stream_test_aabb(nodes[0].aabb, rays[ids[i]], hits[ids[i]].t))
+			lists.push_back(ids[i]);
+
+	if (lists.empty()) return;
+
+	st.push_back({0, 0, static_cast<unsigned int>(lists.size())});
+
+	while (!st.empty())
+	{
+		auto entry = st.back();
+		const auto &node = nodes[entry.node];
+		st.pop_back();
+		lists.resize(entry.offset + entry.count);
+
+		if (node.count > 0)
+		{
+			process_leaf(node, &lists[entry.offset], entry.count);
+			continue;
+		}
+		else if (node.count < 0)
+			continue;
+
+		unsigned int near_id = entry.node + 1;
+		unsigned int far_id = node.index;
+		if (glm::dot(nodes[near_id].aabb.get_center() - nodes[far_id].aabb.get_center(), direction) > 0)
+			std::swap(near_id, far_id);
+
+		for (auto child_id : {far_id, near_id})
+		{
+			unsigned int offset = lists.size();
+			for (unsigned int i = 0; i < entry.count; i++)
+			{
+				unsigned int id = lists[entry.offset + i];
+				if (stream_test_aabb(nodes[child_id].aabb, rays[id], hits[id].t))
+					lists.push_back(id);
+			}
+
+			if (lists.size() > offset)
+				st.push_back({child_id, offset, static_cast<unsigned int>(lists.size() - offset)});
+		}
+	}
+}
+
+/**
+	\brief Finds the closest intersections of a stream of rays
+
+	Only hits closer than the ones already stored in hits are recorded.
+	Like packets, streams are traversed through the binary nodes.
+*/
+void bvh_tree::test_stream(const rt::ray *rays, rt::ray_hit *hits, int count) const
+{
+	thread_local stream_buffers buf;
+
+	glm::vec3 direction{0.f};
+	buf.rays.resize(count);
+	buf.ids.resize(count);
+	for (int i = 0; i < count; i++)
+	{
+		buf.rays[i] = stream_ray{rays[i].origin, 1.f / rays[i].direction};
+		buf.ids[i] = i;
+		direction += rays[i].direction;
+	}
+
+	traverse_stream(nodes, buf.rays.data(), hits, buf.ids.data(), count, direction, buf,
+		[&](const bvh_node &node, const unsigned int *ids, unsigned int id_count)
+		{
+			for (unsigned int j = node.index; j < node.index + node.count; j++)
+				for (unsigned int i = 0; i < id_count; i++)
+				{
+					auto &hit = hits[ids[i]];
+					float t, u, v;
+					if (ray_intersect_triangle(rays[ids[i]], intersections[j], t, u, v) && t < hit.t)
+					{
+						hit.t = t;
+						hit.u = u;
+						hit.v = v;
+						hit.triangle = &triangles[j];
+					}
+				}
+		});
+}
+
+/**
+	\brief Returns a sorting key of the ray - direction octant in the highest bits
+	followed by Morton code of the origin relative to bounds of all origins
+*/
+static std::uint32_t get_stream_key(const bu::rt::ray &r, const bu::rt::aabb &origin_bounds)
+{
+	auto expand_bits = [](std::uint32_t x)
+	{
+		x &= 0x1ff;
+		x = (x | (x << 16)) & 0x030000ff;
+		x = (x | (x << 8)) & 0x0300f00f;
+		x = (x | (x << 4)) & 0x030c30c3;
+		x = (x | (x << 2)) & 0x09249249;
+		return x;
+	};
+
+	glm::vec3 extent = glm::max(origin_bounds.get_dimensions(), glm::vec3{1e-20f});
+	glm::uvec3 q{glm::clamp((r.origin - origin_bounds.min) / extent * 511.f, 0.f, 511.f)};
+	std::uint32_t octant = (r.direction.x < 0) | (r.direction.y < 0) << 1 | (r.direction.z < 0) << 2;
+	return octant << 27 | expand_bits(q.x) << 2 | expand_bits(q.y) << 1 | expand_bits(q.z);
+}
+
+/**
+	\brief Finds the closest intersections of a stream of incoherent rays with the instances
+
+	Rays are binned by direction octant and sorted by origin within each bin. Each
+	bin is then traced as a stream, so the nodes are visited in a consistent order
+	and fetched once per bin instead of once per ray.
+*/
+void tlas::test_stream(const rt::ray *rays, rt::ray_hit *hits, int count) const
+{
+	ZoneScopedN("TLAS stream traversal");
+
+	for (int i = 0; i < count; i++)
+	{
+		hits[i].t = HUGE_VALF;
+		hits[i].triangle = nullptr;
+		hits[i].normal_matrix = nullptr;
+	}
+
+	if (nodes.empty() || !count)
+		return;
+
+	thread_local stream_buffers buf;
+	thread_local std::vector<std::pair<std::uint32_t, unsigned int>> keys;
+	thread_local std::vector<unsigned int> object_ids;
+	thread_local std::vector<rt::ray> object_rays;
+	thread_local std::vector<rt::ray_hit> object_hits;
+
+	// Bin by octant and sort by origin
+	{
+		ZoneScopedN("Ray sorting");
+		rt::aabb origin_bounds{rays[0].origin, rays[0].origin};
+		for (int i = 1; i < count; i++)
+			origin_bounds.add_point(rays[i].origin);
+
+		keys.resize(count);
+		for (int i = 0; i < count; i++)
+			keys[i] = {get_stream_key(rays[i], origin_bounds), i};
+		std::sort(keys.begin(), keys.end());
+	}
+
+	buf.rays.resize(count);
+	buf.ids.resize(count);
+	for (int i = 0; i < count; i++)
+	{
+		buf.rays[i] = stream_ray{rays[i].origin, 1.f / rays[i].direction};
+		buf.ids[i] = keys[i].second;
+	}
+
+	auto process_leaf = [&](const bvh_node &node, const unsigned int *ids, unsigned int id_count)
+	{
+		for (unsigned int i = node.index; i < node.index + node.count; i++)
+		{
+			const auto &inst = instances[i];
+			glm::mat3 m{inst.world_to_object};
+
+			// Transform rays hitting the instance to object space
+			object_ids.clear();
+			object_rays.clear();
+			object_hits.clear();
+			for (unsigned int k = 0; k < id_count; k++)
+			{
+				auto id = ids[k];
+				if (node.count > 1 && !stream_test_aabb(inst.aabb, buf.rays[id], hits[id].t))
+					continue;
+
+				object_ids.push_back(id);
+				object_rays.push_back(rt::ray{
+					glm::vec3{inst.world_to_object * glm::vec4{rays[id].origin, 1.f}},
+					m * rays[id].direction});
+				object_hits.push_back(hits[id]);
+			}
+
+			if (object_ids.empty()) continue;
+			inst.blas->test_stream(object_rays.data(), object_hits.data(), object_rays.size());
+
+			// Write back improved hits - compared by distance, since instances of
+			// a mesh share its BLAS and can report the same triangle
+			for (auto k = 0u; k < object_ids.size(); k++)
+			{
+				auto &hit = hits[object_ids[k]];
+				if (object_hits[k].t < hit.t)
+				{
+					hit = object_hits[k];
+					hit.normal_matrix = &inst.normal_matrix;
+				}
+			}
+		}
+	};
+
+	// Trace each octant separately
+	for (int begin = 0; begin < count;)
+	{
+		std::uint32_t octant = keys[begin].first >> 27;
+		int end = begin;
+		while (end < count && (keys[end].first >> 27) == octant)
+			end++;
+
+		glm::vec3 direction{octant & 1 ? -1.f : 1.f, octant & 2 ? -1.f : 1.f, octant & 4 ? -1.f : 1.f};
+		traverse_stream(nodes.data(), buf.rays.data(), hits, buf.ids.data() + begin, end - begin, direction, buf, process_leaf);
+		begin = end;
+	}
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+namespace bu::rt {
+
+/**
+	\brief Strategy used for finding splits during BVH draft build
+*/
+enum class bvh_build_mode
+{
+	SWEEP_SAH,  //!< Sorts objects in each axis and evaluates SAH for every possible split
+	BINNED_SAH, //!< Evaluates SAH only on bin boundaries of the centroid bounds
+	LBVH,       //!< Linear BVH built from sorted Morton codes - fast, but lower quality
+	SBVH,       //!< BINNED_SAH with spatial splits - triangles can be referenced by multiple leaves
+};
+
+/**
+	\brief Format of wide BVH nodes
+*/
+enum class bvh_node_format
+{
+	FULL,      //!< Full precision float bounds
+	QUANTIZED, //!< 8-bit bounds relative to the parent - less memory traffic, more ALU work
+};
+
+}
@@ -0,0 +1,939 @@
+#include "bvh.hpp"
+#include <algorithm>
+#include <cstring>
+#include <tracy/Tracy.hpp>
+#include "linear_stack.hpp"
+#include "../../log.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BU_BVH_X86
+#endif
+
+using bu::rt::bvh_tree;
+using bu::rt::bvh_node4;
+using bu::rt::bvh_node8;
+using bu::rt::bvh_wide_node;
+using bu::rt::bvh_triangle_block;
+
+/**
+	\brief Returns the widest BVH variant supported by the CPU
+*/
+int bu::rt::get_bvh_width()
+{
+	static const int width = []{
+#ifdef BU_BVH_X86
+		int w = __builtin_cpu_supports("avx2") ? 8 : 4;
+#else
+		int w = 4;
+#endif
+		LOG_INFO << "Using " << w << "-wide BVH for ray traversal";
+		return w;
+	}();
+
+	return width;
+}
+
+/**
+	\brief Packs triangles of a leaf into blocks of N
+	\returns index of the first block
+*/
+template <int N>
+static unsigned int pack_leaf_triangles(
+	const bu::rt::triangle_intersection *intersections,
+	unsigned int first,
+	unsigned int count,
+	std::vector<bvh_triangle_block<N>> &blocks)
+{
+	unsigned int block_id = blocks.size();
+	for (unsigned int i = 0; i < count; i += N)
+	{
+		auto &block = blocks.emplace_back();
+		std::memset(&block, 0, sizeof(block));
+		block.first = first + i;
+
+		for (unsigned int k = 0; k < N && i + k < count; k++)
+		{
+			const auto &tri = intersections[first + i + k];
+			block.v0_x[k] = tri.v0.x;
+			block.v0_y[k] = tri.v0.y;
+			block.v0_z[k] = tri.v0.z;
+			block.e1_x[k] = tri.e1.x;
+			block.e1_y[k] = tri.e1.y;
+			block.e1_z[k] = tri.e1.z;
+			block.e2_x[k] = tri.e2.x;
+			block.e2_y[k] = tri.e2.y;
+			block.e2_z[k] = tri.e2.z;
+		}
+	}
+
+	return block_id;
+}
+
+/**
+	\brief Collapses binary BVH nodes into N-wide nodes
+
+	Each wide node starts with the two children of a binary node. The inner child
+	with the largest surface area is then repeatedly replaced by its own children
+	until all N slots are used or only leaves remain.
+*/
+template <int N>
+static void collapse_bvh(
+	const bu::rt::bvh_node *nodes,
+	const bu::rt::triangle_intersection *intersections,
+	std::vector<bvh_wide_node<N>> &wide,
+	std::vector<bvh_triangle_block<N>> &blocks,
+	std::vector<unsigned int> &parents)
+{
+	ZoneScopedN("BVH collapse");
+
+	wide.clear();
+	wide.emplace_back();
+	blocks.clear();
+	parents = {bu::rt::bvh_no_node};
+
+	// Binary node and the wide node it's collapsed into
+	std::vector<std::pair<unsigned int, unsigned int>> st;
+
+	// A leaf or empty root becomes the only child of the wide root
+	std::vector<unsigned int> children;
+	if (nodes[0].count != 0)
+		children.push_back(0);
+	else
+		st.push_back({0, 0});
+
+	while (!st.empty() || !children.empty())
+	{
+		unsigned int wide_id = 0;
+		if (children.empty())
+		{
+			auto [node_id, id] = st.back();
+			st.pop_back();
+			wide_id = id;
+			children = {node_id + 1, nodes[node_id].index};
+
+			while (children.size() < N)
+			{
+				int best = -1;
+				float best_area = -1;
+				for (auto i = 0u; i < children.size(); i++)
+				{
+					const auto &child = nodes[children[i]];
+					float area = child.aabb.get_area();
+					if (child.count == 0 && area > best_area)
+					{
+						best = i;
+						best_area = area;
+					}
+				}
+
+				if (best < 0) break;
+				unsigned int id = children[best];
+				children[best] = id + 1;
+				children.push_back(nodes[id].index);
+			}
+		}
+
+		for (int i = 0; i < N; i++)
+		{
+			auto &node = wide[wide_id];
+			if (i >= static_cast<int>(children.size()) || nodes[children[i]].count < 0)
+			{
+				node.min_x[i] = node.min_y[i] = node.min_z[i] = HUGE_VALF;
+				node.max_x[i] = node.max_y[i] = node.max_z[i] = -HUGE_VALF;
+				node.index[i] = 0;
+				node.count[i] = -1;
+				continue;
+			}
+
+			const auto &child = nodes[children[i]];
+			node.min_x[i] = child.aabb.min.x;
+			node.min_y[i] = child.aabb.min.y;
+			node.min_z[i] = child.aabb.min.z;
+			node.max_x[i] = child.aabb.max.x;
+			node.max_y[i] = child.aabb.max.y;
+			node.max_z[i] = child.aabb.max.z;
+			node.count[i] = child.count;
+			node.index[i] = child.index;
+
+			if (child.count == 0)
+			{
+				node.index[i] = wide.size();
+				st.push_back({children[i], node.index[i]});
+				wide.emplace_back();
+				parents.push_back(wide_id);
+			}
+			else
+				node.index[i] = pack_leaf_triangles(intersections, child.index, child.count, blocks);
+		}
+
+		children.clear();
+	}
+}
+
+/**
+	\brief Converts a power-of-two scale exponent (biased like in IEEE 754) to float
+*/
+static inline float decode_exponent(std::uint8_t e)
+{
+	std::uint32_t bits = static_cast<std::uint32_t>(e) << 23;
+	float f;
+	std::memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+/**
+	\brief Quantizes child bounds of a wide node relative to the node bounds
+*/
+template <int N>
+static void quantize_node(const bvh_wide_node<N> &src, bu::rt::bvh_quantized_node<N> &dst)
+{
+	const float *src_min[3] = {src.min_x, src.min_y, src.min_z};
+	const float *src_max[3] = {src.max_x, src.max_y, src.max_z};
+	std::uint8_t *dst_min[3] = {dst.min_x, dst.min_y, dst.min_z};
+	std::uint8_t *dst_max[3] = {dst.max_x, dst.max_y, dst.max_z};
+
+	// Node bounds - union of all used child slots
+	glm::vec3 lo{HUGE_VALF}, hi{-HUGE_VALF};
+	for (int i = 0; i < N; i++)
+		if (src.count[i] >= 0)
+		{
+			lo = glm::min(lo, glm::vec3{src.min_x[i], src.min_y[i], src.min_z[i]});
+			hi = glm::max(hi, glm::vec3{src.max_x[i], src.max_y[i], src.max_z[i]});
+		}
+
+	if (lo.x > hi.x)
+		lo = hi = glm::vec3{0.f};
+
+	dst.origin = lo;
+	for (int i = 0; i < N; i++)
+	{
+		dst.index[i] = src.index[i];
+		dst.count[i] = src.count[i];
+	}
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		// Smallest power of two, such that 255 steps cover the whole node
+		int e;
+		std::frexp((hi[axis] - lo[axis]) / 255.f, &e);
+		e = std::clamp(e, -126, 127);
+		dst.exponent[axis] = e + 127;
+		const float scale = decode_exponent(dst.exponent[axis]);
+
+		for (int i = 0; i < N; i++)
+		{
+			if (src.count[i] < 0)
+			{
+				dst_min[axis][i] = dst_max[axis][i] = 0;
+				continue;
+			}
+
+			// Round outwards and make sure decoding doesn't shrink the box
+			int qlo = std::clamp(static_cast<int>(std::floor((src_min[axis][i] - lo[axis]) / scale)), 0, 255);
+			int qhi = std::clamp(static_cast<int>(std::ceil((src_max[axis][i] - lo[axis]) / scale)), 0, 255);
+			while (qlo > 0 && lo[axis] + qlo * scale > src_min[axis][i]) qlo--;
+			while (qhi < 255 && lo[axis] + qhi * scale < src_max[axis][i]) qhi++;
+
+			dst_min[axis][i] = qlo;
+			dst_max[axis][i] = qhi;
+		}
+	}
+}
+
+template <int N>
+static void quantize_bvh(const std::vector<bvh_wide_node<N>> &wide, std::vector<bu::rt::bvh_quantized_node<N>> &quantized)
+{
+	ZoneScopedN("BVH quantization");
+
+	quantized.resize(wide.size());
+	for (auto i = 0u; i < wide.size(); i++)
+		quantize_node(wide[i], quantized[i]);
+}
+
+void bvh_tree::collapse(int width, bvh_node_format format)
+{
+	nodes4.clear();
+	nodes8.clear();
+	qnodes4.clear();
+	qnodes8.clear();
+	blocks4.clear();
+	blocks8.clear();
+	wide_parents.clear();
+	this->width = 2;
+	this->format = bvh_node_format::FULL;
+
+	if (width == 8)
+		collapse_bvh(nodes, intersections, nodes8, blocks8, wide_parents);
+	else if (width == 4)
+		collapse_bvh(nodes, intersections, nodes4, blocks4, wide_parents);
+	else
+		return;
+
+	this->width = width;
+
+	// Full precision nodes are not needed after quantization
+	if (format == bvh_node_format::QUANTIZED)
+	{
+		quantize_bvh(nodes8, qnodes8);
+		quantize_bvh(nodes4, qnodes4);
+		nodes8 = {};
+		nodes4 = {};
+		this->format = format;
+	}
+}
+
+/**
+	\brief Ray with precomputed reciprocal direction, as used by the wide node tests
+*/
+struct bvh_wide_ray
+{
+	glm::vec3 origin;
+	glm::vec3 inv_direction;
+};
+
+/**
+	\brief Tests a ray against all children of a wide node (portable version)
+	\returns bit mask of children hit closer than t_max - their distances are written to t
+*/
+template <int N>
+static inline int intersect_children(const bvh_wide_node<N> &node, const bvh_wide_ray &r, float t_max, float *t)
+{
+	int mask = 0;
+	for (int i = 0; i < N; i++)
+	{
+		float tx0 = (node.min_x[i] - r.origin.x) * r.inv_direction.x;
+		float tx1 = (node.max_x[i] - r.origin.x) * r.inv_direction.x;
+		float ty0 = (node.min_y[i] - r.origin.y) * r.inv_direction.y;
+		float ty1 = (node.max_y[i] - r.origin.y) * r.inv_direction.y;
+		float tz0 = (node.min_z[i] - r.origin.z) * r.inv_direction.z;
+		float tz1 = (node.max_z[i] - r.origin.z) * r.inv_direction.z;
+		float tmin = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::min(tz0, tz1));
+		float tmax = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::max(tz0, tz1));
+		t[i] = tmin;
+		mask |= (tmax >= 0 && tmin <= tmax && tmin < t_max) << i;
+	}
+
+	return mask;
+}
+
+#ifdef __SSE__
+template <>
+inline int intersect_children<4>(const bvh_node4 &node, const bvh_wide_ray &r, float t_max, float *t)
+{
+	const __m128 ox = _mm_set1_ps(r.origin.x);
+	const __m128 oy = _mm_set1_ps(r.origin.y);
+	const __m128 oz = _mm_set1_ps(r.origin.z);
+	const __m128 ix = _mm_set1_ps(r.inv_direction.x);
+	const __m128 iy = _mm_set1_ps(r.inv_direction.y);
+	const __m128 iz = _mm_set1_ps(r.inv_direction.z);
+
+	__m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_x), ox), ix);
+	__m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_x), ox), ix);
+	__m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_y), oy), iy);
+	__m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_y), oy), iy);
+	__m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_z), oz), iz);
+	__m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_z), oz), iz);
+
+	__m128 tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_min_ps(tz0, tz1));
+	__m128 tmax = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)), _mm_max_ps(tz0, tz1));
+
+	__m128 hit = _mm_and_ps(
+		_mm_and_ps(_mm_cmpge_ps(tmax, _mm_setzero_ps()), _mm_cmple_ps(tmin, tmax)),
+		_mm_cmplt_ps(tmin, _mm_set1_ps(t_max)));
+
+	_mm_storeu_ps(t, tmin);
+	return _mm_movemask_ps(hit);
+}
+#endif
+
+/**
+	\brief Tests a ray against all children of a quantized node (portable version)
+
+	Decoded planes are transformed directly into ray distances:
+	(origin + q * scale - o) / d = q * (scale / d) + (origin - o) / d
+*/
+template <int N>
+static inline int intersect_children_quantized(const bu::rt::bvh_quantized_node<N> &node, const bvh_wide_ray &r, float t_max, float *t)
+{
+	glm::vec3 scale{decode_exponent(node.exponent[0]), decode_exponent(node.exponent[1]), decode_exponent(node.exponent[2])};
+	glm::vec3 a = scale * r.inv_direction;
+	glm::vec3 b = (node.origin - r.origin) * r.inv_direction;
+
+	int mask = 0;
+	for (int i = 0; i < N; i++)
+	{
+		float tx0 = node.min_x[i] * a.x + b.x;
+		float tx1 = node.max_x[i] * a.x + b.x;
+		float ty0 = node.min_y[i] * a.y + b.y;
+		float ty1 = node.max_y[i] * a.y + b.y;
+		float tz0 = node.min_z[i] * a.z + b.z;
+		float tz1 = node.max_z[i] * a.z + b.z;
+		float tmin = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::min(tz0, tz1));
+		float tmax = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::max(tz0, tz1));
+		t[i] = tmin;
+		mask |= (tmax >= 0 && tmin <= tmax && tmin < t_max) << i;
+	}
+
+	return mask;
+}
+
+#ifdef __SSE4_1__
+template <>
+inline int intersect_children_quantized<4>(const bu::rt::bvh_qnode4 &node, const bvh_wide_ray &r, float t_max, float *t)
+{
+	auto load = [](const std::uint8_t *q)
+	{
+		std::int32_t v;
+		std::memcpy(&v, q, sizeof(v));
+		return _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(v)));
+	};
+
+	glm::vec3 scale{decode_exponent(node.exponent[0]), decode_exponent(node.exponent[1]), decode_exponent(node.exponent[2])};
+	glm::vec3 a = scale * r.inv_direction;
+	glm::vec3 b = (node.origin - r.origin) * r.inv_direction;
+	const __m128 ax = _mm_set1_ps(a.x), ay = _mm_set1_ps(a.y), az = _mm_set1_ps(a.z);
+	const __m128 bx = _mm_set1_ps(b.x), by = _mm_set1_ps(b.y), bz = _mm_set1_ps(b.z);
+
+	__m128 tx0 = _mm_add_ps(_mm_mul_ps(load(node.min_x), ax), bx);
+	__m128 tx1 = _mm_add_ps(_mm_mul_ps(load(node.max_x), ax), bx);
+	__m128 ty0 = _mm_add_ps(_mm_mul_ps(load(node.min_y), ay), by);
+	__m128 ty1 = _mm_add_ps(_mm_mul_ps(load(node.max_y), ay), by);
+	__m128 tz0 = _mm_add_ps(_mm_mul_ps(load(node.min_z), az), bz);
+	__m128 tz1 = _mm_add_ps(_mm_mul_ps(load(node.max_z), az), bz);
+
+	__m128 tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_min_ps(tz0, tz1));
+	__m128 tmax = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)), _mm_max_ps(tz0, tz1));
+
+	__m128 hit = _mm_and_ps(
+		_mm_and_ps(_mm_cmpge_ps(tmax, _mm_setzero_ps()), _mm_cmple_ps(tmin, tmax)),
+		_mm_cmplt_ps(tmin, _mm_set1_ps(t_max)));
+
+	_mm_storeu_ps(t, tmin);
+	return _mm_movemask_ps(hit);
+}
+#endif
+
+/**
+	\brief Intersects a ray with all triangles of a block (portable version)
+	\returns lane of the closest triangle hit closer than t_max or -1 - its t, u and v are written out
+*/
+template <int N>
+static inline int intersect_triangles(const bvh_triangle_block<N> &block, const bu::rt::ray &r, float t_max, float &t, float &u, float &v)
+{
+	int best = -1;
+	for (int i = 0; i < N; i++)
+	{
+		bu::rt::triangle_intersection tri{
+			{block.v0_x[i], block.v0_y[i], block.v0_z[i]},
+			{block.e1_x[i], block.e1_y[i], block.e1_z[i]},
+			{block.e2_x[i], block.e2_y[i], block.e2_z[i]}};
+
+		float tt, uu, vv;
+		if (ray_intersect_triangle(r, tri, tt, uu, vv) && tt < t_max)
+		{
+			t = t_max = tt;
+			u = uu;
+			v = vv;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+#ifdef __SSE__
+/**
+	\brief Intersects a ray with 4 triangles using SSE
+
+	All lanes are tested at once. Lanes which miss are set to infinity, so the
+	closest hit is found with a horizontal minimum instead of branching per triangle.
+*/
+template <>
+inline int intersect_triangles<4>(const bu::rt::bvh_triangle_block4 &block, const bu::rt::ray &r, float t_max, float &t, float &u, float &v)
+{
+	const __m128 dx = _mm_set1_ps(r.direction.x);
+	const __m128 dy = _mm_set1_ps(r.direction.y);
+	const __m128 dz = _mm_set1_ps(r.direction.z);
+	const __m128 e1x = _mm_load_ps(block.e1_x), e1y = _mm_load_ps(block.e1_y), e1z = _mm_load_ps(block.e1_z);
+	const __m128 e2x = _mm_load_ps(block.e2_x), e2y = _mm_load_ps(block.e2_y), e2z = _mm_load_ps(block.e2_z);
+
+	// P = D x E2
+	__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(e2y, dz));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(e2z, dx));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(e2x, dy));
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, e1x), _mm_mul_ps(py, e1y)), _mm_mul_ps(pz, e1z));
+	__m128 inv_det = _mm_div_ps(_mm_set1_ps(1.f), det);
+
+	// T = O - V0, Q = T x E1
+	__m128 tx = _mm_sub_ps(_mm_set1_ps(r.origin.x), _mm_load_ps(block.v0_x));
+	__m128 ty = _mm_sub_ps(_mm_set1_ps(r.origin.y), _mm_load_ps(block.v0_y));
+	__m128 tz = _mm_sub_ps(_mm_set1_ps(r.origin.z), _mm_load_ps(block.v0_z));
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(e1y, tz));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(e1z, tx));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(e1x, ty));
+
+	__m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(qx, e2x), _mm_mul_ps(qy, e2y)), _mm_mul_ps(qz, e2z)), inv_det);
+	__m128 uu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(px, tx), _mm_mul_ps(py, ty)), _mm_mul_ps(pz, tz)), inv_det);
+	__m128 vv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(qx, dx), _mm_mul_ps(qy, dy)), _mm_mul_ps(qz, dz)), inv_det);
+
+	const __m128 zero = _mm_setzero_ps();
+	__m128 hit = _mm_and_ps(_mm_cmpneq_ps(det, zero), _mm_cmpge_ps(uu, zero));
+	hit = _mm_and_ps(hit, _mm_cmpge_ps(vv, zero));
+	hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(uu, vv), _mm_set1_ps(1.f)));
+	hit = _mm_and_ps(hit, _mm_cmpge_ps(tt, zero));
+	hit = _mm_and_ps(hit, _mm_cmplt_ps(tt, _mm_set1_ps(t_max)));
+	if (!_mm_movemask_ps(hit))
+		return -1;
+
+	// Closest hit lane
+	__m128 masked_t = _mm_or_ps(_mm_and_ps(hit, tt), _mm_andnot_ps(hit, _mm_set1_ps(HUGE_VALF)));
+	__m128 min_t = _mm_min_ps(masked_t, _mm_shuffle_ps(masked_t, masked_t, _MM_SHUFFLE(2, 3, 0, 1)));
+	min_t = _mm_min_ps(min_t, _mm_shuffle_ps(min_t, min_t, _MM_SHUFFLE(1, 0, 3, 2)));
+	int lane = __builtin_ctz(_mm_movemask_ps(_mm_and_ps(hit, _mm_cmpeq_ps(masked_t, min_t))));
+
+	alignas(16) float ts[4], us[4], vs[4];
+	_mm_store_ps(ts, tt);
+	_mm_store_ps(us, uu);
+	_mm_store_ps(vs, vv);
+	t = ts[lane];
+	u = us[lane];
+	v = vs[lane];
+	return lane;
+}
+#endif
+
+/**
+	\brief Returns the slot of a child in its parent wide node
+*/
+template <int N, typename Node>
+static inline int get_child_slot(const Node &parent, unsigned int id)
+{
+	for (int i = 0; i < N; i++)
+		if (parent.count[i] == 0 && parent.index[i] == id)
+			return i;
+	return -1;
+}
+
+/**
+	\brief Finds the node closest hit traversal visits after it's done with the subtree of node id
+
+	Inner children of a wide node are visited in order of (distance, slot). Walking up the
+	tree, the first ancestor with an inner child after the one we came from still hit
+	closer than t_max gives the next node. This recovers entries dropped from the short stack.
+
+	\returns bvh_no_node if the traversal is finished
+*/
+template <int N, typename Node, typename F>
+static unsigned int get_next_wide_node(const Node *nodes, const unsigned int *parents, unsigned int id, const bvh_wide_ray &r, float t_max, F &&intersect)
+{
+	for (; id != 0; id = parents[id])
+	{
+		const auto &parent = nodes[parents[id]];
+		int c = get_child_slot<N>(parent, id);
+
+		alignas(32) float t[N];
+		int next = -1;
+		for (int mask = intersect(parent, r, t_max, t); mask; mask &= mask - 1)
+		{
+			int i = __builtin_ctz(mask);
+			if (parent.count[i] != 0) continue;
+
+			bool after_c = t[i] > t[c] || (t[i] == t[c] && i > c);
+			if (after_c && (next < 0 || t[i] < t[next]))
+				next = i;
+		}
+
+		if (next >= 0)
+			return parent.index[next];
+	}
+
+	return bu::rt::bvh_no_node;
+}
+
+/**
+	\brief Like get_next_wide_node(), but for any hit traversal which visits inner children in descending slot order
+*/
+template <int N, typename Node, typename F>
+static unsigned int get_next_wide_node_any_hit(const Node *nodes, const unsigned int *parents, unsigned int id, const bvh_wide_ray &r, float t_max, F &&intersect)
+{
+	for (; id != 0; id = parents[id])
+	{
+		const auto &parent = nodes[parents[id]];
+		int c = get_child_slot<N>(parent, id);
+
+		alignas(32) float t[N];
+		int mask = intersect(parent, r, t_max, t) & ((1 << c) - 1);
+		for (int i = c - 1; i >= 0; i--)
+			if ((mask >> i & 1) && parent.count[i] == 0)
+				return parent.index[i];
+	}
+
+	return bu::rt::bvh_no_node;
+}
+
+/**
+	\brief Closest hit traversal of a wide BVH
+
+	Children hit by the ray are sorted by distance. Leaves are intersected right
+	away (closest first) and inner nodes are pushed so the closest one is popped first.
+*/
+template <int N, typename Node, typename F, typename G>
+static inline __attribute__((always_inline)) bool traverse_wide(
+	const Node *nodes,
+	const bvh_triangle_block<N> *blocks,
+	const bu::rt::triangle *triangles,
+	const bu::rt::ray &r,
+	bu::rt::ray_hit &hit,
+	float t_max,
+	const unsigned int *parents,
+	F &&intersect,
+	G &&intersect_leaf)
+{
+	bu::rt::short_stack<unsigned int, 8 * N> st;
+	st.push(0);
+
+	const bvh_wide_ray wr{r.origin, 1.f / r.direction};
+
+	bu::rt::ray_hit best;
+	best.t = t_max;
+	best.triangle = nullptr;
+
+	unsigned int node_id = 0;
+	while (true)
+	{
+		// Recover from stack overflow
+		if (st.empty())
+		{
+			if (!st.overflowed()) break;
+			node_id = get_next_wide_node<N>(nodes, parents, node_id, wr, best.t, intersect);
+			if (node_id == bu::rt::bvh_no_node) break;
+			st.push(node_id);
+		}
+
+		node_id = st.top();
+		const auto &node = nodes[node_id];
+		st.pop();
+
+		alignas(32) float t[N];
+		int mask = intersect(node, wr, best.t, t);
+
+		// Sort hit children by distance
+		int order[N];
+		int hit_count = 0;
+		for (; mask; mask &= mask - 1)
+		{
+			int i = __builtin_ctz(mask);
+			if (node.count[i] < 0) continue;
+
+			int j = hit_count++;
+			for (; j > 0 && t[order[j - 1]] > t[i]; j--)
+				order[j] = order[j - 1];
+			order[j] = i;
+		}
+
+		// Leaves - closest first
+		for (int k = 0; k < hit_count; k++)
+		{
+			int i = order[k];
+			if (node.count[i] <= 0 || t[i] >= best.t) continue;
+
+			unsigned int block_count = (node.count[i] + N - 1) / N;
+			for (unsigned int j = node.index[i]; j < node.index[i] + block_count; j++)
+			{
+				float tt, u, v;
+				int lane = intersect_leaf(blocks[j], r, best.t, tt, u, v);
+				if (lane >= 0)
+				{
+					best.t = tt;
+					best.u = u;
+					best.v = v;
+					best.triangle = &triangles[blocks[j].first + lane];
+				}
+			}
+		}
+
+		// Inner nodes - the closest one is pushed last
+		for (int k = hit_count - 1; k >= 0; k--)
+		{
+			int i = order[k];
+			if (node.count[i] == 0 && t[i] < best.t)
+				st.push(node.index[i]);
+		}
+	}
+
+	if (best.triangle)
+	{
+		hit = best;
+		return true;
+	}
+	else
+		return false;
+}
+
+/**
+	\brief Any hit traversal of a wide BVH - returns as soon as a triangle closer than t_max is found
+*/
+template <int N, typename Node, typename F, typename G>
+static inline __attribute__((always_inline)) bool traverse_wide_occlusion(
+	const Node *nodes,
+	const bvh_triangle_block<N> *blocks,
+	const bu::rt::ray &r,
+	float t_max,
+	const unsigned int *parents,
+	F &&intersect,
+	G &&intersect_leaf)
+{
+	bu::rt::short_stack<unsigned int, 8 * N> st;
+	st.push(0);
+
+	const bvh_wide_ray wr{r.origin, 1.f / r.direction};
+
+	unsigned int node_id = 0;
+	while (true)
+	{
+		if (st.empty())
+		{
+			if (!st.overflowed()) break;
+			node_id = get_next_wide_node_any_hit<N>(nodes, parents, node_id, wr, t_max, intersect);
+			if (node_id == bu::rt::bvh_no_node) break;
+			st.push(node_id);
+		}
+
+		node_id = st.top();
+		const auto &node = nodes[node_id];
+		st.pop();
+
+		alignas(32) float t[N];
+		for (int mask = intersect(node, wr, t_max, t); mask; mask &= mask - 1)
+		{
+			int i = __builtin_ctz(mask);
+			if (node.count[i] < 0) continue;
+
+			if (node.count[i] == 0)
+			{
+				st.push(node.index[i]);
+				continue;
+			}
+
+			unsigned int block_count = (node.count[i] + N - 1) / N;
+			for (unsigned int j = node.index[i]; j < node.index[i] + block_count; j++)
+			{
+				float tt, u, v;
+				if (intersect_leaf(blocks[j], r, t_max, tt, u, v) >= 0)
+					return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+bool bvh_tree::test_ray4(const rt::ray &r, rt::ray_hit &hit, float t_max) const
+{
+	return traverse_wide<4>(nodes4.data(), blocks4.data(), triangles, r, hit, t_max, wide_parents.data(), intersect_children<4>, intersect_triangles<4>);
+}
+
+bool bvh_tree::test_ray_quantized4(const rt::ray &r, rt::ray_hit &hit, float t_max) const
+{
+	return traverse_wide<4>(qnodes4.data(), blocks4.data(), triangles, r, hit, t_max, wide_parents.data(), intersect_children_quantized<4>, intersect_triangles<4>);
+}
+
+#ifdef BU_BVH_X86
+/**
+	\brief Tests a ray against all children of an 8-wide node using AVX
+
+	Only called when the CPU supports AVX2 - see get_bvh_width().
+*/
+__attribute__((target("avx2")))
+static inline int intersect_children_avx2(const bvh_node8 &node, const bvh_wide_ray &r, float t_max, float *t)
+{
+	const __m256 ox = _mm256_set1_ps(r.origin.x);
+	const __m256 oy = _mm256_set1_ps(r.origin.y);
+	const __m256 oz = _mm256_set1_ps(r.origin.z);
+	const __m256 ix = _mm256_set1_ps(r.inv_direction.x);
+	const __m256 iy = _mm256_set1_ps(r.inv_direction.y);
+	const __m256 iz = _mm256_set1_ps(r.inv_direction.z);
+
+	__m256 tx0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.min_x), ox), ix);
+	__m256 tx1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.max_x), ox), ix);
+	__m256 ty0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.min_y), oy), iy);
+	__m256 ty1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.max_y), oy), iy);
+	__m256 tz0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.min_z), oz), iz);
+	__m256 tz1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.max_z), oz), iz);
+
+	__m256 tmin = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)), _mm256_min_ps(tz0, tz1));
+	__m256 tmax = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)), _mm256_max_ps(tz0, tz1));
+
+	__m256 hit = _mm256_and_ps(
+		_mm256_and_ps(_mm256_cmp_ps(tmax, _mm256_setzero_ps(), _CMP_GE_OQ), _mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ)),
+		_mm256_cmp_ps(tmin, _mm256_set1_ps(t_max), _CMP_LT_OQ));
+
+	_mm256_store_ps(t, tmin);
+	return _mm256_movemask_ps(hit);
+}
+
+/**
+	\brief Loads 8 quantized values and converts them to floats
+*/
+__attribute__((target("avx2")))
+static inline __m256 load_quantized_avx2(const std::uint8_t *q)
+{
+	return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(q))));
+}
+
+/**
+	\brief Tests a ray against all children of a quantized 8-wide node using AVX2
+*/
+__attribute__((target("avx2")))
+static inline int intersect_children_quantized_avx2(const bu::rt::bvh_qnode8 &node, const bvh_wide_ray &r, float t_max, float *t)
+{
+	glm::vec3 scale{decode_exponent(node.exponent[0]), decode_exponent(node.exponent[1]), decode_exponent(node.exponent[2])};
+	glm::vec3 a = scale * r.inv_direction;
+	glm::vec3 b = (node.origin - r.origin) * r.inv_direction;
+	const __m256 ax = _mm256_set1_ps(a.x), ay = _mm256_set1_ps(a.y), az = _mm256_set1_ps(a.z);
+	const __m256 bx = _mm256_set1_ps(b.x), by = _mm256_set1_ps(b.y), bz = _mm256_set1_ps(b.z);
+
+	__m256 tx0 = _mm256_add_ps(_mm256_mul_ps(load_quantized_avx2(node.min_x), ax), bx);
+	__m256 tx1 = _mm256_add_ps(_mm256_mul_ps(load_quantized_avx2(node.max_x), ax), bx);
+	__m256 ty0 = _mm256_add_ps(_mm256_mul_ps(load_quantized_avx2(node.min_y), ay), by);
+	__m256 ty1 = _mm256_add_ps(_mm256_mul_ps(load_quantized_avx2(node.max_y), ay), by);
+	__m256 tz0 = _mm256_add_ps(_mm256_mul_ps(load_quantized_avx2(node.min_z), az), bz);
+	__m256 tz1 = _mm256_add_ps(_mm256_mul_ps(load_quantized_avx2(node.max_z), az), bz);
+
+	__m256 tmin = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)), _mm256_min_ps(tz0, tz1));
+	__m256 tmax = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)), _mm256_max_ps(tz0, tz1));
+
+	__m256 hit = _mm256_and_ps(
+		_mm256_and_ps(_mm256_cmp_ps(tmax, _mm256_setzero_ps(), _CMP_GE_OQ), _mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ)),
+		_mm256_cmp_ps(tmin, _mm256_set1_ps(t_max), _CMP_LT_OQ));
+
+	_mm256_store_ps(t, tmin);
+	return _mm256_movemask_ps(hit);
+}
+
+/**
+	\brief Intersects a ray with 8 triangles using AVX - see the SSE version
+*/
+__attribute__((target("avx2")))
+static inline int intersect_triangles_avx2(const bu::rt::bvh_triangle_block8 &block, const bu::rt::ray &r, float t_max, float &t, float &u, float &v)
+{
+	const __m256 dx = _mm256_set1_ps(r.direction.x);
+	const __m256 dy = _mm256_set1_ps(r.direction.y);
+	const __m256 dz = _mm256_set1_ps(r.direction.z);
+	const __m256 e1x = _mm256_load_ps(block.e1_x), e1y = _mm256_load_ps(block.e1_y), e1z = _mm256_load_ps(block.e1_z);
+	const __m256 e2x = _mm256_load_ps(block.e2_x), e2y = _mm256_load_ps(block.e2_y), e2z = _mm256_load_ps(block.e2_z);
+
+	// P = D x E2
+	__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(e2y, dz));
+	__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(e2z, dx));
+	__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(e2x, dy));
+	__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, e1x), _mm256_mul_ps(py, e1y)), _mm256_mul_ps(pz, e1z));
+	__m256 inv_det = _mm256_div_ps(_mm256_set1_ps(1.f), det);
+
+	// T = O - V0, Q = T x E1
+	__m256 tx = _mm256_sub_ps(_mm256_set1_ps(r.origin.x), _mm256_load_ps(block.v0_x));
+	__m256 ty = _mm256_sub_ps(_mm256_set1_ps(r.origin.y), _mm256_load_ps(block.v0_y));
+	__m256 tz = _mm256_sub_ps(_mm256_set1_ps(r.origin.z), _mm256_load_ps(block.v0_z));
+	__m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(e1y, tz));
+	__m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(e1z, tx));
+	__m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(e1x, ty));
+
+	__m256 tt = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(qx, e2x), _mm256_mul_ps(qy, e2y)), _mm256_mul_ps(qz, e2z)), inv_det);
+	__m256 uu = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, tx), _mm256_mul_ps(py, ty)), _mm256_mul_ps(pz, tz)), inv_det);
+	__m256 vv = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(qx, dx), _mm256_mul_ps(qy, dy)), _mm256_mul_ps(qz, dz)), inv_det);
+
+	const __m256 zero = _mm256_setzero_ps();
+	__m256 hit = _mm256_and_ps(_mm256_cmp_ps(det, zero, _CMP_NEQ_OQ), _mm256_cmp_ps(uu, zero, _CMP_GE_OQ));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(vv, zero, _CMP_GE_OQ));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_add_ps(uu, vv), _mm256_set1_ps(1.f), _CMP_LE_OQ));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(tt, zero, _CMP_GE_OQ));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(tt, _mm256_set1_ps(t_max), _CMP_LT_OQ));
+	if (!_mm256_movemask_ps(hit))
+		return -1;
+
+	// Closest hit lane
+	__m256 masked_t = _mm256_blendv_ps(_mm256_set1_ps(HUGE_VALF), tt, hit);
+	__m256 min_t = _mm256_min_ps(masked_t, _mm256_permute2f128_ps(masked_t, masked_t, 1));
+	min_t = _mm256_min_ps(min_t, _mm256_shuffle_ps(min_t, min_t, _MM_SHUFFLE(2, 3, 0, 1)));
+	min_t = _mm256_min_ps(min_t, _mm256_shuffle_ps(min_t, min_t, _MM_SHUFFLE(1, 0, 3, 2)));
+	int lane = __builtin_ctz(_mm256_movemask_ps(_mm256_and_ps(hit, _mm256_cmp_ps(masked_t, min_t, _CMP_EQ_OQ))));
+
+	alignas(32) float ts[8], us[8], vs[8];
+	_mm256_store_ps(ts, tt);
+	_mm256_store_ps(us, uu);
+	_mm256_store_ps(vs, vv);
+	t = ts[lane];
+	u = us[lane];
+	v = vs[lane];
+	return lane;
+}
+
+__attribute__((target("avx2")))
+static bool test_ray_quantized_avx2(const bu::rt::bvh_qnode8 *nodes, const bu::rt::bvh_triangle_block8 *blocks, const unsigned int *parents, const bu::rt::triangle *triangles, const bu::rt::ray &r, bu::rt::ray_hit &hit, float t_max)
+{
+	return traverse_wide<8>(nodes, blocks, triangles, r, hit, t_max, parents, intersect_children_quantized_avx2, intersect_triangles_avx2);
+}
+
+__attribute__((target("avx2")))
+static bool test_occlusion_quantized_avx2(const bu::rt::bvh_qnode8 *nodes, const bu::rt::bvh_triangle_block8 *blocks, const unsigned int *parents, const bu::rt::ray &r, float t_max)
+{
+	return traverse_wide_occlusion<8>(nodes, blocks, r, t_max, parents, intersect_children_quantized_avx2, intersect_triangles_avx2);
+}
+
+__attribute__((target("avx2")))
+static bool test_occlusion_avx2(const bvh_node8 *nodes, const bu::rt::bvh_triangle_block8 *blocks, const unsigned int *parents, const bu::rt::ray &r, float t_max)
+{
+	return traverse_wide_occlusion<8>(nodes, blocks, r, t_max, parents, intersect_children_avx2, intersect_triangles_avx2);
+}
+
+/**
+	\brief 8-wide traversal compiled for AVX2 regardless of the global target
+*/
+__attribute__((target("avx2")))
+static bool test_ray_avx2(const bvh_node8 *nodes, const bu::rt::bvh_triangle_block8 *blocks, const unsigned int *parents, const bu::rt::triangle *triangles, const bu::rt::ray &r, bu::rt::ray_hit &hit, float t_max)
+{
+	return traverse_wide<8>(nodes, blocks, triangles, r, hit, t_max, parents, intersect_children_avx2, intersect_triangles_avx2);
+}
+#endif
+
+bool bvh_tree::test_ray8(const rt::ray &r, rt::ray_hit &hit, float t_max) const
+{
+#ifdef BU_BVH_X86
+	return test_ray_avx2(nodes8.data(), blocks8.data(), wide_parents.data(), triangles, r, hit, t_max);
+#else
+	return traverse_wide<8>(nodes8.data(), blocks8.data(), triangles, r, hit, t_max, wide_parents.data(), intersect_children<8>, intersect_triangles<8>);
+#endif
+}
+
+bool bvh_tree::test_ray_quantized8(const rt::ray &r, rt::ray_hit &hit, float t_max) const
+{
+#ifdef BU_BVH_X86
+	return test_ray_quantized_avx2(qnodes8.data(), blocks8.data(), wide_parents.data(), triangles, r, hit, t_max);
+#else
+	return traverse_wide<8>(qnodes8.data(), blocks8.data(), triangles, r, hit, t_max, wide_parents.data(), intersect_children_quantized<8>, intersect_triangles<8>);
+#endif
+}
+
+bool bvh_tree::test_occlusion_wide(const rt::ray &r, float t_max) const
+{
+	if (width == 8)
+	{
+#ifdef BU_BVH_X86
+		if (format == bvh_node_format::QUANTIZED)
+			return test_occlusion_quantized_avx2(qnodes8.data(), blocks8.data(), wide_parents.data(), r, t_max);
+		else
+			return test_occlusion_avx2(nodes8.data(), blocks8.data(), wide_parents.data(), r, t_max);
+#else
+		if (format == bvh_node_format::QUANTIZED)
+			return traverse_wide_occlusion<8>(qnodes8.data(), blocks8.data(), r, t_max, wide_parents.data(), intersect_children_quantized<8>, intersect_triangles<8>);
+		else
+			return traverse_wide_occlusion<8>(nodes8.data(), blocks8.data(), r, t_max, wide_parents.data(), intersect_children<8>, intersect_triangles<8>);
+#endif
+	}
+
+	if (format == bvh_node_format::QUANTIZED)
+		return traverse_wide_occlusion<4>(qnodes4.data(), blocks4.data(), r, t_max, wide_parents.data(), intersect_children_quantized<4>, intersect_triangles<4>);
+	else
+		return traverse_wide_occlusion<4>(nodes4.data(), blocks4.data(), r, t_max, wide_parents.data(), intersect_children<4>, intersect_triangles<4>);
+}
\ No newline at end of file
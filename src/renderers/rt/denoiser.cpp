@@ -0,0 +1,178 @@
+#include "denoiser.hpp"
+#include <cmath>
+#include <algorithm>
+#include <tracy/Tracy.hpp>
+#include "../../task_scheduler.hpp"
+
+using bu::rt::denoiser;
+
+static inline float luminance(const glm::vec3 &c)
+{
+	return glm::dot(c, glm::vec3{0.2126f, 0.7152f, 0.0722f});
+}
+
+denoiser::denoiser(const denoiser_params &params) :
+	m_params(params)
+{
+}
+
+/**
+	\brief Denoises the image
+	\param result output colors with alpha set to 1 (0 for pixels without samples),
+		so it can be drawn just like the sampled image data
+*/
+void denoiser::denoise(const sampled_image &image, std::vector<glm::vec4> &result)
+{
+	ZoneScopedN("denoiser::denoise()");
+
+	prepare(image);
+
+	int src = 0;
+	for (int i = 0; i < m_params.iterations; i++, src ^= 1)
+		filter(m_color[src], m_color[src ^ 1], 1 << i);
+
+	// Put the albedo back
+	int n = m_size.x * m_size.y;
+	result.resize(n);
+	for (int i = 0; i < n; i++)
+		result[i] = m_valid[i] ? glm::vec4{glm::vec3{m_color[src][i]} * m_albedo[i], 1.f} : glm::vec4{0.f};
+}
+
+void denoiser::prepare(const sampled_image &image)
+{
+	ZoneScopedN("Denoiser prepare");
+
+	m_size = image.size;
+	int n = m_size.x * m_size.y;
+	m_albedo.resize(n);
+	m_normal.resize(n);
+	m_depth.resize(n);
+	m_valid.resize(n);
+	m_color[0].resize(n);
+	m_color[1].resize(n);
+
+	auto prepare_pixels = [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+			prepare_pixel(image, i);
+	};
+
+	bu::task_scheduler::get().parallel_for(0, n, 65536, prepare_pixels);
+}
+
+/**
+	\brief Resolves the AOVs of one pixel and demodulates the albedo from its color
+*/
+void denoiser::prepare_pixel(const sampled_image &image, int i)
+{
+	const auto &pixel = image.data[i];
+	const auto &m = image.moments[i];
+	const auto &aov = image.aovs[i];
+	float count = m.z;
+
+	m_valid[i] = pixel.w > 0 && count > 0;
+	if (!m_valid[i])
+	{
+		m_albedo[i] = glm::vec3{1.f};
+		m_normal[i] = glm::vec3{0.f};
+		m_depth[i] = 0.f;
+		m_color[0][i] = glm::vec4{0.f};
+		return;
+	}
+
+	m_albedo[i] = glm::max(aov.albedo / count, glm::vec3{1e-3f});
+	m_normal[i] = glm::dot(aov.normal, aov.normal) > 0 ? glm::normalize(aov.normal) : glm::vec3{0.f};
+	m_depth[i] = aov.depth / count;
+
+	// Variance of the mean luminance - with one sample, the second moment has to do
+	float mean = m.x / count;
+	float variance = count > 1 ? std::max(0.f, m.y / count - mean * mean) / (count - 1) : m.y;
+	float albedo_lum = std::max(luminance(m_albedo[i]), 1e-3f);
+
+	glm::vec3 color = glm::vec3{pixel} / pixel.w;
+	m_color[0][i] = glm::vec4{color / m_albedo[i], variance / (albedo_lum * albedo_lum)};
+}
+
+/**
+	\brief One à-trous pass with taps step pixels apart
+*/
+void denoiser::filter(const std::vector<glm::vec4> &src, std::vector<glm::vec4> &dst, int step) const
+{
+	ZoneScopedN("Denoiser pass");
+
+	const float kernel[5] = {1.f / 16.f, 1.f / 4.f, 3.f / 8.f, 1.f / 4.f, 1.f / 16.f};
+	const glm::ivec2 size = m_size;
+
+	// Inverse distances of the taps in pixels
+	float inv_distance[5][5];
+	for (int dy = -2; dy <= 2; dy++)
+		for (int dx = -2; dx <= 2; dx++)
+			inv_distance[dy + 2][dx + 2] = dx || dy ? 1.f / (step * std::sqrt(static_cast<float>(dx * dx + dy * dy))) : 0.f;
+
+	auto filter_rows = [&](int row_begin, int row_end)
+	{
+		for (int y = row_begin; y < row_end; y++)
+			for (int x = 0; x < size.x; x++)
+			{
+				int p = x + y * size.x;
+				if (!m_valid[p])
+				{
+					dst[p] = src[p];
+					continue;
+				}
+
+				// Variance blurred with a 3x3 Gaussian is more robust for the luminance weight
+				float variance = 0.f, variance_weight = 0.f;
+				for (int dy = -1; dy <= 1; dy++)
+					for (int dx = -1; dx <= 1; dx++)
+					{
+						int qx = x + dx, qy = y + dy;
+						if (qx < 0 || qy < 0 || qx >= size.x || qy >= size.y || !m_valid[qx + qy * size.x])
+							continue;
+
+						float w = kernel[dx + 2] * kernel[dy + 2];
+						variance += w * src[qx + qy * size.x].w;
+						variance_weight += w;
+					}
+
+				float lum_p = luminance(glm::vec3{src[p]});
+				float lum_scale = 1.f / (m_params.sigma_luminance * std::sqrt(std::max(variance / variance_weight, 0.f)) + 1e-6f);
+				const auto &normal_p = m_normal[p];
+				bool surface_p = m_depth[p] > 0;
+				float depth_scale = surface_p ? 1.f / (m_params.sigma_depth * m_depth[p]) : 0.f;
+
+				glm::vec3 sum{0.f};
+				float sum_variance = 0.f;
+				float sum_weight = 0.f;
+				for (int dy = -2; dy <= 2; dy++)
+					for (int dx = -2; dx <= 2; dx++)
+					{
+						int qx = x + dx * step, qy = y + dy * step;
+						if (qx < 0 || qy < 0 || qx >= size.x || qy >= size.y)
+							continue;
+
+						int q = qx + qy * size.x;
+						if (!m_valid[q] || (m_depth[q] > 0) != surface_p)
+							continue;
+
+						// All the edge-stopping functions combined in one exponential
+						float e = std::abs(lum_p - luminance(glm::vec3{src[q]})) * lum_scale;
+						if (surface_p)
+						{
+							e += std::abs(m_depth[p] - m_depth[q]) * depth_scale * inv_distance[dy + 2][dx + 2];
+							e += m_params.sigma_normal * std::max(0.f, 1.f - glm::dot(normal_p, m_normal[q]));
+						}
+
+						float w = kernel[dx + 2] * kernel[dy + 2] * std::exp(-e);
+						sum += w * glm::vec3{src[q]};
+						sum_variance += w * w * src[q].w;
+						sum_weight += w;
+					}
+
+				dst[p] = glm::vec4{sum / sum_weight, sum_variance / (sum_weight * sum_weight)};
+			}
+	};
+
+	auto &scheduler = bu::task_scheduler::get();
+	scheduler.parallel_for(0, size.y, 8, filter_rows);
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include "sampled_image.hpp"
+
+namespace bu::rt {
+
+/**
+	\brief Parameters of the denoiser
+*/
+struct denoiser_params
+{
+	int iterations = 5;           //!< Number of à-trous passes - the filter radius is 2^(iterations + 1) pixels
+	float sigma_luminance = 4.f;  //!< Tolerance of luminance differences in multiples of their standard deviation
+	float sigma_normal = 128.f;   //!< Sharpness of the normal weight exp(-sigma * (1 - dot(n_p, n_q))) - close to dot(n_p, n_q)^sigma
+	float sigma_depth = 0.02f;    //!< Tolerance of depth differences relative to the depth, per pixel of distance
+};
+
+/**
+	\brief Edge-aware à-trous wavelet denoiser for the path traced image
+
+	The noisy color is divided by the first-hit albedo and the remaining
+	illumination is blurred by a sequence of sparse 5x5 filters with growing
+	spacing. The filter weights drop across edges in the normal and depth AOVs
+	and across luminance differences large compared to the estimated noise.
+	The variance estimate is filtered along with the color, so the luminance
+	weight becomes stricter with every pass.
+
+	\note Based on: Schied et al. - Spatiotemporal Variance-Guided Filtering (2017),
+	only the spatial part
+*/
+class denoiser
+{
+public:
+	explicit denoiser(const denoiser_params &params = {});
+
+	void denoise(const sampled_image &image, std::vector<glm::vec4> &result);
+
+private:
+	void prepare(const sampled_image &image);
+	void prepare_pixel(const sampled_image &image, int i);
+	void filter(const std::vector<glm::vec4> &src, std::vector<glm::vec4> &dst, int step) const;
+
+	denoiser_params m_params;
+	glm::ivec2 m_size{0};
+
+	// Per-pixel AOVs
+	std::vector<glm::vec3> m_albedo;
+	std::vector<glm::vec3> m_normal;
+	std::vector<float> m_depth;
+	std::vector<std::uint8_t> m_valid; //!< Whether the pixel has any samples
+
+	// Illumination and its variance, ping-ponged between passes
+	std::vector<glm::vec4> m_color[2];
+};
+
+}
@@ -1,13 +1,16 @@
 #include "job.hpp"
-#include <random>
 #include <thread>
 #include <algorithm>
+#include <cstdint>
 #include <tracy/Tracy.hpp>
 #include "../../log.hpp"
 #include "ray.hpp"
-#include "bvh.hpp"
+#include "ray_packet.hpp"
+#include "tlas.hpp"
 #include "rt.hpp"
 #include "kernel.hpp"
+#include "wavefront.hpp"
+#include "denoiser.hpp"
 #include "scene.hpp"
 #include <glm/gtx/string_cast.hpp>
 
@@ -15,9 +18,11 @@ using namespace std::chrono_literals;
 using bu::splat_bucket_pool;
 using bu::rt_renderer_job;
 using bu::rt_job_context;
+using bu::rt_worker_pool;
 
 static bool child_job(std::shared_ptr<rt_job_context> ctx, int job_id);
 static bool splatter_job(std::shared_ptr<rt_job_context> ctx, int job_id);
+static bool denoiser_job(std::shared_ptr<rt_job_context> ctx, int job_id);
 
 void splat_bucket_pool::submit(std::unique_ptr<rt::splat_bucket> bucket)
 {
@@ -39,28 +44,357 @@ std::unique_ptr<bu::rt::splat_bucket> splat_bucket_pool::acquire()
 	}
 }
 
+/**
+	\brief Interleaves lower 16 bits of x and y
+*/
+static std::uint32_t morton_code_2d(std::uint32_t x, std::uint32_t y)
+{
+	auto expand = [](std::uint32_t v)
+	{
+		v &= 0xffff;
+		v = (v | (v << 8)) & 0x00ff00ff;
+		v = (v | (v << 4)) & 0x0f0f0f0f;
+		v = (v | (v << 2)) & 0x33333333;
+		v = (v | (v << 1)) & 0x55555555;
+		return v;
+	};
+
+	return expand(x) | (expand(y) << 1);
+}
+
+/**
+	\brief Returns the settings with the automatic values replaced by the actual ones
+*/
+static bu::rt_settings resolve_settings(const bu::rt_settings &settings)
+{
+	auto resolved = settings;
+	resolved.sanitize();
+	resolved.thread_count = resolved.get_thread_count();
+	resolved.bucket_count = resolved.get_bucket_count();
+	return resolved;
+}
+
+/**
+	\brief Returns pixel offsets within a tile sorted along the Morton curve
+
+	Consecutive ray packets then cover compact square blocks of pixels.
+*/
+static std::vector<glm::ivec2> get_tile_order(int tile_size)
+{
+	std::vector<glm::ivec2> order;
+	order.reserve(tile_size * tile_size);
+	for (int y = 0; y < tile_size; y++)
+		for (int x = 0; x < tile_size; x++)
+			order.emplace_back(x, y);
+
+	std::sort(order.begin(), order.end(), [](const auto &a, const auto &b)
+	{
+		return morton_code_2d(a.x, a.y) < morton_code_2d(b.x, b.y);
+	});
+
+	return order;
+}
+
 rt_job_context::rt_job_context(
 	std::shared_ptr<const rt::scene> scene,
 	const bu::camera &camera,
 	const glm::ivec2 &viewport_size,
-	int bucket_count,
-	int thread_count,
-	int tile_size) :
+	const bu::rt_settings &settings) :
 	active(true),
+	settings(resolve_settings(settings)),
 	scene(std::move(scene)),
 	ray_caster(camera),
 	image(viewport_size),
 	inhibit_splat(false),
-	bucket_count(bucket_count),
-	thread_count(thread_count),
-	tile_size(tile_size)
+	tile_order(get_tile_order(this->settings.tile_size)),
+	pixel_samples(viewport_size.x * viewport_size.y),
+	tile_grid((viewport_size + this->settings.tile_size - 1) / this->settings.tile_size),
+	next_tile(0),
+	tile_converged(tile_grid.x * tile_grid.y),
+	tile_splatted(tile_grid.x * tile_grid.y),
+	start_time(std::chrono::steady_clock::now()),
+	tile_passes(tile_grid.x * tile_grid.y)
 {
-	int bucket_size = tile_size * tile_size;
-	LOG_INFO << "Creating " << bucket_count << " new splat buckets (size = " << bucket_size << ")";
-	for (int i = 0; i < bucket_count; i++)
+	int bucket_size = this->settings.tile_size * this->settings.tile_size;
+	LOG_INFO << "Creating " << this->settings.bucket_count << " new splat buckets (size = " << bucket_size << ")";
+	for (int i = 0; i < this->settings.bucket_count; i++)
 		clean_pool.submit(std::make_unique<rt::splat_bucket>(bucket_size));
 }
 
+/**
+	\brief Checks whether the job's memory can be reused for a new job
+*/
+bool rt_job_context::is_reusable_for(const glm::ivec2 &viewport_size, const bu::rt_settings &settings) const
+{
+	return image.size == viewport_size && resolve_settings(settings).tile_size == this->settings.tile_size;
+}
+
+/**
+	\brief Discards the samples of a stopped job - no threads may be using the context
+
+	This is the expensive part of the reuse, so the worker pool does it in the background.
+*/
+void rt_job_context::clear()
+{
+	ZoneScopedN("RT job context clear");
+
+	image.clear();
+	inhibit_splat = false;
+	denoised.clear();
+
+	// No other thread uses the context, relaxed stores are enough
+	for (auto &n : pixel_samples)
+		n.store(0, std::memory_order_relaxed);
+	for (auto &converged : tile_converged)
+		converged.store(false, std::memory_order_relaxed);
+	for (auto &splatted : tile_splatted)
+		splatted.store(false, std::memory_order_relaxed);
+	for (auto &passes : tile_passes)
+		passes.store(0, std::memory_order_relaxed);
+
+	// Collect all the buckets
+	for (auto &bucket : dirty_pool.buckets)
+		clean_pool.buckets.push_back(std::move(bucket));
+	dirty_pool.buckets.clear();
+}
+
+/**
+	\brief Prepares a cleared context for a new job of the same size
+*/
+void rt_job_context::reset(
+	std::shared_ptr<const rt::scene> scene,
+	const bu::camera &camera,
+	const bu::rt_settings &settings)
+{
+	this->settings = resolve_settings(settings);
+	this->scene = std::move(scene);
+	ray_caster = bu::camera_ray_caster{camera};
+	next_tile = 0;
+	start_time = std::chrono::steady_clock::now();
+
+	// Add or drop buckets if the count has changed
+	auto &buckets = clean_pool.buckets;
+	int bucket_count = this->settings.bucket_count;
+	int bucket_size = this->settings.tile_size * this->settings.tile_size;
+	LOG_INFO << "Reusing " << std::min<int>(buckets.size(), bucket_count) << " splat buckets (size = " << bucket_size << ")";
+	while (static_cast<int>(buckets.size()) < bucket_count)
+		buckets.push_back(std::make_unique<rt::splat_bucket>(bucket_size));
+	buckets.resize(bucket_count);
+
+	active = true;
+}
+
+/**
+	\brief Returns the next tile to be sampled - the tiles are visited in turns, skipping
+	the converged ones and the ones which already have the target number of samples
+	\returns -1 if all tiles are finished or the time budget has run out
+*/
+int rt_job_context::get_next_tile()
+{
+	if (settings.time_budget > 0 && std::chrono::steady_clock::now() - start_time > std::chrono::duration<float>{settings.time_budget})
+		return -1;
+
+	int tile_count = tile_converged.size();
+	for (int i = 0; i < tile_count; i++)
+	{
+		int tile = next_tile++ % tile_count;
+		if (tile_converged[tile])
+			continue;
+
+		if (settings.target_samples > 0 && tile_passes[tile] >= static_cast<std::uint32_t>(settings.target_samples))
+			continue;
+
+		tile_passes[tile]++;
+		return tile;
+	}
+
+	return -1;
+}
+
+
+rt_worker_pool::rt_worker_pool()
+{
+	spawn([](std::shared_ptr<rt_job_context> ctx)
+	{
+		int job_id = ctx->settings.thread_count;
+		splatter_job(std::move(ctx), job_id);
+	});
+
+	spawn([](std::shared_ptr<rt_job_context> ctx)
+	{
+		int job_id = ctx->settings.thread_count + 1;
+		if (ctx->settings.denoise)
+			denoiser_job(std::move(ctx), job_id);
+	});
+}
+
+/**
+	This blocks until all threads finish their work
+*/
+rt_worker_pool::~rt_worker_pool()
+{
+	{
+		std::lock_guard lock{m_mutex};
+		stop_current();
+		m_quit = true;
+	}
+	m_cv.notify_all();
+
+	for (auto &t : m_threads)
+		t.join();
+}
+
+/**
+	\brief Stops the running job and starts a new one
+	\returns context of the new job
+*/
+std::shared_ptr<rt_job_context> rt_worker_pool::start(
+	std::shared_ptr<const bu::rt::scene> scene,
+	const bu::camera &camera,
+	const glm::ivec2 &viewport_size,
+	const bu::rt_settings &settings)
+{
+	ZoneScopedN("RT worker pool start");
+
+	std::shared_ptr<rt_job_context> job;
+	{
+		std::lock_guard lock{m_mutex};
+		stop_current();
+
+		// The retired job can only be reused once no thread holds it - no new references
+		// can be made, so once the count drops to one, it stays there
+		if (m_retired && m_retired.use_count() == 1 && m_retired->is_reusable_for(viewport_size, settings))
+		{
+			job = std::move(m_retired);
+			if (!m_retired_cleared)
+				job->clear();
+			job->reset(std::move(scene), camera, settings);
+		}
+		m_retired.reset();
+	}
+
+	if (!job)
+		job = std::make_shared<rt_job_context>(std::move(scene), camera, viewport_size, settings);
+
+	// Spawn tracing threads if this job needs more than ever before
+	int thread_count = job->settings.thread_count;
+	while (m_tracing_thread_count < thread_count)
+	{
+		int job_id = m_tracing_thread_count++;
+		spawn([job_id](std::shared_ptr<rt_job_context> ctx)
+		{
+			if (job_id < ctx->settings.thread_count)
+				child_job(std::move(ctx), job_id);
+		});
+	}
+
+	LOG_INFO << "Starting new RT job on " << thread_count << " threads";
+	{
+		std::lock_guard lock{m_mutex};
+		m_job = job;
+		m_generation++;
+	}
+	m_cv.notify_all();
+
+	return job;
+}
+
+/**
+	\brief Stops given job if it's still running - the threads return to waiting for the next one
+*/
+void rt_worker_pool::stop(const std::shared_ptr<rt_job_context> &job)
+{
+	{
+		std::lock_guard lock{m_mutex};
+		if (!job || job != m_job)
+			return;
+
+		stop_current();
+	}
+	m_cv.notify_all();
+}
+
+/**
+	\brief Deactivates the current job and keeps it for reuse - m_mutex must be locked
+*/
+void rt_worker_pool::stop_current()
+{
+	if (!m_job)
+		return;
+
+	LOG_INFO << "Requesting RT jobs to stop";
+	m_job->active = false;
+
+	// Wake the splatter up
+	{
+		std::lock_guard lock{m_job->dirty_pool.mut};
+	}
+	m_job->dirty_pool.cv.notify_all();
+
+	m_retired = std::move(m_job);
+	m_retired_cleared = false;
+	m_generation++;
+}
+
+/**
+	\brief Clears the retired job once the last thread has released it, so
+	that the next job can start right away
+*/
+void rt_worker_pool::clear_retired()
+{
+	std::shared_ptr<rt_job_context> job;
+	{
+		std::lock_guard lock{m_mutex};
+		if (!m_retired || m_retired_cleared || m_retired.use_count() != 1)
+			return;
+
+		job = std::move(m_retired);
+	}
+
+	job->clear();
+
+	// Put it back unless another job has been retired in the meantime
+	std::lock_guard lock{m_mutex};
+	if (!m_retired)
+	{
+		m_retired = std::move(job);
+		m_retired_cleared = true;
+	}
+}
+
+void rt_worker_pool::spawn(job_function function)
+{
+	m_threads.emplace_back(&rt_worker_pool::worker_loop, this, std::move(function));
+}
+
+/**
+	\brief Runs the function for every new job until the pool is destroyed
+*/
+void rt_worker_pool::worker_loop(job_function function)
+{
+	std::uint64_t generation = 0;
+
+	while (true)
+	{
+		std::shared_ptr<rt_job_context> ctx;
+		{
+			std::unique_lock lock{m_mutex};
+			m_cv.wait(lock, [this, &generation]{return m_quit || m_generation != generation;});
+			if (m_quit)
+				return;
+
+			generation = m_generation;
+			ctx = m_job;
+		}
+
+		// The function gets the only reference, so the context is released as soon as it returns
+		if (ctx && ctx->active)
+			function(std::move(ctx));
+
+		clear_retired();
+	}
+}
+
 
 rt_renderer_job::rt_renderer_job(std::shared_ptr<bu::rt_context> context) :
 	m_context(std::move(context))
@@ -68,30 +402,22 @@ rt_renderer_job::rt_renderer_job(std::shared_ptr<bu::rt_context> context) :
 	LOG_INFO << "New RT job!";
 }
 
-/**
-	This blocks until all threads die
-*/
 rt_renderer_job::~rt_renderer_job()
 {
-	if (m_job_context && m_job_context->active)
-		m_job_context->active = false;
+	stop();
 	LOG_INFO << "RT job terminated!";
 }
 
 /**
-	Sets up a new activity flag for the new children
-	and spawns them. Accepts paremeters for the new render
+	Stops the previous job and starts a new one with given parameters on the worker pool
 */
 void rt_renderer_job::start(
 	std::shared_ptr<const bu::rt::scene> scene,
 	bu::camera &camera,
 	const glm::ivec2 &viewport_size,
-	int bucket_count,
-	int thread_count,
-	int tile_size)
+	const bu::rt_settings &settings)
 {
-	if (m_job_context && m_job_context->active)
-		stop();
+	stop();
 
 	if (!scene)
 	{
@@ -99,49 +425,40 @@ void rt_renderer_job::start(
 		throw std::runtime_error{"rt_renderer_job started without a valid scene"};
 	}
 
-	// Remove completed futures
-	m_futures.erase(std::remove_if(m_futures.begin(), m_futures.end(), [](auto &f){
-		return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
-	}), m_futures.end());
-
-	m_job_context = std::make_shared<rt_job_context>(
-		scene,
-		camera,
-		viewport_size,
-		bucket_count,
-		thread_count,
-		tile_size);
-
-	LOG_INFO << "Starting new RT jobs";
-	for (int i = 0; i < thread_count; i++)
-		m_futures.emplace_back(std::async(std::launch::async, child_job, m_job_context, i));
-
-	m_futures.emplace_back(std::async(std::launch::async, splatter_job, m_job_context, thread_count));
+	m_job_context = m_context->get_worker_pool().start(std::move(scene), camera, viewport_size, settings);
 }
 
 
 /**
-	Stops the rendering and lets the threads die on their own
+	Stops the rendering - the worker threads return to the pool
 */
 void rt_renderer_job::stop()
 {
 	if (m_job_context)
-	{
-		if (m_job_context->active)
-			LOG_INFO << "Requesting RT jobs to stop";
-		 m_job_context->active = false;
-	}
+		m_context->get_worker_pool().stop(m_job_context);
 	m_job_context.reset();
 }
 
 
 static bool child_job(std::shared_ptr<rt_job_context> ctx, int job_id)
 {
-	std::mt19937 rng(std::random_device{}() + job_id);
-	std::uniform_real_distribution<float> dist(0, 1);
+	// The buffers live as long as the worker thread, so they are reused by all its jobs
+
+	// One sampler per path of the bucket
+	thread_local std::vector<bu::rt::sampler> samplers;
 
-	for (int bucket_id = 0; ctx->active; bucket_id++)
-	{	
+	// Path states of the whole bucket in stream and wavefront mode
+	thread_local std::vector<bu::rt::path_state> paths;
+	thread_local std::vector<bu::rt::ray_hit> path_hits;
+	thread_local std::vector<bu::rt::ray> path_rays;
+	thread_local std::vector<glm::vec3> path_radiance;
+	thread_local std::vector<bu::rt::aov_sample> path_aovs;
+	thread_local bu::rt::wavefront_integrator wavefront;
+	const auto &settings = ctx->settings;
+	bool batched = settings.integrator != bu::rt::integrator_type::MEGAKERNEL;
+
+	while (ctx->active)
+	{
 		std::unique_ptr<bu::rt::splat_bucket> bucket;
 
 		// This should never stall
@@ -153,27 +470,107 @@ static bool child_job(std::shared_ptr<rt_job_context> ctx, int job_id)
 		}
 
 		if (!ctx->active) break;
-		
+
+		// Nothing to do once the whole image has converged
+		int tile = ctx->get_next_tile();
+		if (tile < 0)
+		{
+			ctx->clean_pool.submit(std::move(bucket));
+			std::this_thread::sleep_for(10ms);
+			continue;
+		}
+
 		{
 			ZoneScopedN("Bucket generation");
 
-			auto start_pos = glm::ivec2{0, (job_id * ctx->tile_size) % ctx->image.size.y};
+			// Tiles on the right and bottom edges may be smaller - their pixels are sampled more times
+			glm::ivec2 tile_min = ctx->get_tile_origin(tile);
+			glm::ivec2 tile_extent = glm::min(glm::ivec2{settings.tile_size}, ctx->image.size - tile_min);
+			bucket->tile = tile;
 
-			for (auto i = 0u; i < bucket->size && ctx->active; i++)
+			samplers.assign(bucket->size, bu::rt::sampler{settings.sampler});
+			if (batched)
 			{
-				auto &splat = bucket->data[i];
-				glm::ivec2 p = start_pos + glm::ivec2{i % ctx->tile_size, i / ctx->tile_size} + glm::ivec2{bucket_id * ctx->tile_size, 0};
-				p.y += (p.x / ctx->image.size.x) * ctx->thread_count * ctx->tile_size;
-				p.x %= ctx->image.size.x;
-				p.y %= ctx->image.size.y;
-				splat.pos = glm::vec2{p} + glm::vec2{dist(rng), dist(rng)};
-				auto ndc = (splat.pos / glm::vec2{ctx->image.size}) * 2.f - 1.f;
-				
-				bu::rt::ray r;
-				r.direction = ctx->ray_caster.get_direction(ndc);
-				r.origin = ctx->ray_caster.origin;
-				splat.color = bu::rt::trace_ray(*ctx->scene->bvh, *ctx->scene->materials, rng, r, 24);
-				splat.samples = 1;
+				path_rays.resize(bucket->size);
+				path_hits.resize(bucket->size);
+			}
+
+			// Primary rays are traced in packets (unless disabled in the settings), the rest
+			// of the paths ray by ray or, in stream and wavefront mode, together for the whole bucket
+			for (auto i = 0u; i < bucket->size && ctx->active; i += bu::rt::ray_packet_size)
+			{
+				bu::rt::ray_packet packet;
+				packet.origin = ctx->ray_caster.origin;
+				packet.size = std::min<int>(bucket->size - i, bu::rt::ray_packet_size);
+
+				for (int k = 0; k < packet.size; k++)
+				{
+					auto &splat = bucket->data[i + k];
+					glm::ivec2 offset = ctx->tile_order[i + k];
+					glm::ivec2 p = tile_min + glm::ivec2{offset.x % tile_extent.x, offset.y % tile_extent.y};
+
+					// The first two dimensions place the sample in the pixel
+					int pixel = p.y * ctx->image.size.x + p.x;
+					auto &sampler = samplers[i + k];
+					sampler.start_sample(pixel, ctx->pixel_samples[pixel]++);
+					splat.pos = glm::vec2{p} + sampler.get_2d();
+					auto ndc = (splat.pos / glm::vec2{ctx->image.size}) * 2.f - 1.f;
+					packet.set_direction(k, ctx->ray_caster.get_direction(ndc));
+				}
+
+				bu::rt::ray_packet_hit hits;
+				if (settings.packet_tracing)
+					ctx->scene->tlas->test_packet(packet, hits);
+
+				for (int k = 0; k < packet.size; k++)
+				{
+					auto &splat = bucket->data[i + k];
+					splat.samples = 1;
+
+					bu::rt::ray_hit hit;
+					if (settings.packet_tracing)
+						hit = hits.get_hit(k);
+					else if (!ctx->scene->tlas->test_ray(packet.get_ray(k), hit))
+						hit.triangle = nullptr;
+
+					if (batched)
+					{
+						path_rays[i + k] = packet.get_ray(k);
+						path_hits[i + k] = hit;
+					}
+					else
+						splat.color = bu::rt::trace_path(*ctx->scene, samplers[i + k], packet.get_ray(k), hit.triangle ? &hit : nullptr,
+							settings.max_bounces, settings.roulette_depth, &splat.aov);
+				}
+			}
+
+			if (settings.integrator == bu::rt::integrator_type::RAY_STREAMS && ctx->active)
+			{
+				paths.resize(bucket->size);
+				for (auto i = 0u; i < bucket->size; i++)
+				{
+					paths[i] = bu::rt::path_state{path_rays[i]};
+					paths[i].sampler = samplers[i];
+				}
+
+				bu::rt::trace_path_stream(*ctx->scene, paths, path_hits, settings.max_bounces, settings.roulette_depth);
+				for (auto i = 0u; i < bucket->size; i++)
+				{
+					bucket->data[i].color = paths[i].L;
+					bucket->data[i].aov = paths[i].aov;
+				}
+			}
+			else if (settings.integrator == bu::rt::integrator_type::WAVEFRONT && ctx->active)
+			{
+				path_radiance.resize(bucket->size);
+				path_aovs.resize(bucket->size);
+				wavefront.trace(*ctx->scene, samplers.data(), path_rays.data(), path_hits.data(), bucket->size, path_radiance.data(), path_aovs.data(),
+					settings.max_bounces, settings.roulette_depth);
+				for (auto i = 0u; i < bucket->size; i++)
+				{
+					bucket->data[i].color = path_radiance[i];
+					bucket->data[i].aov = path_aovs[i];
+				}
 			}
 
 			ctx->dirty_pool.submit(std::move(bucket));
@@ -185,6 +582,8 @@ static bool child_job(std::shared_ptr<rt_job_context> ctx, int job_id)
 
 static bool splatter_job(std::shared_ptr<rt_job_context> ctx, int job_id)
 {
+	auto converged_tiles = 0u;
+
 	while (ctx->active)
 	{
 		std::unique_ptr<bu::rt::splat_bucket> bucket;
@@ -194,7 +593,7 @@ static bool splatter_job(std::shared_ptr<rt_job_context> ctx, int job_id)
 		{
 			// Otherwise wait until notified
 			std::unique_lock<std::mutex> lk{ctx->dirty_pool.mut};
-			ctx->dirty_pool.cv.wait_for(lk, 0.1s);
+			ctx->dirty_pool.cv.wait_for(lk, 0.1s, [&ctx]{return !ctx->active || !ctx->dirty_pool.buckets.empty();});
 
 			if (!ctx->active) return true;
 
@@ -217,6 +616,27 @@ static bool splatter_job(std::shared_ptr<rt_job_context> ctx, int job_id)
 			std::lock_guard lock{ctx->image_mutex};
 			ZoneScopedN("Splat image lock");
 			ctx->image.splat(*bucket);
+
+			int tile = bucket->tile;
+			if (tile >= 0)
+				ctx->tile_splatted[tile] = true;
+			else
+				for (auto &splatted : ctx->tile_splatted)
+					splatted = true;
+
+			// Stop sampling the tile once its error is low enough
+			float threshold = ctx->settings.adaptive_threshold;
+			if (threshold > 0 && tile >= 0 && !ctx->tile_converged[tile])
+			{
+				glm::ivec2 tile_min = ctx->get_tile_origin(tile);
+				float error = ctx->image.get_error(tile_min, tile_min + ctx->settings.tile_size, ctx->settings.adaptive_min_samples);
+				if (error < threshold)
+				{
+					ctx->tile_converged[tile] = true;
+					if (++converged_tiles == ctx->tile_converged.size())
+						LOG_INFO << "All RT tiles have converged";
+				}
+			}
 		}
 
 		// Return the bucket
@@ -225,3 +645,57 @@ static bool splatter_job(std::shared_ptr<rt_job_context> ctx, int job_id)
 
 	return true;
 }
+
+/**
+	\brief Periodically denoises snapshots of the image
+
+	The snapshot is updated tile by tile and only where new samples have been
+	splatted, so the splatter is never locked out for longer than a tile copy.
+*/
+static bool denoiser_job(std::shared_ptr<rt_job_context> ctx, int job_id)
+{
+	// Kept for the next jobs, like the tracing threads' buffers
+	thread_local bu::rt::denoiser denoiser;
+	thread_local bu::rt::sampled_image snapshot{glm::ivec2{0}};
+	thread_local std::vector<glm::vec4> result;
+
+	// The snapshot may hold a previous job's image, so the first pass copies everything
+	if (snapshot.size != ctx->image.size)
+		snapshot = bu::rt::sampled_image{ctx->image.size};
+	bool first_pass = true;
+
+	while (ctx->active)
+	{
+		// Update the snapshot where anything new was splatted
+		bool changed = false;
+		{
+			ZoneScopedN("Denoiser snapshot");
+			int tile_count = ctx->tile_splatted.size();
+			for (int tile = 0; tile < tile_count; tile++)
+			{
+				bool splatted = ctx->tile_splatted[tile].exchange(false);
+				if (!splatted && !first_pass)
+					continue;
+
+				// The splats are filtered, so they reach a pixel into the next tiles
+				glm::ivec2 tile_min = ctx->get_tile_origin(tile);
+				std::lock_guard lock{ctx->image_mutex};
+				snapshot.copy_rect(ctx->image, tile_min, tile_min + ctx->settings.tile_size + 1);
+				changed |= splatted;
+			}
+			first_pass = false;
+		}
+
+		if (changed)
+		{
+			denoiser.denoise(snapshot, result);
+
+			std::lock_guard lock{ctx->denoised_mutex};
+			std::swap(ctx->denoised, result);
+		}
+
+		std::this_thread::sleep_for(0.1s);
+	}
+
+	return true;
+}
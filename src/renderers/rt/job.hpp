@@ -1,13 +1,18 @@
 #pragma once
 #include <memory>
 #include <atomic>
+#include <cstdint>
 #include <vector>
 #include <mutex>
-#include <future>
+#include <condition_variable>
+#include <functional>
 #include <thread>
 #include <optional>
+#include <chrono>
 #include "../../camera.hpp"
 #include "sampled_image.hpp"
+#include "kernel.hpp"
+#include "settings.hpp"
 
 namespace bu {
 namespace rt {
@@ -37,12 +42,27 @@ struct rt_job_context
 		std::shared_ptr<const rt::scene> scene,
 		const bu::camera &camera,
 		const glm::ivec2 &viewport_size,
-		int bucket_count,
-		int thread_count,
-		int tile_size);
+		const bu::rt_settings &settings);
+
+	bool is_reusable_for(const glm::ivec2 &viewport_size, const bu::rt_settings &settings) const;
+	void clear();
+	void reset(
+		std::shared_ptr<const rt::scene> scene,
+		const bu::camera &camera,
+		const bu::rt_settings &settings);
+
+	int get_next_tile();
+
+	glm::ivec2 get_tile_origin(int tile) const
+	{
+		return glm::ivec2{tile % tile_grid.x, tile / tile_grid.x} * settings.tile_size;
+	}
 
 	std::atomic<bool> active;
 	
+	//! Settings with the automatic thread and bucket counts resolved
+	bu::rt_settings settings;
+
 	std::shared_ptr<const bu::rt::scene> scene;
 	bu::camera_ray_caster ray_caster;
 
@@ -53,13 +73,76 @@ struct rt_job_context
 	std::mutex image_mutex;
 	std::atomic<bool> inhibit_splat;
 
-	int bucket_count;
-	int thread_count;
-	int tile_size;
+	// Denoised snapshots of the image
+	std::mutex denoised_mutex;
+	std::vector<glm::vec4> denoised; //!< The latest denoised image - empty until the first one is done
+
+	std::vector<glm::ivec2> tile_order; //!< Order in which pixels of a tile are sampled
+
+	//! Number of samples started in each pixel - gives the sample indices for the samplers
+	std::vector<std::atomic<std::uint32_t>> pixel_samples;
+
+	// Adaptive sampling
+	glm::ivec2 tile_grid;                        //!< Number of tiles in each direction
+	std::atomic<unsigned int> next_tile;
+	std::vector<std::atomic<bool>> tile_converged; //!< Tiles which need no more samples
+	std::vector<std::atomic<bool>> tile_splatted;  //!< Tiles splatted since the denoiser last copied them
+
+	// Sample budget
+	std::chrono::steady_clock::time_point start_time;
+	std::vector<std::atomic<std::uint32_t>> tile_passes; //!< Number of buckets generated for each tile
+};
+
+/**
+	\brief Long-lived threads running the path tracing jobs
+
+	The pool has one splatter thread, one denoiser thread and as many tracing
+	threads as the largest job so far has asked for. Idle threads wait for
+	a new job on a condition variable, so a job starts without spawning any
+	threads. Stopped jobs are kept, and once no thread uses them anymore,
+	they are cleared in the background and their image and buckets are
+	reused by the next job of the same size.
+
+	Only one job runs at a time - starting a job stops the previous one.
+*/
+class rt_worker_pool
+{
+public:
+	rt_worker_pool();
+	~rt_worker_pool();
+
+	rt_worker_pool(const rt_worker_pool &) = delete;
+	rt_worker_pool &operator=(const rt_worker_pool &) = delete;
+
+	std::shared_ptr<rt_job_context> start(
+		std::shared_ptr<const bu::rt::scene> scene,
+		const bu::camera &camera,
+		const glm::ivec2 &viewport_size,
+		const bu::rt_settings &settings);
+	void stop(const std::shared_ptr<rt_job_context> &job);
+
+private:
+	using job_function = std::function<void(std::shared_ptr<rt_job_context>)>;
+
+	void stop_current();
+	void clear_retired();
+	void spawn(job_function function);
+	void worker_loop(job_function function);
+
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	std::shared_ptr<rt_job_context> m_job; //!< The running job - null when stopped
+	std::shared_ptr<rt_job_context> m_retired; //!< The last stopped job, which can be reused
+	bool m_retired_cleared = false;            //!< Whether m_retired has already been cleared
+	std::uint64_t m_generation = 0; //!< Incremented whenever the job changes
+	bool m_quit = false;
+
+	std::vector<std::thread> m_threads;
+	int m_tracing_thread_count = 0;
 };
 
 /**
-	\brief Path tracing rendering job - spawns multiple threads sharing one rt_job_context
+	\brief Path tracing rendering job - runs on the worker pool of the rt_context
 */
 class rt_renderer_job : public std::enable_shared_from_this<rt_renderer_job>
 {
@@ -76,18 +159,15 @@ public:
 		std::shared_ptr<const bu::rt::scene> scene,
 		bu::camera &camera,
 		const glm::ivec2 &viewport_size,
-		int bucket_count = 64,
-		int thread_count = 4,
-		int tile_size = 64);
+		const bu::rt_settings &settings = {});
 	void stop();
 
 private:
 	// The main context
 	std::shared_ptr<bu::rt_context> m_context;
 
-	// Childrens' futures and active flag
+	// The context of the running job
 	std::shared_ptr<rt_job_context> m_job_context;
-	std::vector<std::future<bool>> m_futures;
 };
 
 }
\ No newline at end of file
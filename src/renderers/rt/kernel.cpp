@@ -1,71 +1,285 @@
 #include "kernel.hpp"
 #include "ray.hpp"
-#include "bvh.hpp"
+#include "tlas.hpp"
 #include "material.hpp"
+#include "light.hpp"
+#include "scene.hpp"
 
+#include <glm/gtc/constants.hpp>
 #include <glm/gtx/component_wise.hpp>
 
 glm::vec3 bu::rt::trace_ray(
-	const bu::rt::bvh_tree &bvh,
-	const std::vector<bu::rt::material> &materials,
-	std::mt19937 &rng,
+	const bu::rt::scene &scene,
+	const bu::rt::sampler &sampler,
 	bu::rt::ray r,
-	int max_bounces)
+	int max_bounces,
+	int roulette_depth)
 {
-	std::uniform_real_distribution<float> dist(0, 1);
-	glm::vec3 L{0.0};
-	glm::vec3 thrput{1.0};
-	float ray_ior = 1.f;
+	ray_hit hit;
+	bool did_hit = scene.tlas->test_ray(r, hit);
+	return trace_path(scene, sampler, r, did_hit ? &hit : nullptr, max_bounces, roulette_depth);
+}
 
-	for (int bounces = 0; bounces < max_bounces; bounces++)
+/**
+	\brief MIS weight of a sample drawn with PDF pdf_a against another strategy with PDF pdf_b
+*/
+static inline float power_heuristic(float pdf_a, float pdf_b)
+{
+	float a = pdf_a * pdf_a;
+	float b = pdf_b * pdf_b;
+	return a / (a + b);
+}
+
+/**
+	\brief Returns radiance of the sky in given direction
+*/
+glm::vec3 bu::rt::get_sky_radiance(const glm::vec3 &direction)
+{
+	return glm::vec3{glm::pow(glm::max(0.f, glm::dot(direction, glm::normalize(glm::vec3{1, 1, 1}))), 12.f) * 5.f};
+}
+
+/**
+	\brief Returns MIS weight of emission found by a BSDF ray at point P
+	\param bsdf_pdf solid angle PDF of the ray - 0 if the light couldn't have been sampled instead
+	\param last_position, last_normal the point the ray was cast from
+*/
+float bu::rt::get_emission_weight(
+	const bu::rt::scene &scene,
+	const bu::rt::ray_hit &hit,
+	const glm::vec3 &P,
+	float bsdf_pdf,
+	const glm::vec3 &last_position,
+	const glm::vec3 &last_normal)
+{
+	if (bsdf_pdf <= 0 || !scene.lights || scene.lights->empty())
+		return 1.f;
+
+	float light_pdf = scene.lights->get_hit_pdf(hit, last_position, last_normal, P);
+	return power_heuristic(bsdf_pdf, light_pdf);
+}
+
+/**
+	\brief Samples a light from a Lambertian surface point (next-event estimation)
+	\param shadow_ray, t_max occlusion test which has to pass for the light to contribute
+	\param contribution MIS-weighted contribution of the light, without the path throughput
+	\returns false if the light doesn't contribute at all
+*/
+bool bu::rt::sample_direct_light(
+	const bu::rt::scene &scene,
+	const glm::vec3 &albedo,
+	const glm::vec3 &P,
+	const glm::vec3 &N,
+	float u1,
+	float u2,
+	float u3,
+	bu::rt::ray &shadow_ray,
+	float &t_max,
+	glm::vec3 &contribution)
+{
+	bu::rt::light_sample ls;
+	if (!scene.lights->sample(P, N, u1, u2, u3, ls))
+		return false;
+
+	float cos_surface = glm::dot(N, ls.direction);
+	if (cos_surface <= 0)
+		return false;
+
+	const float ray_surface_offset = 1e-3;
+	shadow_ray = bu::rt::ray{P + ray_surface_offset * N, ls.direction};
+	t_max = ls.distance - 2.f * ray_surface_offset;
+
+	// Point and sphere lights can't be found by the BSDF rays
+	float bsdf_pdf = cos_surface * glm::one_over_pi<float>();
+	float weight = ls.hittable ? power_heuristic(ls.pdf, bsdf_pdf) : 1.f;
+	glm::vec3 f = albedo * glm::one_over_pi<float>();
+	contribution = f * ls.radiance * cos_surface / ls.pdf * weight;
+	return true;
+}
+
+/**
+	\brief Shades the hit of the current path ray and generates the next ray
+	\param hit the hit or nullptr if the ray hit nothing
+	\param roulette_depth number of bounces before Russian roulette starts terminating the path
+	\returns false if the path has terminated
+*/
+bool bu::rt::extend_path(
+	bu::rt::path_state &path,
+	const bu::rt::ray_hit *hit,
+	const bu::rt::scene &scene,
+	int max_bounces,
+	int roulette_depth)
+{
+	auto &r = path.r;
+
+	// World hit
+	if (!hit)
 	{
-		ray_hit hit;
-		bool did_hit = bvh.test_ray(r, hit);
-
-		// World hit
-		if (!did_hit)
-		{
-			L += thrput * glm::pow(glm::max(0.f, glm::dot(r.direction, glm::normalize(glm::vec3{1, 1, 1}))), 12.f) * 5.f;
-			break;
-		}
-
-		// Compute position, normal and find a tangent and bitangent
-		glm::vec3 P = bu::rt::ray_hit_pos(r, hit);
-		glm::vec3 N = bu::rt::ray_hit_normal(r, hit);
-		glm::vec3 T = glm::normalize(glm::cross(r.direction, N));
-		glm::vec3 B = glm::normalize(glm::cross(T, N));
-		glm::mat3 TBN{T, B, N};
-		glm::mat3 inv_TBN{glm::transpose(TBN)};
-
-		// Transform ray direction to tangent space
-		glm::vec3 tbn_dir = inv_TBN * r.direction;
-
-		// Sample the BSDF
-		const auto &material = materials[hit.triangle->material_id];
-		auto bounce = material.sample(tbn_dir, ray_ior, dist(rng), dist(rng));
-
-		// Stop if we hit a light
-		if (bounce.type == ray_bounce_type::EMISSION)
-		{
-			L += thrput * bounce.bsdf;
-			break;
-		}
-
-		// The new ray
-		const float ray_surface_offset = 1e-3;
-		r.direction = glm::normalize(TBN * bounce.new_direction);
-		r.origin = P + glm::sign(bounce.new_direction.z) * ray_surface_offset * N;
-		ray_ior = bounce.new_ior;
-
-		// Accumulate light
-		thrput *= bounce.bsdf / bounce.pdf;
-
-		// Russian roulette
-		float p_survive = glm::compMax(thrput);
-		if (dist(rng) > p_survive)
-			break;
-		thrput *= 1 / p_survive;
+		path.L += path.throughput * get_sky_radiance(r.direction);
+		return false;
 	}
 
-	return L;
-}
\ No newline at end of file
+	// Compute position, normal and find a tangent and bitangent
+	glm::vec3 P = bu::rt::ray_hit_pos(r, *hit);
+	glm::vec3 N = bu::rt::ray_hit_normal(r, *hit);
+	glm::mat3 TBN = get_shading_frame(r.direction, N);
+	glm::mat3 inv_TBN{glm::transpose(TBN)};
+
+	// Transform ray direction to tangent space
+	glm::vec3 tbn_dir = inv_TBN * r.direction;
+
+	const auto &material = (*scene.materials)[hit->triangle->material_id];
+
+	// The first hit provides the AOVs
+	if (path.bounces == 0)
+		path.aov = aov_sample{material.get_albedo(), N, hit->t};
+
+	// Sample the BSDF
+	glm::vec2 u = path.sampler.get_2d();
+	auto bounce = material.sample(tbn_dir, path.ior, u.x, u.y);
+	bool has_lights = scene.lights && !scene.lights->empty();
+
+	// Stop if we hit a light - if the light could also have been sampled
+	// from the previous vertex, weight the hit against that
+	if (bounce.type == ray_bounce_type::EMISSION)
+	{
+		float weight = get_emission_weight(scene, *hit, P, path.bsdf_pdf, path.last_position, path.last_normal);
+		path.L += path.throughput * bounce.bsdf * weight;
+		return false;
+	}
+
+	// Next-event estimation - only diffuse bounces, specular ones can't connect to a light
+	if (bounce.type == ray_bounce_type::DIFFUSE && has_lights)
+	{
+		float v1 = path.sampler.get_1d();
+		glm::vec2 v23 = path.sampler.get_2d();
+		ray shadow_ray;
+		float t_max;
+		glm::vec3 contribution;
+		if (sample_direct_light(scene, material.basic_diffuse.albedo, P, N, v1, v23.x, v23.y, shadow_ray, t_max, contribution)
+			&& !scene.tlas->test_occlusion(shadow_ray, t_max))
+			path.L += path.throughput * contribution;
+	}
+
+	return continue_path(path, bounce, P, N, TBN, path.sampler, max_bounces, roulette_depth);
+}
+
+/**
+	\brief Sets up the next ray of a path after a BSDF sample and applies Russian roulette
+
+	Shared by all the integrators, so they consume the sampler dimensions in the same order.
+
+	\param P, N, TBN the shaded point, its normal and shading frame
+	\param roulette_depth number of bounces before Russian roulette starts terminating the path
+	\returns false if the path has terminated
+*/
+bool bu::rt::continue_path(
+	bu::rt::path_vertex &vertex,
+	const bu::rt::ray_bounce &bounce,
+	const glm::vec3 &P,
+	const glm::vec3 &N,
+	const glm::mat3 &TBN,
+	bu::rt::sampler &sampler,
+	int max_bounces,
+	int roulette_depth)
+{
+	// The new ray
+	const float ray_surface_offset = 1e-3;
+	vertex.r.direction = glm::normalize(TBN * bounce.new_direction);
+	vertex.r.origin = P + glm::sign(bounce.new_direction.z) * ray_surface_offset * N;
+	vertex.ior = bounce.new_ior;
+	vertex.bsdf_pdf = bounce.type == ray_bounce_type::DIFFUSE ? bounce.new_direction.z * glm::one_over_pi<float>() : 0.f;
+	vertex.last_position = P;
+	vertex.last_normal = N;
+
+	// Accumulate light
+	vertex.throughput *= bounce.bsdf / bounce.pdf;
+
+	// Russian roulette - the sample is drawn even if not used, so the sampler
+	// dimensions of the following bounces don't depend on the roulette depth
+	float u_survive = sampler.get_1d();
+	if (vertex.bounces >= roulette_depth)
+	{
+		float p_survive = glm::compMax(vertex.throughput);
+		if (u_survive > p_survive)
+			return false;
+		vertex.throughput *= 1 / p_survive;
+	}
+
+	return ++vertex.bounces < max_bounces;
+}
+
+/**
+	\brief Traces a path whose first intersection is already known (e.g. from packet traversal)
+	\param sampler sampler set up for the path's pixel sample
+	\param primary_hit the first hit or nullptr if the ray hit nothing
+	\param aov if not null, receives the AOVs of the path
+*/
+glm::vec3 bu::rt::trace_path(
+	const bu::rt::scene &scene,
+	const bu::rt::sampler &sampler,
+	bu::rt::ray r,
+	const bu::rt::ray_hit *primary_hit,
+	int max_bounces,
+	int roulette_depth,
+	bu::rt::aov_sample *aov)
+{
+	if (max_bounces <= 0)
+		return glm::vec3{0.f};
+
+	path_state path{r};
+	path.sampler = sampler;
+	ray_hit hit;
+	while (extend_path(path, primary_hit, scene, max_bounces, roulette_depth))
+		primary_hit = scene.tlas->test_ray(path.r, hit) ? &hit : nullptr;
+
+	if (aov)
+		*aov = path.aov;
+
+	return path.L;
+}
+
+/**
+	\brief Traces many paths at once - all paths are extended by one bounce at a time
+	and the new rays are traced together as a stream
+
+	\param paths the paths with their samplers already set up
+	\param hits the first hits of the paths (null triangle means no hit)
+*/
+void bu::rt::trace_path_stream(
+	const bu::rt::scene &scene,
+	std::vector<path_state> &paths,
+	std::vector<ray_hit> &hits,
+	int max_bounces,
+	int roulette_depth)
+{
+	thread_local std::vector<unsigned int> active;
+	thread_local std::vector<ray> rays;
+	thread_local std::vector<ray_hit> stream_hits;
+
+	active.resize(paths.size());
+	for (auto i = 0u; i < paths.size(); i++)
+		active[i] = i;
+
+	if (max_bounces <= 0)
+		return;
+
+	while (!active.empty())
+	{
+		// Shade and drop terminated paths
+		unsigned int count = 0;
+		for (auto id : active)
+			if (extend_path(paths[id], hits[id].triangle ? &hits[id] : nullptr, scene, max_bounces, roulette_depth))
+				active[count++] = id;
+		active.resize(count);
+
+		rays.resize(count);
+		stream_hits.resize(count);
+		for (auto i = 0u; i < count; i++)
+			rays[i] = paths[active[i]].r;
+
+		scene.tlas->test_stream(rays.data(), stream_hits.data(), count);
+
+		for (auto i = 0u; i < count; i++)
+			hits[active[i]] = stream_hits[i];
+	}
+}
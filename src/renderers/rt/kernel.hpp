@@ -1,17 +1,112 @@
 #pragma once 
 #include <glm/glm.hpp>
-#include <random>
+#include <vector>
+#include "ray.hpp"
+#include "sampler.hpp"
+#include "sampled_image.hpp"
 
 namespace bu::rt {
-struct bvh_tree;
 struct ray;
+struct ray_hit;
 struct material;
+struct scene;
+
+struct ray_bounce;
+
+/**
+	\brief The part of the path state updated by continue_path() at every bounce
+*/
+struct path_vertex
+{
+	rt::ray r;
+	glm::vec3 throughput{1.f};
+	float ior = 1.f;
+	int bounces = 0;
+	float bsdf_pdf = 0.f;         //!< Solid angle PDF of the last bounce - 0 for camera rays and specular bounces
+	glm::vec3 last_position{0.f}; //!< Position of the last diffuse bounce
+	glm::vec3 last_normal{0.f};   //!< Normal of the last diffuse bounce
+};
+
+/**
+	\brief State of a path between bounces
+*/
+struct path_state : path_vertex
+{
+	glm::vec3 L{0.f};             //!< Accumulated radiance
+	rt::sampler sampler{};        //!< Random numbers of this path
+	rt::aov_sample aov{};         //!< Features of the first hit
+};
+
+/**
+	\brief Returns an orthonormal shading frame with N as the Z axis
+*/
+inline glm::mat3 get_shading_frame(const glm::vec3 &direction, const glm::vec3 &N)
+{
+	glm::vec3 T = glm::normalize(glm::cross(direction, N));
+	glm::vec3 B = glm::normalize(glm::cross(T, N));
+	return glm::mat3{T, B, N};
+}
+
+glm::vec3 get_sky_radiance(const glm::vec3 &direction);
+
+float get_emission_weight(
+	const bu::rt::scene &scene,
+	const bu::rt::ray_hit &hit,
+	const glm::vec3 &P,
+	float bsdf_pdf,
+	const glm::vec3 &last_position,
+	const glm::vec3 &last_normal);
+
+bool sample_direct_light(
+	const bu::rt::scene &scene,
+	const glm::vec3 &albedo,
+	const glm::vec3 &P,
+	const glm::vec3 &N,
+	float u1,
+	float u2,
+	float u3,
+	bu::rt::ray &shadow_ray,
+	float &t_max,
+	glm::vec3 &contribution);
 
 glm::vec3 trace_ray(
-	const bu::rt::bvh_tree &bvh,
-	const std::vector<bu::rt::material> &materials,
-	std::mt19937 &rng,
+	const bu::rt::scene &scene,
+	const bu::rt::sampler &sampler,
+	bu::rt::ray r,
+	int max_bounces,
+	int roulette_depth = 0);
+
+glm::vec3 trace_path(
+	const bu::rt::scene &scene,
+	const bu::rt::sampler &sampler,
 	bu::rt::ray r,
-	int max_bounces);
+	const bu::rt::ray_hit *primary_hit,
+	int max_bounces,
+	int roulette_depth = 0,
+	bu::rt::aov_sample *aov = nullptr);
+
+bool continue_path(
+	bu::rt::path_vertex &vertex,
+	const bu::rt::ray_bounce &bounce,
+	const glm::vec3 &P,
+	const glm::vec3 &N,
+	const glm::mat3 &TBN,
+	bu::rt::sampler &sampler,
+	int max_bounces,
+	int roulette_depth);
+
+bool extend_path(
+	bu::rt::path_state &path,
+	const bu::rt::ray_hit *hit,
+	const bu::rt::scene &scene,
+	int max_bounces,
+	int roulette_depth = 0);
+
+void trace_path_stream(
+	const bu::rt::scene &scene,
+	std::vector<path_state> &paths,
+	std::vector<ray_hit> &hits,
+	int max_bounces,
+	int roulette_depth = 0);
 
 }
\ No newline at end of file
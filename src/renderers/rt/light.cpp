@@ -0,0 +1,211 @@
+#include "light.hpp"
+#include <algorithm>
+#include <cmath>
+#include <glm/gtc/constants.hpp>
+#include <tracy/Tracy.hpp>
+#include "tlas.hpp"
+#include "material.hpp"
+
+using bu::rt::light_list;
+
+static inline float luminance(const glm::vec3 &c)
+{
+	return glm::dot(c, glm::vec3{0.2126f, 0.7152f, 0.0722f});
+}
+
+static inline bu::rt::light_bounds get_triangle_light_bounds(const bu::rt::triangle_light &t)
+{
+	glm::vec3 n = glm::cross(t.e1, t.e2);
+	float area = 0.5f * glm::length(n);
+
+	bu::rt::light_bounds b;
+	b.aabb = bu::rt::aabb{t.v0, t.v0};
+	b.aabb.add_point(t.v0 + t.e1);
+	b.aabb.add_point(t.v0 + t.e2);
+	b.axis = area > 0 ? glm::normalize(n) : glm::vec3{0, 0, 1};
+	b.power = 2.f * glm::pi<float>() * luminance(t.emission) * area;
+	b.cos_theta_o = 1.f;
+	b.cos_theta_e = 0.f;
+	b.two_sided = true;
+	return b;
+}
+
+static inline bu::rt::light_bounds get_point_light_bounds(const bu::rt::point_light &l)
+{
+	bu::rt::light_bounds b;
+	b.aabb = bu::rt::aabb{l.position - l.radius, l.position + l.radius};
+	b.axis = glm::vec3{0, 0, 1};
+	b.power = luminance(l.power);
+	b.cos_theta_o = -1.f;
+	b.cos_theta_e = 0.f;
+	b.two_sided = false;
+	return b;
+}
+
+/**
+	\brief Collects the emissive triangles of all instances in the TLAS and builds the light tree
+
+	Every source triangle of an instance with any emissive triangle becomes a light,
+	so the light of a hit is found just by the source index of the BLAS triangle.
+	Triangles referenced multiple times by an SBVH still give a single light.
+	Non-emissive ones have zero power and never get into the tree.
+*/
+light_list::light_list(const rt::tlas &tlas, const std::vector<rt::material> &materials, std::vector<point_light> pts) :
+	points(std::move(pts))
+{
+	ZoneScopedN("Light list build");
+
+	auto get_emission = [&](const rt::triangle &tri)
+	{
+		if (tri.material_id < 0 || tri.material_id >= static_cast<int>(materials.size()))
+			return glm::vec3{0.f};
+
+		const auto &mat = materials[tri.material_id];
+		return mat.type == material_type::EMISSIVE ? mat.emissive.emission : glm::vec3{0.f};
+	};
+
+	for (const auto &inst : tlas.instances)
+	{
+		const auto &blas = *inst.blas;
+		auto is_emissive = [&](const rt::triangle &tri){return get_emission(tri) != glm::vec3{0.f};};
+		if (std::none_of(blas.triangles, blas.triangles + blas.triangle_count, is_emissive))
+			continue;
+
+		unsigned int first = triangles.size();
+		instances[&inst.normal_matrix] = instance_lights{blas.triangles, blas.source_triangles.data(), first};
+
+		// One light per source triangle - sources without any reference stay dark
+		triangles.resize(first + blas.source_triangle_count, triangle_light{glm::vec3{0.f}, glm::vec3{0.f}, glm::vec3{0.f}, glm::vec3{0.f}});
+		glm::mat4 object_to_world = glm::inverse(inst.world_to_object);
+		for (auto i = 0u; i < blas.triangle_count; i++)
+		{
+			auto &light = triangles[first + blas.source_triangles[i]];
+			if (light.emission != glm::vec3{0.f})
+				continue;
+
+			const auto &tri = blas.triangles[i];
+			glm::vec3 v[3];
+			for (int j = 0; j < 3; j++)
+				v[j] = glm::vec3{object_to_world * glm::vec4{tri.vertices[j], 1.f}};
+
+			light = triangle_light{v[0], v[1] - v[0], v[2] - v[0], get_emission(tri)};
+		}
+	}
+
+	std::vector<light_bounds> bounds;
+	bounds.reserve(triangles.size() + points.size());
+	for (const auto &t : triangles)
+		bounds.push_back(get_triangle_light_bounds(t));
+	for (const auto &l : points)
+		bounds.push_back(get_point_light_bounds(l));
+
+	tree = light_tree{bounds};
+}
+
+/**
+	\brief Samples a point light or a sphere light as seen from point P
+	\param pdf probability of selecting the light
+*/
+static bool sample_point_light(const bu::rt::point_light &l, const glm::vec3 &P, float pdf, float u1, float u2, bu::rt::light_sample &ls)
+{
+	glm::vec3 L = l.position - P;
+	float d2 = glm::dot(L, L);
+	float d = std::sqrt(d2);
+	if (!(d > l.radius))
+		return false;
+
+	glm::vec3 w = L / d;
+	ls.hittable = false;
+
+	// Delta light - the radiance is actually irradiance and the PDF is discrete
+	if (l.radius <= 0)
+	{
+		ls.direction = w;
+		ls.distance = d;
+		ls.radiance = l.power * (0.25f * glm::one_over_pi<float>()) / d2;
+		ls.pdf = pdf;
+		return true;
+	}
+
+	// Uniform direction in the cone subtended by the sphere
+	float sin2_max = l.radius * l.radius / d2;
+	float cos_max = std::sqrt(std::max(0.f, 1.f - sin2_max));
+	float one_minus_cos_max = sin2_max / (1.f + cos_max);
+	float cos_theta = 1.f - u1 * one_minus_cos_max;
+	float sin_theta = std::sqrt(std::max(0.f, 1.f - cos_theta * cos_theta));
+	float phi = 2.f * glm::pi<float>() * u2;
+
+	glm::vec3 T = glm::normalize(std::abs(w.x) > 0.9f ? glm::cross(w, glm::vec3{0, 1, 0}) : glm::cross(w, glm::vec3{1, 0, 0}));
+	glm::vec3 B = glm::cross(w, T);
+	ls.direction = glm::normalize(sin_theta * std::cos(phi) * T + sin_theta * std::sin(phi) * B + cos_theta * w);
+	ls.distance = d * cos_theta - std::sqrt(std::max(0.f, l.radius * l.radius - d2 * sin_theta * sin_theta));
+
+	// Uniform radiance of the sphere surface with the same flux
+	ls.radiance = l.power / (4.f * glm::pi<float>() * glm::pi<float>() * l.radius * l.radius);
+	ls.pdf = pdf / (2.f * glm::pi<float>() * one_minus_cos_max);
+	return ls.pdf > 0 && std::isfinite(ls.pdf);
+}
+
+/**
+	\brief Samples a point on one of the lights as seen from point P with normal N
+	\returns false if no light could be sampled
+*/
+bool light_list::sample(const glm::vec3 &P, const glm::vec3 &N, float u1, float u2, float u3, light_sample &ls) const
+{
+	unsigned int index;
+	float pmf;
+	if (!tree.sample(P, N, u1, index, pmf))
+		return false;
+
+	if (index >= triangles.size())
+		return sample_point_light(points[index - triangles.size()], P, pmf, u2, u3, ls);
+
+	const auto &t = triangles[index];
+
+	// Uniform point on the triangle
+	float su = std::sqrt(u2);
+	float b1 = 1.f - su;
+	float b2 = u3 * su;
+	glm::vec3 L = t.v0 + b1 * t.e1 + b2 * t.e2 - P;
+
+	ls.distance = glm::length(L);
+	if (!(ls.distance > 0))
+		return false;
+
+	ls.direction = L / ls.distance;
+	glm::vec3 n = glm::cross(t.e1, t.e2);
+	float area = 0.5f * glm::length(n);
+	float cos_light = std::abs(glm::dot(n, ls.direction)) / (2.f * area);
+	ls.radiance = t.emission;
+	ls.hittable = true;
+	ls.pdf = pmf / area * ls.distance * ls.distance / cos_light;
+	return cos_light > 0 && std::isfinite(ls.pdf);
+}
+
+/**
+	\brief Returns solid angle PDF of sample() choosing the point of a ray hit
+	\param P, N position and normal of the point the ray was cast from
+	\returns zero if the hit triangle is not a light
+*/
+float light_list::get_hit_pdf(const rt::ray_hit &hit, const glm::vec3 &P, const glm::vec3 &N, const glm::vec3 &hit_pos) const
+{
+	auto it = instances.find(hit.normal_matrix);
+	if (it == instances.end())
+		return 0.f;
+
+	unsigned int index = it->second.first + it->second.sources[hit.triangle - it->second.triangles];
+	float pmf = tree.get_pmf(P, N, index);
+	if (pmf <= 0)
+		return 0.f;
+
+	const auto &t = triangles[index];
+	glm::vec3 L = hit_pos - P;
+	float d2 = glm::dot(L, L);
+	glm::vec3 n = glm::cross(t.e1, t.e2);
+	float area = 0.5f * glm::length(n);
+	float cos_light = std::abs(glm::dot(n, L)) / (2.f * area * std::sqrt(d2));
+	if (!(cos_light > 0))
+		return 0.f;
+
+	return pmf / area * d2 / cos_light;
+}
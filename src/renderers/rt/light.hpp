@@ -0,0 +1,81 @@
+#pragma once
+#include <vector>
+#include <unordered_map>
+#include <glm/glm.hpp>
+#include "ray.hpp"
+#include "light_tree.hpp"
+
+namespace bu::rt {
+struct tlas;
+struct material;
+
+/**
+	\brief Emissive triangle in world space
+*/
+struct triangle_light
+{
+	glm::vec3 v0;
+	glm::vec3 e1; //!< vertices[1] - vertices[0]
+	glm::vec3 e2; //!< vertices[2] - vertices[0]
+	glm::vec3 emission;
+};
+
+/**
+	\brief Point light from the scene graph in world space
+
+	Lights with zero radius are delta lights. Larger ones are spheres emitting
+	uniform radiance - they're sampled by the cone they subtend, but can't be hit
+	by rays.
+*/
+struct point_light
+{
+	glm::vec3 position;
+	float radius;
+	glm::vec3 power; //!< Emitted flux (color times power)
+};
+
+/**
+	\brief Light sampled from a shading point
+*/
+struct light_sample
+{
+	glm::vec3 direction; //!< Normalized direction towards the light
+	float distance;
+	glm::vec3 radiance;  //!< Incident radiance (irradiance for delta lights)
+	float pdf;           //!< Solid angle PDF (discrete probability for delta lights)
+	bool hittable;       //!< Can be found by BSDF rays too - MIS is needed
+};
+
+/**
+	\brief All lights of the RT scene
+
+	Emissive triangles are collected from the TLAS instances, so that any
+	emitter found by a ray can be mapped back to its light. A light_tree
+	selects the light for each shading point.
+*/
+struct light_list
+{
+	/**
+		\brief First light of an emissive instance
+	*/
+	struct instance_lights
+	{
+		const rt::triangle *triangles;  //!< Triangles of the instance's BLAS
+		const unsigned int *sources;   //!< Source triangle of each BLAS triangle
+		unsigned int first;            //!< Light of the first source triangle - the rest follow in the same order
+	};
+
+	light_list() = default;
+	light_list(const rt::tlas &tlas, const std::vector<rt::material> &materials, std::vector<point_light> points);
+
+	bool empty() const {return tree.empty();}
+	bool sample(const glm::vec3 &P, const glm::vec3 &N, float u1, float u2, float u3, light_sample &ls) const;
+	float get_hit_pdf(const rt::ray_hit &hit, const glm::vec3 &P, const glm::vec3 &N, const glm::vec3 &hit_pos) const;
+
+	std::vector<triangle_light> triangles;
+	std::vector<point_light> points; //!< Follow the triangles in the light indices
+	light_tree tree;
+	std::unordered_map<const glm::mat3*, instance_lights> instances; //!< Emissive instances by their normal matrix (as found in ray_hit)
+};
+
+}
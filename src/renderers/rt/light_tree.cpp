@@ -0,0 +1,348 @@
+#include "light_tree.hpp"
+#include <algorithm>
+#include <cmath>
+#include <glm/gtc/constants.hpp>
+#include <glm/gtx/component_wise.hpp>
+#include <tracy/Tracy.hpp>
+#include "../../log.hpp"
+
+using bu::rt::light_bounds;
+using bu::rt::light_tree;
+
+static inline float safe_sqrt(float x)
+{
+	return std::sqrt(std::max(0.f, x));
+}
+
+static inline float safe_acos(float x)
+{
+	return std::acos(std::clamp(x, -1.f, 1.f));
+}
+
+/**
+	\brief cos(max(0, a - b)) given sines and cosines of a and b
+*/
+static inline float cos_sub_clamped(float sin_a, float cos_a, float sin_b, float cos_b)
+{
+	if (cos_a > cos_b) return 1.f;
+	return cos_a * cos_b + sin_a * sin_b;
+}
+
+/**
+	\brief sin(max(0, a - b)) given sines and cosines of a and b
+*/
+static inline float sin_sub_clamped(float sin_a, float cos_a, float sin_b, float cos_b)
+{
+	if (cos_a > cos_b) return 0.f;
+	return sin_a * cos_b - cos_a * sin_b;
+}
+
+/**
+	\brief Returns an upper bound of the light arriving at point P with normal N
+
+	The bound accounts for the distance to the box, the angle between the emission
+	cone and the direction towards P, and the angle between N and the box.
+	Only the hemisphere around N receives light.
+*/
+float light_bounds::get_importance(const glm::vec3 &P, const glm::vec3 &N) const
+{
+	glm::vec3 center = aabb.get_center();
+	float radius = 0.5f * glm::length(aabb.get_dimensions());
+	glm::vec3 d = P - center;
+	float d2 = glm::dot(d, d);
+	float dist = std::sqrt(d2);
+	d2 = std::max(d2, radius);
+
+	glm::vec3 wi = dist > 0 ? d / dist : glm::vec3{0.f};
+	float cos_w = glm::dot(axis, wi);
+	if (two_sided) cos_w = std::abs(cos_w);
+	float sin_w = safe_sqrt(1.f - cos_w * cos_w);
+
+	// Directions from P towards the bounding sphere of the box
+	float cos_b = -1.f;
+	if (dist > radius)
+		cos_b = safe_sqrt(1.f - radius * radius / (dist * dist));
+	float sin_b = safe_sqrt(1.f - cos_b * cos_b);
+
+	// Minimum angle between the emission and the direction towards P
+	float sin_o = safe_sqrt(1.f - cos_theta_o * cos_theta_o);
+	float cos_x = cos_sub_clamped(sin_w, cos_w, sin_o, cos_theta_o);
+	float sin_x = sin_sub_clamped(sin_w, cos_w, sin_o, cos_theta_o);
+	float cos_p = cos_sub_clamped(sin_x, cos_x, sin_b, cos_b);
+	if (cos_p <= cos_theta_e)
+		return 0.f;
+
+	// Minimum angle between N and the direction towards the box
+	float cos_i = -glm::dot(wi, N);
+	float sin_i = safe_sqrt(1.f - cos_i * cos_i);
+	float cos_pi = cos_sub_clamped(sin_i, cos_i, sin_b, cos_b);
+
+	return std::max(0.f, power * cos_p * cos_pi / d2);
+}
+
+/**
+	\brief Merges two light bounds - the resulting cone contains both cones
+*/
+light_bounds bu::rt::merge_light_bounds(const light_bounds &a, const light_bounds &b)
+{
+	if (a.power <= 0) return b;
+	if (b.power <= 0) return a;
+
+	light_bounds m;
+	m.aabb = a.aabb;
+	m.aabb.add_aabb(b.aabb);
+	m.power = a.power + b.power;
+	m.cos_theta_e = std::min(a.cos_theta_e, b.cos_theta_e);
+	m.two_sided = a.two_sided || b.two_sided;
+
+	float theta_a = safe_acos(a.cos_theta_o);
+	float theta_b = safe_acos(b.cos_theta_o);
+	float theta_d = safe_acos(glm::dot(a.axis, b.axis));
+	const float pi = glm::pi<float>();
+
+	// One cone contains the other
+	if (std::min(theta_d + theta_b, pi) <= theta_a)
+	{
+		m.axis = a.axis;
+		m.cos_theta_o = a.cos_theta_o;
+		return m;
+	}
+	if (std::min(theta_d + theta_a, pi) <= theta_b)
+	{
+		m.axis = b.axis;
+		m.cos_theta_o = b.cos_theta_o;
+		return m;
+	}
+
+	// Spread the cone from a's axis towards b's
+	float theta_o = (theta_a + theta_d + theta_b) * 0.5f;
+	glm::vec3 rotation_axis = glm::cross(a.axis, b.axis);
+	if (theta_o >= pi || glm::dot(rotation_axis, rotation_axis) == 0)
+	{
+		m.axis = a.axis;
+		m.cos_theta_o = -1.f;
+		return m;
+	}
+
+	// Rotate a's axis about the rotation axis (Rodrigues' formula - the axes are perpendicular)
+	float theta_r = theta_o - theta_a;
+	glm::vec3 k = glm::normalize(rotation_axis);
+	m.axis = glm::normalize(a.axis * std::cos(theta_r) + glm::cross(k, a.axis) * std::sin(theta_r));
+	m.cos_theta_o = std::cos(theta_o);
+	return m;
+}
+
+/**
+	\brief Measure of the directions a cone emits into - used by the SAOH
+*/
+static float get_orientation_cost(const light_bounds &b)
+{
+	const float pi = glm::pi<float>();
+	float theta_o = safe_acos(b.cos_theta_o);
+	float theta_e = safe_acos(b.cos_theta_e);
+	float theta_w = std::min(theta_o + theta_e, pi);
+	float sin_o = std::sin(theta_o);
+	return 2.f * pi * (1.f - b.cos_theta_o)
+		+ pi / 2.f * (2.f * theta_w * sin_o - std::cos(theta_o - 2.f * theta_w) - 2.f * theta_o * sin_o + b.cos_theta_o);
+}
+
+/**
+	\brief Builds the tree over all lights with positive power
+*/
+light_tree::light_tree(const std::vector<light_bounds> &lights) :
+	m_leaves(lights.size(), no_node)
+{
+	ZoneScopedN("Light tree build");
+
+	std::vector<unsigned int> ids;
+	for (auto i = 0u; i < lights.size(); i++)
+		if (lights[i].power > 0)
+			ids.push_back(i);
+
+	if (ids.empty())
+		return;
+
+	m_nodes.reserve(2 * ids.size() - 1);
+	m_parents.reserve(2 * ids.size() - 1);
+	build(lights, ids.data(), ids.size());
+	LOG_DEBUG << "Light tree built - " << ids.size() << " lights and " << m_nodes.size() << " nodes";
+}
+
+/**
+	\brief Recursively builds the subtree of given lights
+	\returns index of the subtree root
+*/
+unsigned int light_tree::build(const std::vector<light_bounds> &lights, unsigned int *ids, unsigned int count)
+{
+	unsigned int node_id = m_nodes.size();
+	m_nodes.emplace_back();
+	m_parents.push_back(no_node);
+
+	if (count == 1)
+	{
+		m_nodes[node_id] = light_tree_node{lights[ids[0]], ids[0], true};
+		m_leaves[ids[0]] = node_id;
+		return node_id;
+	}
+
+	rt::aabb centroid_box{lights[ids[0]].aabb.get_center(), lights[ids[0]].aabb.get_center()};
+	light_bounds total = lights[ids[0]];
+	for (auto i = 1u; i < count; i++)
+	{
+		centroid_box.add_point(lights[ids[i]].aabb.get_center());
+		total = merge_light_bounds(total, lights[ids[i]]);
+	}
+
+	// Find the split with the lowest SAOH cost
+	constexpr int bucket_count = 12;
+	glm::vec3 extent = centroid_box.get_dimensions();
+	glm::vec3 total_extent = total.aabb.get_dimensions();
+	float best_cost = HUGE_VALF;
+	int best_axis = -1;
+	int best_split = 0;
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		if (!(extent[axis] > 0))
+			continue;
+
+		auto get_bucket = [&](unsigned int id)
+		{
+			float x = (lights[id].aabb.get_center()[axis] - centroid_box.min[axis]) / extent[axis];
+			return std::min(static_cast<int>(x * bucket_count), bucket_count - 1);
+		};
+
+		light_bounds buckets[bucket_count] = {};
+		for (auto i = 0u; i < count; i++)
+		{
+			auto &b = buckets[get_bucket(ids[i])];
+			b = merge_light_bounds(b, lights[ids[i]]);
+		}
+
+		auto get_cost = [&](const light_bounds &b)
+		{
+			float regularization = glm::compMax(total_extent) / std::max(total_extent[axis], 1e-20f);
+			return b.power * get_orientation_cost(b) * regularization * b.aabb.get_area();
+		};
+
+		for (int split = 0; split < bucket_count - 1; split++)
+		{
+			light_bounds left = {}, right = {};
+			for (int i = 0; i <= split; i++)
+				left = merge_light_bounds(left, buckets[i]);
+			for (int i = split + 1; i < bucket_count; i++)
+				right = merge_light_bounds(right, buckets[i]);
+
+			if (left.power <= 0 || right.power <= 0)
+				continue;
+
+			float cost = get_cost(left) + get_cost(right);
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = axis;
+				best_split = split;
+			}
+		}
+	}
+
+	// Partition the lights - split in the middle if no bucket split is possible
+	unsigned int mid = count / 2;
+	if (best_axis >= 0)
+	{
+		int axis = best_axis;
+		auto it = std::partition(ids, ids + count, [&](unsigned int id)
+		{
+			float x = (lights[id].aabb.get_center()[axis] - centroid_box.min[axis]) / extent[axis];
+			return std::min(static_cast<int>(x * bucket_count), bucket_count - 1) <= best_split;
+		});
+
+		if (it != ids && it != ids + count)
+			mid = it - ids;
+	}
+
+	unsigned int left = build(lights, ids, mid);
+	unsigned int right = build(lights, ids + mid, count - mid);
+	m_parents[left] = node_id;
+	m_parents[right] = node_id;
+	m_nodes[node_id] = light_tree_node{merge_light_bounds(m_nodes[left].bounds, m_nodes[right].bounds), right, false};
+	return node_id;
+}
+
+/**
+	\brief Picks a light for point P with normal N
+	\param u uniform random number in [0, 1) - reused at every level
+	\param pmf probability of picking the light
+	\returns false if no light can illuminate the point
+*/
+bool light_tree::sample(const glm::vec3 &P, const glm::vec3 &N, float u, unsigned int &light, float &pmf) const
+{
+	if (m_nodes.empty())
+		return false;
+
+	pmf = 1.f;
+	unsigned int id = 0;
+	while (!m_nodes[id].leaf)
+	{
+		unsigned int left = id + 1;
+		unsigned int right = m_nodes[id].index;
+		float il = m_nodes[left].bounds.get_importance(P, N);
+		float ir = m_nodes[right].bounds.get_importance(P, N);
+		if (il <= 0 && ir <= 0)
+			return false;
+
+		float p_left = il / (il + ir);
+		if (u < p_left)
+		{
+			id = left;
+			u = std::min(u / p_left, 0x1.fffffep-1f);
+			pmf *= p_left;
+		}
+		else
+		{
+			id = right;
+			u = std::min((u - p_left) / (1.f - p_left), 0x1.fffffep-1f);
+			pmf *= 1.f - p_left;
+		}
+	}
+
+	// A single light in the root still has to be able to reach the point
+	if (id == 0 && m_nodes[0].bounds.get_importance(P, N) <= 0)
+		return false;
+
+	light = m_nodes[id].index;
+	return true;
+}
+
+/**
+	\brief Returns the probability of sample() picking given light
+	for point P with normal N
+
+	The path from the leaf to the root is followed using the parent links.
+	Each level contributes the probability of choosing the node over its sibling.
+*/
+float light_tree::get_pmf(const glm::vec3 &P, const glm::vec3 &N, unsigned int light) const
+{
+	unsigned int id = light < m_leaves.size() ? m_leaves[light] : no_node;
+	if (id == no_node)
+		return 0.f;
+
+	if (id == 0)
+		return m_nodes[0].bounds.get_importance(P, N) > 0 ? 1.f : 0.f;
+
+	float pmf = 1.f;
+	while (id != 0)
+	{
+		unsigned int parent = m_parents[id];
+		unsigned int sibling = id == parent + 1 ? m_nodes[parent].index : parent + 1;
+		float i = m_nodes[id].bounds.get_importance(P, N);
+		float is = m_nodes[sibling].bounds.get_importance(P, N);
+		if (i <= 0)
+			return 0.f;
+
+		pmf *= i / (i + is);
+		id = parent;
+	}
+
+	return pmf;
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <vector>
+#include <glm/glm.hpp>
+#include "aabb.hpp"
+
+namespace bu::rt {
+
+/**
+	\brief Spatial and directional bounds of emitted light
+
+	All light is emitted from inside the box. The surface normals lie within
+	theta_o of the axis and the emission falls to zero at theta_e from the normals.
+*/
+struct light_bounds
+{
+	rt::aabb aabb;
+	glm::vec3 axis;
+	float power;       //!< Luminance of the emitted flux
+	float cos_theta_o; //!< Spread of the normals around the axis
+	float cos_theta_e; //!< Spread of the emission around the normals
+	bool two_sided;
+
+	float get_importance(const glm::vec3 &P, const glm::vec3 &N) const;
+};
+
+light_bounds merge_light_bounds(const light_bounds &a, const light_bounds &b);
+
+/**
+	\brief Light tree node - uses the same depth-first layout as bvh_node
+
+	The left child immediately follows its parent and index holds the right
+	child. Every leaf contains a single light.
+*/
+struct light_tree_node
+{
+	light_bounds bounds;
+	unsigned int index; //!< Right child or light index in leaves
+	bool leaf;
+};
+
+/**
+	\brief BVH over lights used for importance-based light selection
+
+	The tree is traversed stochastically from the root - at each node, a child is
+	picked proportionally to an estimate of the light it contributes to the shading
+	point. This gives each point a distribution fitted to its surroundings at a cost
+	logarithmic in the number of lights.
+
+	The nodes are built with surface area orientation heuristic (SAOH), which
+	keeps lights close in both position and direction together.
+
+	\note Based on: Conty Estevez and Kulla - Importance Sampling of Many Lights
+	with Adaptive Tree Splitting (2018) and the light BVH of PBRT-v4
+*/
+class light_tree
+{
+public:
+	static constexpr unsigned int no_node = ~0u;
+
+	light_tree() = default;
+	explicit light_tree(const std::vector<light_bounds> &lights);
+
+	bool empty() const {return m_nodes.empty();}
+	bool sample(const glm::vec3 &P, const glm::vec3 &N, float u, unsigned int &light, float &pmf) const;
+	float get_pmf(const glm::vec3 &P, const glm::vec3 &N, unsigned int light) const;
+	unsigned int get_node_count() const {return m_nodes.size();}
+
+private:
+	unsigned int build(const std::vector<light_bounds> &lights, unsigned int *ids, unsigned int count);
+
+	std::vector<light_tree_node> m_nodes;
+	std::vector<unsigned int> m_parents; //!< Parent of each node
+	std::vector<unsigned int> m_leaves;  //!< Leaf of each light - no_node if the light emits nothing
+};
+
+}
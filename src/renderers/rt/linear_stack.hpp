@@ -33,4 +33,56 @@ private:
 	int m_size = 0;
 };
 
+/**
+	\brief Fixed-size stack which drops its oldest entries instead of overflowing
+
+	Traversals using it have to be able to recover the dropped entries
+	(e.g. by walking up the tree using parent links) once overflowed() is set.
+*/
+template <typename T, int Size>
+class short_stack
+{
+	static_assert((Size & (Size - 1)) == 0, "short_stack size must be a power of two");
+
+public:
+	short_stack() = default;
+
+	void push(const T &t)
+	{
+		m_arr[m_top++ & (Size - 1)] = t;
+		if (m_size < Size)
+			m_size++;
+		else
+			m_overflowed = true;
+	}
+
+	void pop()
+	{
+		--m_top;
+		--m_size;
+	}
+
+	const T &top() const
+	{
+		return m_arr[(m_top - 1) & (Size - 1)];
+	}
+
+	bool empty() const
+	{
+		return m_size == 0;
+	}
+
+	//! Whether any entries have been dropped so far
+	bool overflowed() const
+	{
+		return m_overflowed;
+	}
+
+private:
+	T m_arr[Size];
+	unsigned int m_top = 0;
+	int m_size = 0;
+	bool m_overflowed = false;
+};
+
 }
\ No newline at end of file
@@ -25,6 +25,7 @@ struct material
 	inline ray_bounce sample_basic_diffuse(const glm::vec3 &V, float ior, float u1, float u2) const;
 	inline ray_bounce sample_glass(const glm::vec3 &V, float ior, float u1) const;
 	inline ray_bounce sample_emissive() const;
+	inline glm::vec3 get_albedo() const;
 
 	material_type type;
 
@@ -161,4 +162,23 @@ ray_bounce material::sample_emissive() const
 	return bounce;
 }
 
+/**
+	\brief Returns the color the material tints the reflected light with - used by the denoiser
+*/
+glm::vec3 material::get_albedo() const
+{
+	switch (this->type)
+	{
+		case material_type::BASIC_DIFFUSE:
+			return basic_diffuse.albedo;
+
+		case material_type::GLASS:
+			return glass.color;
+
+		default:
+		case material_type::EMISSIVE:
+			return glm::vec3{1.f};
+	}
+}
+
 }
\ No newline at end of file
@@ -19,10 +19,29 @@ struct triangle
 	int material_id;
 };
 
+/**
+	\brief Precomputed data of a triangle needed for the intersection test only
+
+	Kept separately from the triangles, so traversal doesn't have to fetch
+	normals, UVs and material of every tested triangle.
+*/
+struct triangle_intersection
+{
+	glm::vec3 v0;
+	glm::vec3 e1; //!< vertices[1] - vertices[0]
+	glm::vec3 e2; //!< vertices[2] - vertices[0]
+};
+
+inline triangle_intersection get_triangle_intersection(const triangle &tri)
+{
+	return {tri.vertices[0], tri.vertices[1] - tri.vertices[0], tri.vertices[2] - tri.vertices[0]};
+}
+
 struct ray_hit
 {
 	float t, u, v;
 	const rt::triangle *triangle;
+	const glm::mat3 *normal_matrix = nullptr; //!< Transforms normals of instanced triangles to world space
 };
 
 enum class ray_bounce_type
@@ -50,20 +69,24 @@ inline glm::vec3 ray_hit_pos(const ray &r, const ray_hit &h)
 
 inline glm::vec3 ray_hit_normal(const ray &r, const ray_hit &h)
 {
-	return glm::normalize(
+	glm::vec3 n = 
 		(1.f - h.u - h.v) * h.triangle->normals[0]
 		+ h.u * h.triangle->normals[1]
-		+ h.v * h.triangle->normals[2]
-		);
+		+ h.v * h.triangle->normals[2];
+
+	if (h.normal_matrix)
+		n = *h.normal_matrix * n;
+
+	return glm::normalize(n);
 }
 
 /**
 	\note Based on: https://cadxfem.org/inf/Fast%20MinimumStorage%20RayTriangle%20Intersection.pdf
 */
-inline bool ray_intersect_triangle(const ray &r, const triangle &tri, float &t, float &u, float &v)
+inline bool ray_intersect_triangle(const ray &r, const triangle_intersection &tri, float &t, float &u, float &v)
 {
-	glm::vec3 E1 = tri.vertices[1] - tri.vertices[0];
-	glm::vec3 E2 = tri.vertices[2] - tri.vertices[0];
+	const glm::vec3 &E1 = tri.e1;
+	const glm::vec3 &E2 = tri.e2;
 	glm::vec3 P = glm::cross(r.direction, E2);
 	float det = glm::dot(P, E1);
 	if (det == 0.0)
@@ -71,7 +94,7 @@ inline bool ray_intersect_triangle(const ray &r, const triangle &tri, float &t,
 
 	//! \todo Backface culling
 
-	glm::vec3 T = r.origin - tri.vertices[0];
+	glm::vec3 T = r.origin - tri.v0;
 	glm::vec3 Q = glm::cross(T, E1);
 	glm::vec3 tuv = glm::vec3{glm::dot(Q, E2), glm::dot(P, T), glm::dot(Q, r.direction)} * (1.f / det);
 	t = tuv.x;
@@ -93,4 +116,9 @@ inline bool ray_intersect_triangle(const ray &r, const triangle &tri, float &t,
 	return true;
 }
 
+inline bool ray_intersect_triangle(const ray &r, const triangle &tri, float &t, float &u, float &v)
+{
+	return ray_intersect_triangle(r, get_triangle_intersection(tri), t, u, v);
+}
+
 }
\ No newline at end of file
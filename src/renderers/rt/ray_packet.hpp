@@ -0,0 +1,75 @@
+#pragma once
+#include <cmath>
+#include "ray.hpp"
+
+namespace bu::rt {
+
+constexpr int ray_packet_size = 64; //!< Maximum number of rays in a packet (8x8 pixels)
+
+/**
+	\brief Packet of coherent rays sharing a common origin (e.g. primary camera rays)
+
+	Directions are stored in SoA layout, so the per-ray tests can be vectorized.
+	The common origin is preserved by affine transforms, which makes the packet
+	usable in object space of instances too.
+*/
+struct ray_packet
+{
+	glm::vec3 origin;
+	alignas(32) float dir_x[ray_packet_size];
+	alignas(32) float dir_y[ray_packet_size];
+	alignas(32) float dir_z[ray_packet_size];
+	int size = 0;
+
+	void set_direction(int i, const glm::vec3 &d)
+	{
+		dir_x[i] = d.x;
+		dir_y[i] = d.y;
+		dir_z[i] = d.z;
+	}
+
+	glm::vec3 get_direction(int i) const
+	{
+		return {dir_x[i], dir_y[i], dir_z[i]};
+	}
+
+	rt::ray get_ray(int i) const
+	{
+		return {origin, get_direction(i)};
+	}
+};
+
+/**
+	\brief Closest hits of all rays in a ray_packet - same meaning as in ray_hit
+*/
+struct ray_packet_hit
+{
+	alignas(32) float t[ray_packet_size];
+	alignas(32) float u[ray_packet_size];
+	alignas(32) float v[ray_packet_size];
+	const rt::triangle *triangle[ray_packet_size];
+	const glm::mat3 *normal_matrix[ray_packet_size];
+
+	void clear()
+	{
+		for (int i = 0; i < ray_packet_size; i++)
+		{
+			t[i] = HUGE_VALF;
+			triangle[i] = nullptr;
+			normal_matrix[i] = nullptr;
+		}
+	}
+
+	rt::ray_hit get_hit(int i) const
+	{
+		rt::ray_hit hit;
+		hit.t = t[i];
+		hit.u = u[i];
+		hit.v = v[i];
+		hit.triangle = triangle[i];
+		hit.normal_matrix = normal_matrix[i];
+		return hit;
+	}
+};
+
+}
@@ -7,19 +7,26 @@
 #include "scene_cache.hpp"
 #include "bvh_builder.hpp"
 #include "bvh.hpp"
+#include "tlas.hpp"
 #include "material.hpp"
+#include "light.hpp"
 #include "scene.hpp"
 #include "../../log.hpp"
+#include "../../task_scheduler.hpp"
 
 using namespace std::chrono_literals;
 using bu::rt_renderer;
 using bu::rt_context;
 
-rt_context::rt_context(bu::event_bus &bus, std::shared_ptr<bu::basic_preview_context> preview_ctx) :
+rt_context::rt_context(bu::event_bus &bus, std::shared_ptr<bu::basic_preview_context> preview_ctx, const bu::rt_settings &settings) :
 	m_events(bus.make_connection()),
+	m_settings(settings),
 	m_sampled_image_program(std::make_unique<bu::shader_program>(bu::load_shader_program("draw_sampled_image"))),
 	m_aabb_program(std::make_unique<bu::shader_program>(bu::load_shader_program("aabb"))),
-	m_scene_cache(std::make_unique<bu::rt::scene_cache>())
+	m_scene_cache(std::make_unique<bu::rt::scene_cache>()),
+	m_blas_build_mode(bu::rt::bvh_build_mode::BINNED_SAH),
+	m_blas_build_format(bu::rt::bvh_node_format::FULL),
+	m_worker_pool(std::make_unique<bu::rt_worker_pool>())
 {
 	if (!preview_ctx) preview_ctx = std::make_shared<bu::basic_preview_context>();
 	m_preview_context = std::move(preview_ctx);
@@ -42,88 +49,198 @@ rt_context::rt_context(bu::event_bus &bus, std::shared_ptr<bu::basic_preview_con
 	glVertexArrayAttribBinding(m_aabb_vao.id(), 0, 0);
 }
 
-static std::unique_ptr<bu::rt::bvh_draft> build_bvh_draft(
+rt_context::~rt_context() = default;
+
+/**
+	\brief Builds bottom-level BVHs of the meshes in object space
+	\returns BVHs in the order of the meshes - null if the build has been stopped
+*/
+static std::vector<std::shared_ptr<const bu::rt::bvh_tree>> build_blases(
 	const bu::async_stop_flag *flag,
-	rt_context *ctx)
+	std::vector<std::shared_ptr<const bu::rt::scene_cache_mesh>> meshes,
+	bu::rt::bvh_build_params params,
+	bu::rt::bvh_node_format format)
 {
-	auto cache_ptr = ctx->get_scene_cache();
-	auto draft_ptr = std::make_unique<bu::rt::bvh_draft>();
-	draft_ptr->build(*cache_ptr, *flag);
-	return draft_ptr;
+	ZoneScopedN("BLAS builds");
+
+	// Each build is parallel too, but many small meshes scale better this way
+	std::vector<std::shared_ptr<const bu::rt::bvh_tree>> blases(meshes.size());
+	bu::task_scheduler::get().parallel_for(0, meshes.size(), 1, [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			bu::rt::bvh_draft draft;
+			draft.build({meshes[i]}, *flag, params);
+			if (flag->should_stop()) return;
+
+			auto bvh = std::make_shared<bu::rt::bvh_tree>(draft.get_node_count(), draft.get_triangle_count());
+			bvh->populate(draft, bu::rt::get_bvh_width(), format);
+			blases[i] = std::move(bvh);
+		}
+	});
+
+	return blases;
 }
 
+/**
+	\brief Builds the RT scene - the previous TLAS is refitted if possible
+
+	The lights are collected from the finished TLAS, so the light tree matches
+	the instances found by rays.
+*/
 static std::unique_ptr<bu::rt::scene> build_rt_scene(
 	const bu::async_stop_flag *flag,
-	rt_context *ctx,
-	std::shared_ptr<bu::rt::bvh_draft> draft_ptr)
+	std::vector<bu::rt::material> materials,
+	std::vector<bu::rt::bvh_instance> instances,
+	std::vector<bu::rt::point_light> point_lights,
+	std::shared_ptr<const bu::rt::tlas> previous_tlas)
 {
-	auto cache_ptr = ctx->get_scene_cache();
-	auto materials = std::make_shared<std::vector<bu::rt::material>>(cache_ptr->get_materials());
-	
-	// Build BVH
-	auto bvh = std::make_shared<bu::rt::bvh_tree>(draft_ptr->get_height(), draft_ptr->get_triangle_count());
-	bvh->populate(*draft_ptr);
+	auto tlas = std::make_shared<bu::rt::tlas>();
+	if (previous_tlas)
+	{
+		*tlas = *previous_tlas;
+		if (tlas->refit(instances))
+			LOG_DEBUG << "TLAS refitted - SAH cost " << tlas->get_sah_cost() << " (" << tlas->build_sah_cost << " after build)";
+		else
+			previous_tlas.reset();
+	}
+
+	if (!previous_tlas)
+		tlas->build(std::move(instances), *flag);
 
 	auto scene = std::make_unique<bu::rt::scene>();
-	scene->bvh = bvh;
-	scene->materials = materials;
+	scene->tlas = tlas;
+	scene->materials = std::make_shared<std::vector<bu::rt::material>>(std::move(materials));
+	scene->lights = std::make_shared<bu::rt::light_list>(*tlas, *scene->materials, std::move(point_lights));
 	return scene;
 }
 
-void rt_context::update_from_scene(const bu::scene &scene, bool allow_build)
+/**
+	\brief Kills running BLAS build and starts a new one for given meshes
+*/
+void rt_context::start_blas_build(bu::rt::bvh_build_mode mode, bu::rt::bvh_node_format format, std::vector<std::shared_ptr<const bu::rt::scene_cache_mesh>> meshes)
 {
-	const auto policy = std::launch::async;
+	bu::rt::bvh_build_params params;
+	params.mode = mode;
+	params.leaf_block_size = bu::rt::get_bvh_width();
+
+	m_blas_build_task.reset();
+	m_blas_build_task = bu::make_async_task(
+		bu::global_task_cleaner,
+		std::launch::async,
+		build_blases,
+		meshes,
+		params,
+		format);
+
+	m_blas_build_meshes = std::move(meshes);
+	m_blas_build_mode = mode;
+	m_blas_build_format = format;
+}
+
+/**
+	Updates the scene cache and manages acceleration structure builds.
 
-	if (scene.root_node->is_visibly_modified() && allow_build)
+	Every mesh gets its own bottom-level BVH in object space, shared by all
+	instances of the mesh. Instance changes (e.g. transforms) only require
+	the top-level BVH to be rebuilt.
+
+	While the scene is being edited interactively (interactive = true), new meshes
+	get fast LBVH builds. Once the edit is finished, their BVHs are rebuilt in the
+	background with the build mode selected in the settings (binned SAH by default)
+	and replace the LBVH ones when complete. The same happens to meshes whose BVH
+	has been built with other mode or node format than the settings select.
+*/
+void rt_context::update_from_scene(const bu::scene &scene, bool interactive)
+{
+	if (scene.root_node->is_visibly_modified())
 	{
-		auto [update_scene, update_bvh] = m_scene_cache->update_from_scene(scene);
-		if (update_bvh)
+		auto [update_scene, update_tlas] = m_scene_cache->update_from_scene(scene);
+		if (update_tlas)
 		{
-			LOG_INFO << "BVH cache modified - initiating draft build!";
-
-			// Kill running tasks and start building a new BVH
-			m_bvh_draft_build_task.reset();
-			m_scene_build_task.reset();
-			m_bvh_draft_build_task = bu::make_async_task(bu::global_task_cleaner, policy, build_bvh_draft, this);
+			m_tlas_outdated = true;
 		}
 		else if (m_scene)
 		{
 			LOG_INFO << "Preserving BVH through scene update!";
 			
 			auto new_scene = std::make_shared<rt::scene>();
-			new_scene->bvh = m_scene->bvh;
+			new_scene->tlas = m_scene->tlas;
 			new_scene->materials = std::make_shared<std::vector<rt::material>>(m_scene_cache->get_materials());
+			new_scene->lights = std::make_shared<rt::light_list>(*new_scene->tlas, *new_scene->materials, m_scene_cache->get_point_lights());
 			m_scene = std::move(new_scene);
 		}
 	}
 
-	// When BVH draft is complete, update BVH preview and start scene build
-	if (m_bvh_draft_build_task.has_value() && m_bvh_draft_build_task->is_ready())
+	// Start BLAS builds - an interactive build preempts a running refinement
+	bool blas_running = m_blas_build_task.has_value();
+	if (!blas_running || (interactive && m_blas_build_mode != bu::rt::bvh_build_mode::LBVH))
 	{
-		LOG_INFO << "BVH draft complete!";
+		auto meshes = m_scene_cache->get_meshes_to_build(interactive, m_settings.bvh_build_mode, m_settings.bvh_format);
+		if (!meshes.empty())
+		{
+			LOG_DEBUG << "Initiating BLAS build for " << meshes.size() << " meshes";
+			start_blas_build(interactive ? bu::rt::bvh_build_mode::LBVH : m_settings.bvh_build_mode, m_settings.bvh_format, std::move(meshes));
+		}
+	}
 
-		std::shared_ptr<bu::rt::bvh_draft> draft{m_bvh_draft_build_task->get()};
-		auto aabbs = draft->get_tree_aabbs();
-		glNamedBufferData(m_aabb_buffer.id(), 0, nullptr, GL_STATIC_DRAW);
-		glNamedBufferData(m_aabb_buffer.id(), bu::vector_size(aabbs), aabbs.data(), GL_STATIC_DRAW);
-		m_aabb_count = aabbs.size();
+	// Assign complete BLASes to the meshes
+	if (m_blas_build_task.has_value() && m_blas_build_task->is_ready())
+	{
+		std::vector<std::shared_ptr<const bu::rt::bvh_tree>> blases;
+		try
+		{
+			blases = m_blas_build_task->get();
+		}
+		catch (const std::exception &ex)
+		{
+			LOG_ERROR << "BLAS build failed: " << ex.what();
+		}
+
+		for (auto i = 0u; i < blases.size(); i++)
+			if (blases[i])
+				m_scene_cache->set_mesh_bvh(*m_blas_build_meshes[i], std::move(blases[i]), m_blas_build_mode, m_blas_build_format);
 
-		m_scene_build_task = bu::make_async_task(bu::global_task_cleaner, policy, build_rt_scene, this, draft);
-		m_bvh_draft_build_task.reset();
+		LOG_DEBUG << "BLAS build complete!";
+		m_blas_build_task.reset();
+		m_blas_build_meshes.clear();
+		m_tlas_outdated = true;
+	}
+
+	// Rebuild TLAS once all meshes have their BLASes, so no geometry goes missing
+	if (m_tlas_outdated && m_scene_cache->get_meshes_to_build(true, m_settings.bvh_build_mode, m_settings.bvh_format).empty())
+	{
+		m_scene_build_task.reset();
+		m_scene_build_task = bu::make_async_task(
+			bu::global_task_cleaner,
+			std::launch::async,
+			build_rt_scene,
+			m_scene_cache->get_materials(),
+			m_scene_cache->get_instances(),
+			m_scene_cache->get_point_lights(),
+			m_scene ? m_scene->tlas : nullptr);
+		m_tlas_outdated = false;
 	}
 
-	// Update scene
+	// Update scene and BVH preview
 	if (m_scene_build_task.has_value() && m_scene_build_task->is_ready())
 	{
 		this->m_scene = m_scene_build_task->get();
 		m_scene_build_task.reset();
-		LOG_INFO << "Final BVH build finished: " << this->m_scene->bvh->triangle_count << " triangles and " << this->m_scene->bvh->node_count << " nodes";
+
+		auto aabbs = m_scene->tlas->get_aabbs();
+		glNamedBufferData(m_aabb_buffer.id(), 0, nullptr, GL_STATIC_DRAW);
+		glNamedBufferData(m_aabb_buffer.id(), bu::vector_size(aabbs), aabbs.data(), GL_STATIC_DRAW);
+		m_aabb_count = aabbs.size();
+
+		LOG_DEBUG << "TLAS update finished: " << m_scene->tlas->instances.size() << " instances and " << m_scene->tlas->get_triangle_count() << " triangles";
 	}	
 }
 
 rt_renderer::rt_renderer(std::shared_ptr<rt_context> context) :
 	m_context(std::move(context)),
 	m_preview_renderer(std::make_unique<bu::basic_preview_renderer>(m_context->get_basic_preview_context())),
+	m_settings(m_context->get_settings()),
 	m_job(std::make_unique<bu::rt_renderer_job>(m_context))
 {
 	set_viewport_size({1024, 1024});
@@ -167,7 +284,7 @@ void rt_renderer::draw(const bu::scene &scene, const bu::camera &camera, const g
 	FrameMarkStart(tracy_frame);
 	ZoneScopedN("rt_renderer::draw()");
 
-	bool changed = scene.layout_ed.is_transform_pending();
+	bool changed = false;
 
 	// Detect viewport change
 	if (viewport_size != m_viewport)
@@ -183,17 +300,26 @@ void rt_renderer::draw(const bu::scene &scene, const bu::camera &camera, const g
 		changed = true;
 	}
 
-	// Detect BVH update
+	// If changed anything, reset the timer and stop the job
+	if (changed)
+	{
+		m_last_change = std::chrono::steady_clock::now();
+		if (m_job) m_job->stop();
+		m_active = false;
+	}
+
+	// Detect BVH update - restart immediately, so interactive edits are visible
 	if (m_last_scene != m_context->get_scene().get())
 	{
 		m_last_scene = m_context->get_scene().get();
-		changed = true;
+		if (m_job) m_job->stop();
+		m_active = false;
 	}
 
-	// If changed anything, reset the timer and stop the job
-	if (changed)
+	// Settings changes restart immediately too
+	if (m_settings != m_context->get_settings())
 	{
-		m_last_change = std::chrono::steady_clock::now();
+		m_settings = m_context->get_settings();
 		if (m_job) m_job->stop();
 		m_active = false;
 	}
@@ -202,7 +328,7 @@ void rt_renderer::draw(const bu::scene &scene, const bu::camera &camera, const g
 	if (!m_active && m_context->get_scene() && std::chrono::steady_clock::now() - m_last_change > 0.5s)
 	{
 		if (m_job) m_job->stop();
-		m_job->start(m_context->get_scene(), m_camera, m_viewport, 512);
+		m_job->start(m_context->get_scene(), m_camera, m_viewport, m_settings);
 		m_active = true;
 	}
 
@@ -240,7 +366,23 @@ void rt_renderer::draw(const bu::scene &scene, const bu::camera &camera, const g
 			ZoneScopedN("PBO upload")
 
 			auto ctx = m_job->get_job_context();
-			ctx->inhibit_splat = true;
+
+			// Show the denoised image once there is one
+			bool denoised = false;
+			if (ctx->settings.denoise)
+			{
+				std::lock_guard lock{ctx->denoised_mutex};
+				if (!ctx->denoised.empty())
+				{
+					glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pbo.id());
+					glBufferData(GL_PIXEL_UNPACK_BUFFER, bu::vector_size(ctx->denoised), nullptr, GL_STREAM_DRAW);
+					glBufferData(GL_PIXEL_UNPACK_BUFFER, bu::vector_size(ctx->denoised), ctx->denoised.data(), GL_STREAM_DRAW);
+					denoised = true;
+				}
+			}
+
+			ctx->inhibit_splat = !denoised;
+			if (!denoised)
 			{
 				std::lock_guard lock{ctx->image_mutex};
 				ZoneScopedN("PBO upload image lock");
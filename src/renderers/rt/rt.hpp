@@ -9,6 +9,7 @@
 #include "camera.hpp"
 #include "renderer.hpp"
 #include "renderers/preview/basic_preview.hpp"
+#include "renderers/rt/settings.hpp"
 #include "event.hpp"
 
 namespace bu::rt {
@@ -17,17 +18,23 @@ class bvh_draft;
 struct bvh_tree;
 struct material;
 struct scene;
+struct scene_cache_mesh;
 }
 
 namespace bu {
 class rt_renderer_job;
+class rt_worker_pool;
 
 class rt_context
 {
 public:
-	rt_context(bu::event_bus &bus, std::shared_ptr<bu::basic_preview_context> preview_ctx = {});
+	rt_context(bu::event_bus &bus, std::shared_ptr<bu::basic_preview_context> preview_ctx = {}, const bu::rt_settings &settings = {});
+	~rt_context();
 
-	void update_from_scene(const bu::scene &scene, bool allow_rebuild);
+	void update_from_scene(const bu::scene &scene, bool interactive);
+
+	const auto &get_settings() const {return m_settings;}
+	void set_settings(const bu::rt_settings &settings) {m_settings = settings;}
 
 	auto get_basic_preview_context() const {return m_preview_context;}
 	auto &get_sampled_image_program() const {return *m_sampled_image_program;}
@@ -42,10 +49,17 @@ public:
 	auto get_scene() const {return m_scene;}
 	auto get_scene_cache() const {return m_scene_cache;}
 
+	auto &get_worker_pool() {return *m_worker_pool;}
+
 private:
+	void start_blas_build(bu::rt::bvh_build_mode mode, bu::rt::bvh_node_format format, std::vector<std::shared_ptr<const bu::rt::scene_cache_mesh>> meshes);
+
 	// Event bus connection
 	std::shared_ptr<bu::event_bus_connection> m_events;
 
+	// Settings of the path tracer shared by all its renderers
+	bu::rt_settings m_settings;
+
 	// Embedded preview renderer
 	std::shared_ptr<bu::basic_preview_context> m_preview_context;
 
@@ -65,13 +79,22 @@ private:
 	std::shared_ptr<bu::rt::scene_cache> m_scene_cache;
 	std::shared_ptr<bu::rt::scene> m_scene;
 
-	std::optional<bu::async_task<std::unique_ptr<bu::rt::bvh_draft>>> m_bvh_draft_build_task;
+	std::optional<bu::async_task<std::vector<std::shared_ptr<const bu::rt::bvh_tree>>>> m_blas_build_task;
 	std::optional<bu::async_task<std::unique_ptr<bu::rt::scene>>> m_scene_build_task;
+
+	// BLAS build state
+	std::vector<std::shared_ptr<const bu::rt::scene_cache_mesh>> m_blas_build_meshes; //!< Meshes processed by the running BLAS build
+	bu::rt::bvh_build_mode m_blas_build_mode;
+	bu::rt::bvh_node_format m_blas_build_format;
+	bool m_tlas_outdated = false; //!< Instances changed since the last TLAS build was started
+
+	// Threads running the path tracing jobs
+	std::unique_ptr<bu::rt_worker_pool> m_worker_pool;
 };
 
 /**
-	The renderer spawns rt_renderer_job. If any rendering parameters change
-	the job is respawned.
+	The renderer runs rt_renderer_job on the worker pool of the context.
+	If any rendering parameters change the job is restarted.
 */
 class rt_renderer : public bu::renderer
 {
@@ -101,6 +124,7 @@ private:
 	bu::camera m_camera;
 	std::chrono::time_point<std::chrono::steady_clock> m_last_change;
 	const bu::rt::scene *m_last_scene;
+	bu::rt_settings m_settings;
 	bool m_active = false;
 
 	// Current job
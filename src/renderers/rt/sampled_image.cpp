@@ -1,4 +1,6 @@
 #include "sampled_image.hpp"
+#include <cmath>
+#include <algorithm>
 #include <tracy/Tracy.hpp>
 
 using bu::rt::pixel_splat;
@@ -18,7 +20,9 @@ splat_bucket::~splat_bucket()
 
 sampled_image::sampled_image(glm::ivec2 s) :
 	size(s),
-	data(s.x * s.y)
+	data(s.x * s.y),
+	moments(s.x * s.y),
+	aovs(s.x * s.y, aov_sample{glm::vec3{0.f}, glm::vec3{0.f}, 0.f})
 {
 }
 
@@ -41,8 +45,19 @@ void sampled_image::splat(splat_bucket &bucket)
 		};
 
 		if (A.x >= 0 && A.y >= 0 && A.x < size.x && A.y < size.y)
+		{
 			at(A) += w.x * glm::vec4{splat.color, splat.samples};
 
+			// The statistics and AOVs are not filtered - the sample counts in the pixel it fell into
+			float lum = glm::dot(splat.color, glm::vec3{0.2126f, 0.7152f, 0.0722f});
+			moments[A.x + A.y * size.x] += glm::vec3{lum, lum * lum, splat.samples};
+
+			auto &aov = aovs[A.x + A.y * size.x];
+			aov.albedo += splat.aov.albedo * splat.samples;
+			aov.normal += splat.aov.normal * splat.samples;
+			aov.depth += splat.aov.depth * splat.samples;
+		}
+
 		if (B.x >= 0 && A.y >= 0 && B.x < size.x && A.y < size.y)
 			at(glm::ivec2{B.x, A.y}) += w.y * glm::vec4{splat.color, splat.samples};
 
@@ -58,4 +73,70 @@ void sampled_image::clear()
 {
 	for (auto &pixel : data)
 		pixel = glm::vec4{0.f};
+
+	for (auto &m : moments)
+		m = glm::vec3{0.f};
+
+	for (auto &aov : aovs)
+		aov = aov_sample{glm::vec3{0.f}, glm::vec3{0.f}, 0.f};
+}
+
+/**
+	\brief Copies all channels of a rectangle from another image of the same size
+	\param min, max the rectangle (max is exclusive)
+*/
+void sampled_image::copy_rect(const sampled_image &src, glm::ivec2 min, glm::ivec2 max)
+{
+	min = glm::max(min, glm::ivec2{0});
+	max = glm::min(max, glm::min(size, src.size));
+	for (int y = min.y; y < max.y; y++)
+	{
+		int begin = min.x + y * size.x;
+		int end = max.x + y * size.x;
+		std::copy(src.data.begin() + begin, src.data.begin() + end, data.begin() + begin);
+		std::copy(src.moments.begin() + begin, src.moments.begin() + end, moments.begin() + begin);
+		std::copy(src.aovs.begin() + begin, src.aovs.begin() + end, aovs.begin() + begin);
+	}
+}
+
+/**
+	\brief Estimates the error of the pixels in a rectangle
+
+	The error of each pixel is its standard error divided by the square root of
+	its mean, so dark and bright areas converge at a similar perceived rate.
+	The worst pixel decides, so a few noisy pixels aren't averaged away.
+
+	A pixel whose samples are all equal (e.g. all black, because the paths
+	reaching a light are rare) looks converged, so it needs 4 times as many
+	samples before its zero variance is trusted.
+
+	\param min, max the rectangle (max is exclusive)
+	\param min_samples pixels with fewer samples have infinite error
+	\returns the largest error of the pixels
+*/
+float sampled_image::get_error(glm::ivec2 min, glm::ivec2 max, float min_samples) const
+{
+	min = glm::max(min, glm::ivec2{0});
+	max = glm::min(max, size);
+	if (min.x >= max.x || min.y >= max.y)
+		return 0.f;
+
+	float max_error = 0.f;
+	for (int y = min.y; y < max.y; y++)
+		for (int x = min.x; x < max.x; x++)
+		{
+			const auto &m = moments[x + y * size.x];
+			float n = m.z;
+			if (n < min_samples || n < 2)
+				return HUGE_VALF;
+
+			float mean = m.x / n;
+			float variance = std::max(0.f, m.y / n - mean * mean) * n / (n - 1);
+			if (variance <= 0 && n < 4 * min_samples)
+				return HUGE_VALF;
+
+			max_error = std::max(max_error, variance / (n * std::max(mean, 1e-3f)));
+		}
+
+	return std::sqrt(max_error);
 }
\ No newline at end of file
@@ -5,6 +5,18 @@
 
 namespace bu::rt {
 
+/**
+	\brief Auxiliary outputs (AOVs) of a path - features of the first surface hit
+
+	Used to guide the denoiser. Misses have zero normal and depth.
+*/
+struct aov_sample
+{
+	glm::vec3 albedo{1.f};
+	glm::vec3 normal{0.f};
+	float depth = 0.f;
+};
+
 /**
 	\brief Result of sampling a ray
 */
@@ -13,6 +25,7 @@ struct pixel_splat
 	glm::vec3 color;
 	glm::vec2 pos;
 	float samples;
+	aov_sample aov;
 };
 
 /**
@@ -25,16 +38,22 @@ struct splat_bucket
 
 	pixel_splat *data;
 	size_t size;
+	int tile = -1; //!< Tile of the image the samples were taken in
 };
 
 
 /**
+	\brief Image accumulating the path tracing samples
 
+	Besides the filtered color, statistics of the sample luminance are kept
+	in each pixel, so the error of the estimate can be judged for adaptive sampling.
 */
 struct sampled_image
 {
 	glm::ivec2 size;
-	std::vector<glm::vec4> data;
+	std::vector<glm::vec4> data;    //!< Sum of weighted colors and the sum of weights
+	std::vector<glm::vec3> moments; //!< Sum of luminance, sum of squared luminance and sample count
+	std::vector<aov_sample> aovs;   //!< Sums of the AOVs of the samples (divide by the sample count)
 
 	sampled_image(glm::ivec2 size);
 
@@ -45,6 +64,8 @@ struct sampled_image
 
 	void splat(splat_bucket &bucket);
 	void clear();
+	void copy_rect(const sampled_image &src, glm::ivec2 min, glm::ivec2 max);
+	float get_error(glm::ivec2 min, glm::ivec2 max, float min_samples) const;
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,213 @@
+#pragma once
+#include <cstdint>
+#include <glm/glm.hpp>
+
+namespace bu::rt {
+
+/**
+	\brief Kind of sample sequence generated by rt::sampler
+*/
+enum class sampler_type
+{
+	RANDOM, //!< Independent uniform random numbers (PCG32)
+	SOBOL,  //!< Owen-scrambled Sobol sequence - stratified across samples of a pixel
+};
+
+/**
+	\brief PCG32 random number generator - 16 bytes of state
+
+	Satisfies UniformRandomBitGenerator, so it can be used with the standard distributions.
+
+	\note Based on: O'Neill - PCG: A Family of Simple Fast Space-Efficient
+	Statistically Good Algorithms for Random Number Generation (2014)
+*/
+class pcg32
+{
+public:
+	using result_type = std::uint32_t;
+
+	explicit pcg32(std::uint64_t seed = 0x853c49e6748fea9bull, std::uint64_t stream = 0xda3e39cb94b95bdbull) :
+		m_state(0),
+		m_inc((stream << 1) | 1)
+	{
+		(*this)();
+		m_state += seed;
+		(*this)();
+	}
+
+	static constexpr result_type min() {return 0;}
+	static constexpr result_type max() {return ~result_type{0};}
+
+	result_type operator()()
+	{
+		std::uint64_t old = m_state;
+		m_state = old * 6364136223846793005ull + m_inc;
+		auto xorshifted = static_cast<std::uint32_t>(((old >> 18) ^ old) >> 27);
+		auto rot = static_cast<std::uint32_t>(old >> 59);
+		return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+	}
+
+	/**
+		\brief Returns a uniform float in [0, 1)
+	*/
+	float next_float()
+	{
+		return ((*this)() >> 8) * 0x1p-24f;
+	}
+
+private:
+	std::uint64_t m_state;
+	std::uint64_t m_inc;
+};
+
+namespace detail {
+
+inline std::uint32_t hash_u32(std::uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+inline std::uint32_t hash_combine(std::uint32_t seed, std::uint32_t v)
+{
+	return hash_u32(seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+inline std::uint32_t reverse_bits(std::uint32_t x)
+{
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+	return __builtin_bswap32(x);
+}
+
+/**
+	\brief Hash-based permutation in which each bit only depends on the bits below it
+
+	Applied to bit-reversed numbers, this is Owen scrambling of the original ones.
+*/
+inline std::uint32_t laine_karras_permutation(std::uint32_t x, std::uint32_t seed)
+{
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return x;
+}
+
+/**
+	\brief Second dimension of the Sobol sequence, bit-reversed (the first one is just the index)
+
+	The generator matrix is the Pascal matrix mod 2, so the output bit j is the
+	XOR of the index bits k whose binary digits are a superset of j's (Lucas' theorem).
+*/
+inline std::uint32_t sobol_dim1_reversed(std::uint32_t index)
+{
+	index ^= (index >> 1) & 0x55555555u;
+	index ^= (index >> 2) & 0x33333333u;
+	index ^= (index >> 4) & 0x0f0f0f0fu;
+	index ^= (index >> 8) & 0x00ff00ffu;
+	index ^= (index >> 16) & 0x0000ffffu;
+	return index;
+}
+
+inline float u32_to_float(std::uint32_t x)
+{
+	return (x >> 8) * 0x1p-24f;
+}
+
+}
+
+/**
+	\brief Source of the random numbers used by the path tracing kernels
+
+	A sampler is a small value type - every path carries its own copy. It is
+	set up with start_sample() for a pixel and the index of the sample within
+	that pixel, after which each get_1d()/get_2d() call returns the next
+	dimension of the sample.
+
+	In SOBOL mode, every dimension (or pair of dimensions) is a 1D/2D Sobol point
+	set with a random shuffle of the sample index and Owen scrambling seeded by
+	the pixel and the dimension. Samples of one pixel are then well stratified in
+	every dimension, while different pixels and dimensions stay uncorrelated.
+
+	\note Based on: Burley - Practical Hash-based Owen Scrambling (2020)
+*/
+class sampler
+{
+public:
+	explicit sampler(sampler_type type = sampler_type::RANDOM, std::uint32_t seed = 0) :
+		m_type(type),
+		m_seed(seed)
+	{
+	}
+
+	/**
+		\brief Starts a new sample of given pixel
+		\param sample_index index of the sample within the pixel
+	*/
+	void start_sample(std::uint32_t pixel, std::uint32_t sample_index)
+	{
+		m_pixel_seed = detail::hash_combine(m_seed, pixel);
+		m_index = sample_index;
+		m_dimension = 0;
+
+		if (m_type == sampler_type::RANDOM)
+			m_rng = pcg32{(static_cast<std::uint64_t>(m_pixel_seed) << 32) | sample_index, m_seed};
+	}
+
+	float get_1d()
+	{
+		if (m_type == sampler_type::RANDOM)
+			return m_rng.next_float();
+
+		// Scrambled van der Corput sequence - the bit-reversed value is the index itself
+		std::uint32_t seed = detail::hash_combine(m_pixel_seed, m_dimension++);
+		std::uint32_t x = detail::laine_karras_permutation(get_shuffled_index(seed), detail::hash_u32(seed));
+		return detail::u32_to_float(detail::reverse_bits(x));
+	}
+
+	glm::vec2 get_2d()
+	{
+		if (m_type == sampler_type::RANDOM)
+		{
+			float u = m_rng.next_float();
+			return glm::vec2{u, m_rng.next_float()};
+		}
+
+		// The first two Sobol dimensions, scrambled independently
+		std::uint32_t seed = detail::hash_combine(m_pixel_seed, m_dimension++);
+		std::uint32_t index = get_shuffled_index(seed);
+		std::uint32_t x = detail::laine_karras_permutation(index, detail::hash_u32(seed));
+		std::uint32_t y = detail::laine_karras_permutation(detail::sobol_dim1_reversed(index), detail::hash_u32(seed ^ 0x5bd1e995u));
+		return glm::vec2{
+			detail::u32_to_float(detail::reverse_bits(x)),
+			detail::u32_to_float(detail::reverse_bits(y))
+		};
+	}
+
+	sampler_type get_type() const {return m_type;}
+
+private:
+	/**
+		\brief Owen-scrambled sample index - a different order of the samples for each dimension
+	*/
+	std::uint32_t get_shuffled_index(std::uint32_t seed) const
+	{
+		return detail::reverse_bits(detail::laine_karras_permutation(detail::reverse_bits(m_index), seed));
+	}
+
+	sampler_type m_type;
+	std::uint32_t m_seed;
+	std::uint32_t m_pixel_seed = 0;
+	std::uint32_t m_index = 0;
+	std::uint32_t m_dimension = 0;
+	pcg32 m_rng;
+};
+
+}
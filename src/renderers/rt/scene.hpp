@@ -4,16 +4,17 @@
 
 namespace bu::rt {
 struct material;
-struct bvh_tree;
+struct tlas;
+struct light_list;
 
 /**
-	\brief RT scene - BVH + RT material and RT light arrays
+	\brief RT scene - TLAS + RT material and RT light arrays
 */
 struct scene
 {
-	std::shared_ptr<bu::rt::bvh_tree> bvh;
+	std::shared_ptr<bu::rt::tlas> tlas;
 	std::shared_ptr<std::vector<bu::rt::material>> materials;
-	// std::shared_ptr<std::vector<bu::rt::light>> lights;
+	std::shared_ptr<const bu::rt::light_list> lights;
 };
 
 }
\ No newline at end of file
@@ -1,45 +1,29 @@
 #include "scene_cache.hpp"
+#include <algorithm>
 #include <tracy/Tracy.hpp>
 #include "aabb.hpp"
 #include "material.hpp"
 #include "../../mesh.hpp"
 #include "../../model.hpp"
 #include "../../material.hpp"
+#include "../../light.hpp"
 #include "../../log.hpp"
 #include "bvh_builder.hpp"
+#include "bvh.hpp"
 
 using bu::rt::scene_cache;
 using bu::rt::scene_cache_material;
 using bu::rt::scene_cache_mesh;
+using bu::rt::bvh_build_mode;
 
-static void mesh_to_triangles(std::vector<bu::rt::triangle> &tris, const bu::mesh &mesh, const glm::mat4 &transform, int material_id)
+static void mesh_to_triangles(std::vector<bu::rt::triangle> &tris, const bu::mesh &mesh, int material_id)
 {
 	ZoneScopedN("mesh_to_triangles()");
 	tris.reserve(tris.size() + mesh.indices.size() / 3);
 
-	// Transform matrix for normals
-	glm::mat3 tn{transform};
-	tn[0] /= glm::dot(tn[0], tn[0]);
-	tn[1] /= glm::dot(tn[1], tn[1]);
-	tn[2] /= glm::dot(tn[2], tn[2]);
-
 	if (mesh.indices.size() % 3)
 		LOG_ERROR << "There are some redundant indices in the mesh!";
 
-	std::vector<glm::vec3> vertices(mesh.vertices.size());
-	std::transform(mesh.vertices.begin(), mesh.vertices.end(), vertices.begin(),
-		[transform](const glm::vec3 &v)
-		{
-			return glm::vec3{transform * glm::vec4{v, 1}};
-		});
-
-	std::vector<glm::vec3> normals(mesh.normals.size());
-	std::transform(mesh.normals.begin(), mesh.normals.end(), normals.begin(),
-		[tn](const glm::vec3 &n)
-		{
-			return glm::normalize(tn * n);
-		});
-
 	bu::rt::triangle t;
 	for (auto i = 0u; i < mesh.indices.size(); i++)
 	{
@@ -47,8 +31,8 @@ static void mesh_to_triangles(std::vector<bu::rt::triangle> &tris, const bu::mes
 		auto index = mesh.indices[i];
 
 		t.material_id = material_id;
-		t.vertices[vi] = vertices[index];
-		t.normals[vi] = normals[index];
+		t.vertices[vi] = mesh.vertices[index];
+		t.normals[vi] = glm::normalize(mesh.normals[index]);
 		
 		if (i < mesh.uvs.size())
 			t.uvs[vi] = mesh.uvs[index];
@@ -59,102 +43,54 @@ static void mesh_to_triangles(std::vector<bu::rt::triangle> &tris, const bu::mes
 }
 
 /**
-	\returns true if the mesh has been updated
+	\brief Returns cached triangles of a mesh with given material - converts the mesh if necessary
 */
-bool scene_cache::update_from_model_node(
-	bu::rt::scene_cache_mesh &cached_mesh,
-	const bu::model_node &node,
-	bool force_update)
+std::shared_ptr<const scene_cache_mesh> scene_cache::get_mesh(const std::shared_ptr<bu::mesh> &mesh, int material_id)
 {
-	ZoneScopedN("scene_cache::update_from_model_node()");
-
-	// Update transform
-	bool transform_changed = false;
-	if (cached_mesh.transform != node.get_final_transform())
+	auto &ptr = m_meshes[{mesh->uid(), material_id}];
+	if (!ptr)
 	{
-		transform_changed = true;
-		cached_mesh.transform = node.get_final_transform();
-		// LOG_DEBUG << "BVH mesh change - transform change";
+		ZoneScopedN("Mesh conversion");
+		ptr = std::make_shared<scene_cache_mesh>();
+		ptr->mesh = mesh;
+		ptr->mesh_uid = mesh->uid();
+		ptr->material_id = material_id;
+		mesh_to_triangles(ptr->triangles, *mesh, material_id);
+		ptr->aabb = bu::rt::triangles_aabb(ptr->triangles.data(), ptr->triangles.size());
+		LOG_DEBUG << "Adding a new mesh to the cache";
 	}
 
-	// Update meshes
-	bool meshes_changed = false;
-	auto &model = *node.model;
-
-	// Check if any meshes have been added or removed
-	if (cached_mesh.meshes.size() != model.get_mesh_count())
-	{
-		meshes_changed = true;
-		// LOG_DEBUG << "BVH mesh change - different mesh count";
-	}
-	else
-	{
-		// Compare mesh IDs and not pointers for safety
-		auto cmp_mesh_ptr = [](std::shared_ptr<bu::mesh> a, std::shared_ptr<bu::mesh> b)
-		{
-			if (!a) return true;
-			else if (!b) return false;
-			else return a->uid() < b->uid();
-		};
-
-		// Detect any missing meshes
-		std::set<std::shared_ptr<bu::mesh>, decltype(cmp_mesh_ptr)> our_meshes(cmp_mesh_ptr);
-		for (const auto &wptr : cached_mesh.meshes)
-		{
-			auto ptr = wptr.lock();
-			if (!wptr.lock())
-			{
-				meshes_changed = true;
-				// LOG_DEBUG << "BVH mesh change - mesh destructed";
-				break;
-			}
+	ptr->visited = true;
+	return ptr;
+}
 
-			our_meshes.emplace(std::move(ptr));
-		}
-			
-		// Check if the scene node contains the same meshes
-		for (auto i = 0u; i < model.get_mesh_count(); i++)
-		{
-			auto mesh_ptr = model.get_mesh(i);
-			auto it = our_meshes.find(mesh_ptr);
-			if (it == our_meshes.end())
-			{
-				meshes_changed = true;
-				// LOG_DEBUG << "BVH mesh change - different meshes";
-				break;
-			}
-		}
-	}
+/**
+	Only the transform and the list of referenced meshes are stored in the instance,
+	so transform changes don't require any triangle processing.
 
-	bool visibility_changed = false;
-	if (cached_mesh.visible != node.is_visible())
-	{
-		cached_mesh.visible = node.is_visible();
-		visibility_changed = true;
-	}
+	\returns true if the instance has been updated
+*/
+bool scene_cache::update_from_model_node(
+	bu::rt::scene_cache_instance &instance,
+	const bu::model_node &node)
+{
+	ZoneScopedN("scene_cache::update_from_model_node()");
+	auto &model = *node.model;
 
-	bool changed = transform_changed || meshes_changed || visibility_changed || force_update;
+	std::vector<std::shared_ptr<const scene_cache_mesh>> meshes;
+	meshes.reserve(model.get_mesh_count());
+	for (auto i = 0u; i < model.get_mesh_count(); i++)
+		meshes.push_back(get_mesh(model.get_mesh(i), m_materials.at(model.get_mesh_material(i)->uid()).index));
 
-	// Update from the model
-	if (changed)
-	{
-		ZoneScopedN("Actual update from model");
-		cached_mesh.transform = node.get_final_transform();
-		cached_mesh.meshes.clear();
-		cached_mesh.triangles.clear();
-		for (auto i = 0u; i < model.get_mesh_count(); i++)
-		{
-			auto mesh_ptr = model.get_mesh(i);
-			cached_mesh.meshes.push_back(mesh_ptr);
-			mesh_to_triangles(cached_mesh.triangles, *mesh_ptr, cached_mesh.transform, m_materials.at(model.get_mesh_material(i)->uid()).index);
-		}
-		cached_mesh.meshes.shrink_to_fit();
-		cached_mesh.triangles.shrink_to_fit();
+	bool meshes_changed = meshes != instance.meshes;
+	bool transform_changed = instance.transform != node.get_final_transform();
+	bool visibility_changed = instance.visible != node.is_visible();
 
-		cached_mesh.aabb = bu::rt::triangles_aabb(cached_mesh.triangles.data(), cached_mesh.triangles.size());
-	}
+	instance.meshes = std::move(meshes);
+	instance.transform = node.get_final_transform();
+	instance.visible = node.is_visible();
 
-	return changed;
+	return meshes_changed || transform_changed || visibility_changed;
 }
 
 /**
@@ -232,6 +168,9 @@ std::pair<bool, bool> scene_cache::update_materials(const bu::scene &scene)
 	return {changed, full_rebuild};
 }
 
+/**
+	\returns true if any instance has been updated
+*/
 bool scene_cache::update_meshes(const bu::scene &scene, bool force_update)
 {
 	ZoneScopedN("scene_cache::update_meshes()");
@@ -239,9 +178,15 @@ bool scene_cache::update_meshes(const bu::scene &scene, bool force_update)
 	auto &scene_root = *scene.root_node;
 	bool changed = false;
 
-	// Clear 'visited' flag for all meshes and materials
+	// Material indices are baked into the triangles
+	if (force_update)
+		m_meshes.clear();
+
+	// Clear 'visited' flag for all meshes and instances
 	for (auto &p : m_meshes)
 		p.second->visited = false;
+	for (auto &p : m_instances)
+		p.second.visited = false;
 
 	// Update from scene
 	for (bu::scene_node::dfs_iterator it = scene_root.begin(); !(it == scene_root.end()); ++it)
@@ -249,24 +194,37 @@ bool scene_cache::update_meshes(const bu::scene &scene, bool force_update)
 		auto &node = *it;
 		if (auto model_node = dynamic_cast<bu::model_node*>(&node))
 		{
-			auto &ptr = m_meshes[node.uid()];
-			if (!ptr)
+			auto [inst_it, inserted] = m_instances.try_emplace(node.uid());
+			auto &instance = inst_it->second;
+			if (inserted)
 			{
-				ptr = std::make_shared<scene_cache_mesh>();
-				LOG_DEBUG << "Adding a new mesh to BVH";
+				instance.visible = false;
+				LOG_DEBUG << "Adding a new instance to the scene cache";
 			}
-			changed |= update_from_model_node(*ptr, *model_node, force_update);
-			ptr->visited = true;
+			changed |= update_from_model_node(instance, *model_node);
+			instance.visited = true;
+		}
+	}
+
+	// Remove all instances without 'visited' flag
+	for (auto it = m_instances.begin(); it != m_instances.end();)
+	{
+		if (!it->second.visited)
+		{
+			LOG_DEBUG << "Erasing instance from the scene cache";
+			changed |= it->second.visible;
+			it = m_instances.erase(it);
 		}
+		else
+			++it;
 	}
 
-	// Remove all meshes without 'visited' flag
+	// Remove meshes no longer used by any instance
 	for (auto it = m_meshes.begin(); it != m_meshes.end();)
 	{
 		if (!it->second->visited)
 		{
-			LOG_DEBUG << "Erasing mesh from BVH";
-			changed |= it->second->visible;
+			LOG_DEBUG << "Erasing mesh from the scene cache";
 			it = m_meshes.erase(it);
 		}
 		else
@@ -276,9 +234,49 @@ bool scene_cache::update_meshes(const bu::scene &scene, bool force_update)
 	return changed;
 }
 
+/**
+	\brief Converts all visible point lights to world space
+	\returns true if any light has changed
+*/
+bool scene_cache::update_lights(const bu::scene &scene)
+{
+	ZoneScopedN("scene_cache::update_lights()");
+
+	auto &scene_root = *scene.root_node;
+	std::vector<point_light> lights;
+
+	for (bu::scene_node::dfs_iterator it = scene_root.begin(); !(it == scene_root.end()); ++it)
+	{
+		auto &node = *it;
+		auto light_node = dynamic_cast<bu::light_node*>(&node);
+		if (!light_node || !light_node->is_visible())
+			continue;
+
+		if (auto l = std::dynamic_pointer_cast<bu::point_light>(light_node->light))
+		{
+			if (l->power <= 0 || l->color == glm::vec3{0.f}) continue;
+
+			glm::mat4 transform = node.get_final_transform();
+			lights.push_back(point_light{
+				glm::vec3{transform[3]},
+				std::max(l->radius, 0.f),
+				l->color * l->power});
+		}
+	}
+
+	auto equal = [](const point_light &a, const point_light &b)
+	{
+		return a.position == b.position && a.radius == b.radius && a.power == b.power;
+	};
+
+	bool changed = !std::equal(lights.begin(), lights.end(), m_point_lights.begin(), m_point_lights.end(), equal);
+	m_point_lights = std::move(lights);
+	return changed;
+}
+
 /**
 	\returns a pair of boolean. The first one indicates whether the scene should
-	be updates. The second indicates whether the BVH has to be rebuilt.
+	be updates. The second indicates whether the TLAS has to be rebuilt.
 */
 std::pair<bool, bool> scene_cache::update_from_scene(const bu::scene &scene)
 {
@@ -286,7 +284,8 @@ std::pair<bool, bool> scene_cache::update_from_scene(const bu::scene &scene)
 
 	auto [materials_changed, force_mesh_update] = update_materials(scene);
 	bool meshes_changed = update_meshes(scene, force_mesh_update);
-	return {materials_changed, meshes_changed};
+	bool lights_changed = update_lights(scene);
+	return {materials_changed || lights_changed, meshes_changed};
 }
 
 std::vector<bu::rt::material> bu::rt::scene_cache::get_materials() const
@@ -303,11 +302,64 @@ std::vector<bu::rt::material> bu::rt::scene_cache::get_materials() const
 	return materials;
 }
 
-std::vector<bu::rt::aabb> bu::rt::scene_cache::get_mesh_aabbs() const
+/**
+	\returns meshes used by the scene which don't have a BVH yet, or whose BVH
+	wasn't built with the requested mode and node format and the interactive mode
+	has ended. The returned meshes' triangles are never modified, so they can be
+	safely used from other threads.
+*/
+std::vector<std::shared_ptr<const scene_cache_mesh>> bu::rt::scene_cache::get_meshes_to_build(bool interactive, bvh_build_mode mode, bvh_node_format format) const
+{
+	std::vector<std::shared_ptr<const scene_cache_mesh>> meshes;
+	for (const auto &[key, mesh] : m_meshes)
+		if (!mesh->bvh || (!interactive && (mesh->bvh_mode != mode || mesh->bvh_format != format)))
+			meshes.push_back(mesh);
+	return meshes;
+}
+
+/**
+	\brief Assigns a built BLAS to the mesh - ignored if the mesh is no longer in the cache
+*/
+void bu::rt::scene_cache::set_mesh_bvh(const scene_cache_mesh &mesh, std::shared_ptr<const bvh_tree> bvh, bvh_build_mode mode, bvh_node_format format)
+{
+	auto it = m_meshes.find({mesh.mesh_uid, mesh.material_id});
+	if (it == m_meshes.end() || it->second.get() != &mesh)
+		return;
+
+	it->second->bvh = std::move(bvh);
+	it->second->bvh_mode = mode;
+	it->second->bvh_format = format;
+}
+
+/**
+	\returns instances of all visible meshes with a BLAS - ready to be used for a TLAS build
+*/
+std::vector<bu::rt::bvh_instance> bu::rt::scene_cache::get_instances() const
+{
+	std::vector<bvh_instance> instances;
+	for (const auto &[id, instance] : m_instances)
+	{
+		if (!instance.visible) continue;
+
+		glm::mat4 world_to_object = glm::inverse(instance.transform);
+		glm::mat3 normal_matrix = glm::transpose(glm::mat3{world_to_object});
+
+		for (const auto &mesh : instance.meshes)
+			if (mesh->bvh && !mesh->triangles.empty())
+				instances.push_back(bvh_instance{
+					mesh->bvh,
+					world_to_object,
+					normal_matrix,
+					transform_aabb(mesh->aabb, instance.transform)});
+	}
+	return instances;
+}
+
+std::vector<bu::rt::aabb> bu::rt::scene_cache::get_instance_aabbs() const
 {
 	std::vector<aabb> aabbs;
-	aabbs.reserve(m_meshes.size());
-	for (const auto &[id, mesh] : m_meshes)
-		aabbs.push_back(mesh->aabb);
+	for (const auto &[id, instance] : m_instances)
+		for (const auto &mesh : instance.meshes)
+			aabbs.push_back(transform_aabb(mesh->aabb, instance.transform));
 	return aabbs;
 }
@@ -5,6 +5,9 @@
 #include <glm/glm.hpp>
 #include "aabb.hpp"
 #include "ray.hpp"
+#include "tlas.hpp"
+#include "light.hpp"
+#include "bvh_types.hpp"
 
 namespace bu {
 struct material_data;
@@ -27,24 +30,43 @@ struct scene_cache_material
 };
 
 /**
-	\brief Corresponds to single scene model node
+	\brief Object-space triangles of a single bu::mesh with a material assigned
 
-	\todo Thread-safety - triangles may be read from another thread
+	Meshes are shared by all model nodes using the same bu::mesh and material,
+	so each of them needs only a single bottom-level BVH.
+
+	The triangles are never modified after the mesh is created, so snapshots
+	can be read from other threads. The bvh field is only accessed from the main thread.
 */
 struct scene_cache_mesh
 {
-	glm::mat4 transform;
-	std::vector<std::weak_ptr<bu::mesh>> meshes; // Weak pointers to the original meshes
+	std::weak_ptr<bu::mesh> mesh; // Weak pointer to the original mesh
+	std::uint64_t mesh_uid;
+	int material_id;
+
+	rt::aabb aabb;                       //!< Object-space bounds
+	std::vector<rt::triangle> triangles; //!< Object-space triangles
+
+	std::shared_ptr<const bvh_tree> bvh; //!< Bottom-level BVH - null until built
+	bvh_build_mode bvh_mode;             //!< Mode the BVH has been built with
+	bvh_node_format bvh_format;          //!< Node format the BVH has been built with
+	bool visited;                        //!< Has mesh been used in this update_from_scene pass
+};
 
-	rt::aabb aabb;
-	std::vector<rt::triangle> triangles;
+/**
+	\brief Corresponds to single scene model node - places meshes in the scene
+*/
+struct scene_cache_instance
+{
+	glm::mat4 transform;
+	std::vector<std::shared_ptr<const scene_cache_mesh>> meshes;
 
 	bool visited; //!< Has node been visited in this update_from_scene pass
 	bool visible;
 };
 
 /**
-	\brief Caches dissolved meshes, material and light arrays
+	\brief Caches meshes, instances, material and light arrays
 
 	\todo Thread-safety - get_materials() and get_mesh_aabbs() can be called from another thread
 */
@@ -59,19 +81,25 @@ public:
 	}
 
 	std::vector<bu::rt::material> get_materials() const;
-	std::vector<rt::aabb> get_mesh_aabbs() const;
+	std::vector<std::shared_ptr<const scene_cache_mesh>> get_meshes_to_build(bool interactive, bvh_build_mode mode, bvh_node_format format) const;
+	void set_mesh_bvh(const scene_cache_mesh &mesh, std::shared_ptr<const bvh_tree> bvh, bvh_build_mode mode, bvh_node_format format);
+	std::vector<bvh_instance> get_instances() const;
+	const std::vector<point_light> &get_point_lights() const {return m_point_lights;}
+	std::vector<rt::aabb> get_instance_aabbs() const;
 
 private:
+	std::shared_ptr<const scene_cache_mesh> get_mesh(const std::shared_ptr<bu::mesh> &mesh, int material_id);
 	bool update_from_model_node(
-		bu::rt::scene_cache_mesh &cached_mesh,
-		const bu::model_node &node,
-		bool force_update);
+		bu::rt::scene_cache_instance &instance,
+		const bu::model_node &node);
 	std::pair<bool, bool> update_materials(const bu::scene &scene);
 	bool update_meshes(const bu::scene &scene, bool force_update);
+	bool update_lights(const bu::scene &scene);
 
-
-	std::map<std::uint64_t, std::shared_ptr<scene_cache_mesh>> m_meshes;
+	std::map<std::pair<std::uint64_t, int>, std::shared_ptr<scene_cache_mesh>> m_meshes;
+	std::map<std::uint64_t, scene_cache_instance> m_instances;
 	std::map<std::uint64_t, scene_cache_material> m_materials;
+	std::vector<point_light> m_point_lights; //!< World-space point lights of all visible light nodes
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,106 @@
+#pragma once
+#include <thread>
+#include <algorithm>
+#include "sampler.hpp"
+#include "bvh_types.hpp"
+
+namespace bu {
+namespace rt {
+
+/**
+	\brief Integrator used by the RT jobs
+*/
+enum class integrator_type
+{
+	MEGAKERNEL,  //!< Each path is traced from start to end by trace_path()
+	RAY_STREAMS, //!< All paths of a bucket are extended together and traced as ray streams
+	WAVEFRONT,   //!< Paths of a bucket are processed in stages over SoA queues (wavefront_integrator)
+};
+
+}
+
+/**
+	\brief Parameters of the path tracer
+
+	Read from the [rt] section of the config file and editable in the UI.
+	Changing any of them restarts the rendering.
+*/
+struct rt_settings
+{
+	// Threading and work distribution
+	int thread_count = 0;  //!< Number of tracing threads - 0 uses all hardware threads
+	int tile_size = 64;    //!< Side of the square tiles in pixels - one bucket samples each pixel of a tile once
+	int bucket_count = 0;  //!< Number of splat buckets in flight - 0 means 4 per thread
+
+	// Paths
+	int max_bounces = 24;
+	int roulette_depth = 3; //!< Number of bounces before Russian roulette starts terminating paths
+	rt::integrator_type integrator = rt::integrator_type::MEGAKERNEL;
+	rt::sampler_type sampler = rt::sampler_type::SOBOL;
+	bool packet_tracing = true; //!< Primary rays are traced in 8x8 packets through the binary BVH nodes instead of one by one through the wide nodes
+
+	// When to stop sampling
+	int target_samples = 0;         //!< Samples per pixel after which a tile is finished - 0 is unlimited
+	float time_budget = 0.f;        //!< Seconds after which the sampling stops - 0 is unlimited
+	float adaptive_threshold = 0.1f; //!< Error of the worst pixel below which a tile has converged - 0 disables adaptive sampling
+	int adaptive_min_samples = 16;   //!< Samples each pixel gets before its error is trusted
+
+	bool denoise = true;
+
+	// Acceleration structures
+	rt::bvh_build_mode bvh_build_mode = rt::bvh_build_mode::BINNED_SAH; //!< Mode of the final mesh BVH builds - LBVH is used while editing
+	rt::bvh_node_format bvh_format = rt::bvh_node_format::FULL;         //!< Format of the wide BVH nodes of the meshes
+
+	/**
+		\brief Clamps the values to sensible ranges - applied to everything
+		coming from the config file or the UI
+	*/
+	void sanitize()
+	{
+		thread_count = std::clamp(thread_count, 0, 1024);
+		tile_size = std::clamp(tile_size, 8, 256);
+		bucket_count = std::clamp(bucket_count, 0, 4096);
+		max_bounces = std::clamp(max_bounces, 1, 1024);
+		roulette_depth = std::max(roulette_depth, 0);
+		target_samples = std::max(target_samples, 0);
+		time_budget = std::max(time_budget, 0.f);
+		adaptive_threshold = std::max(adaptive_threshold, 0.f);
+		adaptive_min_samples = std::clamp(adaptive_min_samples, 2, 65536);
+	}
+
+	int get_thread_count() const
+	{
+		return thread_count > 0 ? thread_count : std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	int get_bucket_count() const
+	{
+		return bucket_count > 0 ? bucket_count : 4 * get_thread_count();
+	}
+
+	bool operator==(const rt_settings &rhs) const
+	{
+		return thread_count == rhs.thread_count
+			&& tile_size == rhs.tile_size
+			&& bucket_count == rhs.bucket_count
+			&& max_bounces == rhs.max_bounces
+			&& roulette_depth == rhs.roulette_depth
+			&& integrator == rhs.integrator
+			&& sampler == rhs.sampler
+			&& packet_tracing == rhs.packet_tracing
+			&& target_samples == rhs.target_samples
+			&& time_budget == rhs.time_budget
+			&& adaptive_threshold == rhs.adaptive_threshold
+			&& adaptive_min_samples == rhs.adaptive_min_samples
+			&& denoise == rhs.denoise
+			&& bvh_build_mode == rhs.bvh_build_mode
+			&& bvh_format == rhs.bvh_format;
+	}
+
+	bool operator!=(const rt_settings &rhs) const
+	{
+		return !(*this == rhs);
+	}
+};
+
+}
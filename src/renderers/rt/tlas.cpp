@@ -0,0 +1,335 @@
+#include "tlas.hpp"
+#include <tracy/Tracy.hpp>
+#include "bvh_builder.hpp"
+#include "linear_stack.hpp"
+#include "../../async_task.hpp"
+
+using bu::rt::tlas;
+using bu::rt::bvh_instance;
+
+static bu::rt::bvh_build_params get_tlas_build_params()
+{
+	// Testing an instance means traversing its BLAS - much more expensive than a triangle test
+	bu::rt::bvh_build_params params;
+	params.cost_intersect = params.cost_traversal * 4;
+	return params;
+}
+
+/**
+	\brief Recursively builds TLAS nodes over a range of instance indices
+	\returns index of the created node
+*/
+static unsigned int build_tlas_node(
+	const bu::async_stop_flag &stop_flag,
+	const bu::rt::bvh_build_params &params,
+	const std::vector<bvh_instance> &input,
+	const std::vector<glm::vec3> &centroids,
+	const std::vector<bu::rt::aabb> &bounds,
+	unsigned int *ids,
+	int count,
+	std::vector<bvh_instance> &instances,
+	std::vector<unsigned int> &instance_ids,
+	std::vector<bu::rt::bvh_node> &nodes)
+{
+	unsigned int node_id = nodes.size();
+	nodes.emplace_back();
+
+	bu::rt::aabb aabb = bounds[ids[0]];
+	for (int i = 1; i < count; i++)
+		aabb.add_aabb(bounds[ids[i]]);
+
+	int nl = count > 1 ? bu::rt::partition_references(stop_flag, centroids.data(), bounds.data(), ids, count, params) : 0;
+
+	if (nl > 0 && nl < count)
+	{
+		build_tlas_node(stop_flag, params, input, centroids, bounds, ids, nl, instances, instance_ids, nodes);
+		unsigned int right_id = build_tlas_node(stop_flag, params, input, centroids, bounds, ids + nl, count - nl, instances, instance_ids, nodes);
+		nodes[node_id] = bu::rt::bvh_node{aabb, right_id, 0};
+	}
+	else
+	{
+		nodes[node_id] = bu::rt::bvh_node{aabb, static_cast<unsigned int>(instances.size()), count};
+		for (int i = 0; i < count; i++)
+		{
+			instances.push_back(input[ids[i]]);
+			instance_ids.push_back(ids[i]);
+		}
+	}
+
+	return node_id;
+}
+
+void tlas::build(std::vector<bvh_instance> input, const bu::async_stop_flag &stop_flag)
+{
+	ZoneScopedN("TLAS build");
+
+	instances.clear();
+	instance_ids.clear();
+	nodes.clear();
+	parents.clear();
+	build_sah_cost = 0;
+	if (input.empty()) return;
+
+	std::vector<unsigned int> ids(input.size());
+	std::vector<glm::vec3> centroids(input.size());
+	std::vector<rt::aabb> bounds(input.size());
+	for (auto i = 0u; i < ids.size(); i++)
+	{
+		ids[i] = i;
+		bounds[i] = input[i].aabb;
+		centroids[i] = bounds[i].get_center();
+	}
+
+	instances.reserve(input.size());
+	instance_ids.reserve(input.size());
+	build_tlas_node(stop_flag, get_tlas_build_params(), input, centroids, bounds, ids.data(), ids.size(), instances, instance_ids, nodes);
+	parents = get_bvh_parents(nodes.data(), nodes.size());
+	build_sah_cost = get_sah_cost();
+}
+
+/**
+	\brief Updates the instances and recomputes node bounds bottom-up, keeping the topology
+
+	\returns false if the instances don't correspond to the ones the TLAS was built from,
+	or if the SAH cost grew over max_sah_degradation times the cost after the last build.
+	A full rebuild is needed in both cases.
+*/
+bool tlas::refit(const std::vector<bvh_instance> &input)
+{
+	ZoneScopedN("TLAS refit");
+
+	if (nodes.empty() || input.size() != instances.size())
+		return false;
+
+	for (auto i = 0u; i < instances.size(); i++)
+		if (input[instance_ids[i]].blas != instances[i].blas)
+			return false;
+
+	for (auto i = 0u; i < instances.size(); i++)
+		instances[i] = input[instance_ids[i]];
+
+	// Children are always stored after their parents
+	for (auto i = nodes.size(); i-- > 0;)
+	{
+		auto &node = nodes[i];
+		if (node.count == 0)
+		{
+			node.aabb = nodes[i + 1].aabb;
+			node.aabb.add_aabb(nodes[node.index].aabb);
+		}
+		else if (node.count > 0)
+		{
+			node.aabb = instances[node.index].aabb;
+			for (unsigned int j = node.index + 1; j < node.index + node.count; j++)
+				node.aabb.add_aabb(instances[j].aabb);
+		}
+	}
+
+	return get_sah_cost() <= build_sah_cost * max_sah_degradation;
+}
+
+/**
+	\brief Finds the closest intersection with any of the instances
+
+	The ray is transformed to object space of each tested instance. Its direction
+	is not normalized, so the hit distances remain comparable between instances.
+*/
+bool tlas::test_ray(const rt::ray &r, rt::ray_hit &hit) const
+{
+	if (nodes.empty())
+		return false;
+
+	bu::rt::short_stack<unsigned int, 16> st;
+
+	// Check intersection with the root node
+	{
+		float t;
+		if (nodes[0].aabb.test_ray(r, t))
+			st.push(0);
+		else
+			return false;
+	}
+
+	ray_hit best;
+	best.t = HUGE_VALF;
+	best.triangle = nullptr;
+
+	unsigned int node_id = 0;
+	while (true)
+	{
+		// Recover from stack overflow - see bvh_tree::test_ray()
+		if (st.empty())
+		{
+			if (!st.overflowed()) break;
+			node_id = get_next_bvh_node(nodes.data(), parents.data(), node_id, r, best.t);
+			if (node_id == bvh_no_node) break;
+			st.push(node_id);
+		}
+
+		node_id = st.top();
+		auto &node = nodes[node_id];
+		st.pop();
+
+		if (node.count == 0)
+		{
+			auto id_l = node_id + 1;
+			auto id_r = node.index;
+			auto &nl = nodes[id_l];
+			auto &nr = nodes[id_r];
+
+			float tl, tr;
+			bool hit_l = nl.aabb.test_ray(r, tl) && tl < best.t;
+			bool hit_r = nr.aabb.test_ray(r, tr) && tr < best.t;
+
+			if (hit_l && hit_r)
+			{
+				// Check the closer child first
+				if (tl < tr)
+				{
+					st.push(id_r);
+					st.push(id_l);
+				}
+				else
+				{
+					st.push(id_l);
+					st.push(id_r);
+				}
+			}
+			else if (hit_l)
+			{
+				st.push(id_l);
+			}
+			else if (hit_r)
+			{
+				st.push(id_r);
+			}
+		}
+		else if (node.count > 0)
+		{
+			for (unsigned int i = node.index; i < node.index + node.count; i++)
+			{
+				const auto &inst = instances[i];
+
+				float t;
+				if (node.count > 1 && (!inst.aabb.test_ray(r, t) || t >= best.t))
+					continue;
+
+				rt::ray object_ray{
+					glm::vec3{inst.world_to_object * glm::vec4{r.origin, 1.f}},
+					glm::mat3{inst.world_to_object} * r.direction};
+
+				if (inst.blas->test_ray(object_ray, best, best.t))
+					best.normal_matrix = &inst.normal_matrix;
+			}
+		}
+	}
+
+	if (best.triangle)
+	{
+		hit = best;
+		return true;
+	}
+	else
+		return false;
+}
+
+/**
+	\brief Checks whether the ray hits anything closer than t_max - see bvh_tree::test_occlusion()
+*/
+bool tlas::test_occlusion(const rt::ray &r, float t_max) const
+{
+	if (nodes.empty())
+		return false;
+
+	bu::rt::short_stack<unsigned int, 16> st;
+	st.push(0);
+
+	unsigned int node_id = 0;
+	while (true)
+	{
+		if (st.empty())
+		{
+			if (!st.overflowed()) break;
+			node_id = get_next_bvh_node_any_hit(nodes.data(), parents.data(), node_id, r, t_max);
+			if (node_id == bvh_no_node) break;
+			st.push(node_id);
+		}
+
+		node_id = st.top();
+		auto &node = nodes[node_id];
+		st.pop();
+
+		float t;
+		if (node.count < 0 || !node.aabb.test_ray(r, t) || t >= t_max)
+			continue;
+
+		if (node.count == 0)
+		{
+			st.push(node.index);
+			st.push(node_id + 1);
+		}
+		else
+		{
+			for (unsigned int i = node.index; i < node.index + node.count; i++)
+			{
+				const auto &inst = instances[i];
+				if (node.count > 1 && (!inst.aabb.test_ray(r, t) || t >= t_max))
+					continue;
+
+				rt::ray object_ray{
+					glm::vec3{inst.world_to_object * glm::vec4{r.origin, 1.f}},
+					glm::mat3{inst.world_to_object} * r.direction};
+
+				if (inst.blas->test_occlusion(object_ray, t_max))
+					return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+std::vector<bu::rt::aabb> tlas::get_aabbs() const
+{
+	std::vector<aabb> aabbs;
+	aabbs.reserve(nodes.size() + instances.size());
+	for (const auto &node : nodes)
+		aabbs.push_back(node.aabb);
+	for (const auto &inst : instances)
+		aabbs.push_back(inst.aabb);
+	return aabbs;
+}
+
+/**
+	\returns number of triangles in all instances - shared BLASes are counted multiple times
+*/
+unsigned int tlas::get_triangle_count() const
+{
+	unsigned int count = 0;
+	for (const auto &inst : instances)
+		count += inst.blas->triangle_count;
+	return count;
+}
+
+/**
+	\returns SAH cost of the tree relative to the root node area
+*/
+float tlas::get_sah_cost() const
+{
+	if (nodes.empty()) return 0;
+	float root_area = nodes[0].aabb.get_area();
+	if (root_area <= 0) return 0;
+
+	auto params = get_tlas_build_params();
+	float cost = 0;
+	for (const auto &node : nodes)
+	{
+		float p = node.aabb.get_area() / root_area;
+		if (node.count == 0)
+			cost += params.cost_traversal * p;
+		else if (node.count > 0)
+			cost += params.cost_intersect * p * node.count;
+	}
+
+	return cost;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <memory>
+#include <vector>
+#include <glm/glm.hpp>
+#include "aabb.hpp"
+#include "bvh.hpp"
+
+namespace bu {
+class async_stop_flag;
+}
+
+namespace bu::rt {
+
+/**
+	\brief Placement of a bottom-level BVH in the scene
+
+	The BLAS is built in object space and can be shared by many instances.
+*/
+struct bvh_instance
+{
+	std::shared_ptr<const bvh_tree> blas;
+	glm::mat4 world_to_object;
+	glm::mat3 normal_matrix; //!< Transforms object-space normals to world space
+	rt::aabb aabb;           //!< World-space bounds
+};
+
+/**
+	\brief Top-level acceleration structure - BVH over BLAS instances
+
+	Nodes are stored in depth-first order. The left child of an inner node
+	immediately follows its parent and the index field holds the right child.
+	In leaves, index is the first instance and count the number of instances.
+
+	Transform changes don't require touching any triangle data - the TLAS
+	is refitted and only rebuilt when its quality degrades too much.
+*/
+struct tlas
+{
+	static constexpr float max_sah_degradation = 1.5f; //!< Refitted TLAS can be this much worse than a rebuilt one
+
+	void build(std::vector<bvh_instance> instances, const bu::async_stop_flag &stop_flag);
+	bool refit(const std::vector<bvh_instance> &instances);
+	bool test_ray(const rt::ray &r, rt::ray_hit &hit) const;
+	bool test_occlusion(const rt::ray &r, float t_max = HUGE_VALF) const;
+	void test_packet(const rt::ray_packet &packet, rt::ray_packet_hit &hit) const;
+	void test_stream(const rt::ray *rays, rt::ray_hit *hits, int count) const;
+	std::vector<rt::aabb> get_aabbs() const;
+	unsigned int get_triangle_count() const;
+	float get_sah_cost() const;
+
+	std::vector<bvh_instance> instances;
+	std::vector<unsigned int> instance_ids; //!< Indices of the instances in the build input
+	std::vector<bvh_node> nodes;
+	std::vector<unsigned int> parents; //!< Parent of each node - used to recover from traversal stack overflow
+	float build_sah_cost = 0; //!< SAH cost right after the last full build
+};
+
+}
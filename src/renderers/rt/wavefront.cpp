@@ -0,0 +1,256 @@
+#include "wavefront.hpp"
+#include <tracy/Tracy.hpp>
+#include "kernel.hpp"
+#include "tlas.hpp"
+#include "material.hpp"
+#include "light.hpp"
+#include "scene.hpp"
+
+using bu::rt::wavefront_integrator;
+
+/**
+	\brief Traces a batch of paths whose first intersections are already known
+	\param samplers samplers set up for the pixel samples of the paths
+	\param primary_hits the first hits of the paths (null triangle means no hit)
+	\param radiance output radiance of each path
+	\param aovs output AOVs of each path
+*/
+void wavefront_integrator::trace(
+	const bu::rt::scene &scene,
+	const rt::sampler *samplers,
+	const rt::ray *rays,
+	const rt::ray_hit *primary_hits,
+	int count,
+	glm::vec3 *radiance,
+	rt::aov_sample *aovs,
+	int max_bounces,
+	int roulette_depth)
+{
+	ZoneScopedN("Wavefront trace");
+
+	init(samplers, rays, primary_hits, count);
+	if (max_bounces <= 0)
+		m_active.clear();
+
+	while (!m_active.empty())
+	{
+		classify(scene);
+		shade_misses();
+		shade_emitters(scene);
+
+		m_extend.clear();
+		m_shadow_path.clear();
+		m_shadow_ray.clear();
+		m_shadow_t_max.clear();
+		m_shadow_radiance.clear();
+		shade_diffuse(scene, max_bounces, roulette_depth);
+		shade_glass(scene, max_bounces, roulette_depth);
+
+		trace_shadow_rays(scene);
+		extend(scene);
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		radiance[i] = m_radiance[i];
+		aovs[i] = m_aov[i];
+	}
+}
+
+void wavefront_integrator::init(const rt::sampler *samplers, const rt::ray *rays, const rt::ray_hit *primary_hits, int count)
+{
+	m_vertex.resize(count);
+	m_hit.resize(count);
+	m_radiance.assign(count, glm::vec3{0.f});
+	m_sampler.assign(samplers, samplers + count);
+	m_aov.assign(count, aov_sample{});
+	m_active.resize(count);
+
+	for (int i = 0; i < count; i++)
+	{
+		m_vertex[i] = rt::path_vertex{rays[i]};
+		m_hit[i] = primary_hits[i];
+		m_active[i] = i;
+	}
+}
+
+/**
+	\brief Sorts the active paths into queues by the material they hit
+	and records the AOVs of the first hits
+*/
+void wavefront_integrator::classify(const bu::rt::scene &scene)
+{
+	ZoneScopedN("Wavefront classify");
+
+	m_miss.clear();
+	m_emissive.clear();
+	m_diffuse.clear();
+	m_glass.clear();
+
+	const auto &materials = *scene.materials;
+	for (auto id : m_active)
+	{
+		const auto *tri = m_hit[id].triangle;
+		if (!tri)
+		{
+			m_miss.push_back(id);
+			continue;
+		}
+
+		const auto &material = materials[tri->material_id];
+		if (m_vertex[id].bounces == 0)
+			m_aov[id] = aov_sample{material.get_albedo(), bu::rt::ray_hit_normal(m_vertex[id].r, m_hit[id]), m_hit[id].t};
+
+		switch (material.type)
+		{
+			case material_type::EMISSIVE:
+				m_emissive.push_back(id);
+				break;
+
+			case material_type::GLASS:
+				m_glass.push_back(id);
+				break;
+
+			default:
+			case material_type::BASIC_DIFFUSE:
+				m_diffuse.push_back(id);
+				break;
+		}
+	}
+}
+
+void wavefront_integrator::shade_misses()
+{
+	ZoneScopedN("Wavefront shade misses");
+
+	for (auto id : m_miss)
+		m_radiance[id] += m_vertex[id].throughput * get_sky_radiance(m_vertex[id].r.direction);
+}
+
+void wavefront_integrator::shade_emitters(const bu::rt::scene &scene)
+{
+	ZoneScopedN("Wavefront shade emitters");
+
+	const auto &materials = *scene.materials;
+	for (auto id : m_emissive)
+	{
+		const auto &hit = m_hit[id];
+		const auto &vertex = m_vertex[id];
+		glm::vec3 P = bu::rt::ray_hit_pos(vertex.r, hit);
+		float weight = get_emission_weight(scene, hit, P, vertex.bsdf_pdf, vertex.last_position, vertex.last_normal);
+		m_radiance[id] += vertex.throughput * materials[hit.triangle->material_id].emissive.emission * weight;
+	}
+}
+
+/**
+	\brief Continues a path after a bounce and queues it for extension if it survives
+*/
+void wavefront_integrator::continue_path(
+	unsigned int id,
+	const glm::vec3 &P,
+	const glm::vec3 &N,
+	const glm::mat3 &TBN,
+	const rt::ray_bounce &bounce,
+	int max_bounces,
+	int roulette_depth)
+{
+	if (rt::continue_path(m_vertex[id], bounce, P, N, TBN, m_sampler[id], max_bounces, roulette_depth))
+		m_extend.push_back(id);
+}
+
+/**
+	\brief Shades all Lambertian hits - samples the BSDF and generates shadow rays
+*/
+void wavefront_integrator::shade_diffuse(const bu::rt::scene &scene, int max_bounces, int roulette_depth)
+{
+	ZoneScopedN("Wavefront shade diffuse");
+
+	const auto &materials = *scene.materials;
+	bool has_lights = scene.lights && !scene.lights->empty();
+
+	for (auto id : m_diffuse)
+	{
+		const auto &hit = m_hit[id];
+		const auto &r = m_vertex[id].r;
+		glm::vec3 P = bu::rt::ray_hit_pos(r, hit);
+		glm::vec3 N = bu::rt::ray_hit_normal(r, hit);
+		glm::mat3 TBN = get_shading_frame(r.direction, N);
+		glm::vec3 tbn_dir = glm::transpose(TBN) * r.direction;
+
+		const auto &material = materials[hit.triangle->material_id];
+		auto &sampler = m_sampler[id];
+		glm::vec2 u = sampler.get_2d();
+		auto bounce = material.sample_basic_diffuse(tbn_dir, m_vertex[id].ior, u.x, u.y);
+
+		// Next-event estimation - the shadow ray is traced in its own stage
+		if (has_lights)
+		{
+			float v1 = sampler.get_1d();
+			glm::vec2 v23 = sampler.get_2d();
+			rt::ray shadow_ray;
+			float t_max;
+			glm::vec3 contribution;
+			if (sample_direct_light(scene, material.basic_diffuse.albedo, P, N, v1, v23.x, v23.y, shadow_ray, t_max, contribution))
+			{
+				m_shadow_path.push_back(id);
+				m_shadow_ray.push_back(shadow_ray);
+				m_shadow_t_max.push_back(t_max);
+				m_shadow_radiance.push_back(m_vertex[id].throughput * contribution);
+			}
+		}
+
+		continue_path(id, P, N, TBN, bounce, max_bounces, roulette_depth);
+	}
+}
+
+/**
+	\brief Shades all glass hits - glass is a delta BSDF, so no shadow rays are needed
+*/
+void wavefront_integrator::shade_glass(const bu::rt::scene &scene, int max_bounces, int roulette_depth)
+{
+	ZoneScopedN("Wavefront shade glass");
+
+	const auto &materials = *scene.materials;
+
+	for (auto id : m_glass)
+	{
+		const auto &hit = m_hit[id];
+		const auto &r = m_vertex[id].r;
+		glm::vec3 P = bu::rt::ray_hit_pos(r, hit);
+		glm::vec3 N = bu::rt::ray_hit_normal(r, hit);
+		glm::mat3 TBN = get_shading_frame(r.direction, N);
+		glm::vec3 tbn_dir = glm::transpose(TBN) * r.direction;
+
+		const auto &material = materials[hit.triangle->material_id];
+		// Draws the same dimensions as extend_path(), so both integrators use the same sequence
+		auto &sampler = m_sampler[id];
+		auto bounce = material.sample_glass(tbn_dir, m_vertex[id].ior, sampler.get_2d().x);
+		continue_path(id, P, N, TBN, bounce, max_bounces, roulette_depth);
+	}
+}
+
+void wavefront_integrator::trace_shadow_rays(const bu::rt::scene &scene)
+{
+	ZoneScopedN("Wavefront shadow rays");
+
+	for (auto i = 0u; i < m_shadow_path.size(); i++)
+		if (!scene.tlas->test_occlusion(m_shadow_ray[i], m_shadow_t_max[i]))
+			m_radiance[m_shadow_path[i]] += m_shadow_radiance[i];
+}
+
+/**
+	\brief Traces the new rays - the extended paths become the active ones
+*/
+void wavefront_integrator::extend(const bu::rt::scene &scene)
+{
+	ZoneScopedN("Wavefront extend");
+
+	for (auto id : m_extend)
+	{
+		auto &hit = m_hit[id];
+		if (!scene.tlas->test_ray(m_vertex[id].r, hit))
+			hit.triangle = nullptr;
+	}
+
+	std::swap(m_active, m_extend);
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include "ray.hpp"
+#include "sampler.hpp"
+#include "sampled_image.hpp"
+#include "kernel.hpp"
+
+namespace bu::rt {
+struct scene;
+
+/**
+	\brief Wavefront path tracer - alternative to the trace_path() megakernel
+
+	Instead of tracing each path from start to end, all paths of a batch advance
+	together by one bounce at a time. Each bounce is split into stages working on
+	queues of path indices:
+
+		- classification of the hits into per-material queues,
+		- shading of misses, emitters, diffuse and glass surfaces - each
+		  stage runs a single material model over its whole queue,
+		- occlusion tests of the shadow rays generated by the diffuse stage,
+		- extension - tracing of the new rays of the surviving paths.
+
+	The path state is kept in SoA layout, so every stage only reads the fields
+	it needs - except for the ray and throughput bookkeeping (rt::path_vertex),
+	which most stages read together and which is updated by the same
+	continue_path() as in the megakernel. One integrator is owned by each
+	worker thread and reused for all its batches.
+*/
+class wavefront_integrator
+{
+public:
+	void trace(
+		const bu::rt::scene &scene,
+		const rt::sampler *samplers,
+		const rt::ray *rays,
+		const rt::ray_hit *primary_hits,
+		int count,
+		glm::vec3 *radiance,
+		rt::aov_sample *aovs,
+		int max_bounces,
+		int roulette_depth = 0);
+
+private:
+	void init(const rt::sampler *samplers, const rt::ray *rays, const rt::ray_hit *primary_hits, int count);
+	void classify(const bu::rt::scene &scene);
+	void shade_misses();
+	void shade_emitters(const bu::rt::scene &scene);
+	void shade_diffuse(const bu::rt::scene &scene, int max_bounces, int roulette_depth);
+	void shade_glass(const bu::rt::scene &scene, int max_bounces, int roulette_depth);
+	void trace_shadow_rays(const bu::rt::scene &scene);
+	void extend(const bu::rt::scene &scene);
+	void continue_path(unsigned int id, const glm::vec3 &P, const glm::vec3 &N, const glm::mat3 &TBN, const rt::ray_bounce &bounce, int max_bounces, int roulette_depth);
+
+	// Path state (SoA)
+	std::vector<rt::path_vertex> m_vertex;
+	std::vector<rt::ray_hit> m_hit;
+	std::vector<glm::vec3> m_radiance;
+	std::vector<rt::sampler> m_sampler;
+	std::vector<rt::aov_sample> m_aov;
+
+	// Queues of path indices
+	std::vector<unsigned int> m_active;   //!< Paths with a traced ray waiting to be shaded
+	std::vector<unsigned int> m_extend;   //!< Paths with a new ray to trace
+	std::vector<unsigned int> m_miss;
+	std::vector<unsigned int> m_emissive;
+	std::vector<unsigned int> m_diffuse;
+	std::vector<unsigned int> m_glass;
+
+	// Shadow ray queue (SoA)
+	std::vector<unsigned int> m_shadow_path;
+	std::vector<rt::ray> m_shadow_ray;
+	std::vector<float> m_shadow_t_max;
+	std::vector<glm::vec3> m_shadow_radiance; //!< Contribution including the path throughput
+};
+
+}
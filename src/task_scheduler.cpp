@@ -0,0 +1,221 @@
+#include "task_scheduler.hpp"
+#include <tracy/Tracy.hpp>
+#include "log.hpp"
+
+using bu::task_scheduler;
+using bu::task_group;
+
+/**
+	Waits for the remaining tasks, so tasks can't outlive their group
+	when the waiting thread leaves early because of an exception
+*/
+task_group::~task_group()
+{
+	if (m_scheduler)
+		m_scheduler->wait_for_tasks(*this);
+}
+
+/**
+	\brief Keeps the exception unless another task has already thrown one
+*/
+void task_group::set_exception(std::exception_ptr ex)
+{
+	std::lock_guard lock{m_exception_mutex};
+	if (!m_exception)
+		m_exception = std::move(ex);
+}
+
+// Scheduler the current thread works for and the index of its queue
+static thread_local const task_scheduler *tls_scheduler = nullptr;
+static thread_local int tls_queue_index = -1;
+
+task_scheduler::task_scheduler(int thread_count)
+{
+	if (thread_count <= 0)
+		thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+	for (int i = 0; i < thread_count + 1; i++)
+		m_queues.emplace_back(std::make_unique<task_queue>());
+
+	LOG_INFO << "Starting task scheduler with " << thread_count << " threads";
+	for (int i = 0; i < thread_count; i++)
+		m_threads.emplace_back(&task_scheduler::worker_loop, this, i);
+}
+
+task_scheduler::~task_scheduler()
+{
+	{
+		std::lock_guard lock{m_sleep_mutex};
+		m_active = false;
+	}
+	m_sleep_cv.notify_all();
+
+	for (auto &t : m_threads)
+		t.join();
+}
+
+/**
+	\brief Global scheduler shared by all parallel algorithms
+*/
+task_scheduler &task_scheduler::get()
+{
+	static task_scheduler instance;
+	return instance;
+}
+
+/**
+	\returns index of the queue owned by the calling thread or index of the
+	injection queue if called from outside of the pool
+*/
+int task_scheduler::get_queue_index() const
+{
+	if (tls_scheduler == this)
+		return tls_queue_index;
+	else
+		return m_queues.size() - 1;
+}
+
+void task_scheduler::run(task_group &group, task_func func)
+{
+	group.m_pending++;
+	group.m_scheduler = this;
+
+	auto &q = *m_queues[get_queue_index()];
+	{
+		std::lock_guard lock{q.mutex};
+		q.tasks.push_back(task{std::move(func), &group});
+	}
+
+	// Locking here prevents a lost wakeup in worker_loop()
+	{
+		std::lock_guard lock{m_sleep_mutex};
+		m_queued++;
+	}
+	m_sleep_cv.notify_one();
+}
+
+/**
+	\brief Takes a task from the back or the front of a queue
+	\param group if not null, only a task of this group can be taken
+*/
+bool task_scheduler::pop_task(task &t, int queue_index, bool back, const task_group *group)
+{
+	auto &q = *m_queues[queue_index];
+	std::lock_guard lock{q.mutex};
+	if (q.tasks.empty())
+		return false;
+
+	if (group)
+	{
+		auto matches = [group](const task &t){return t.group == group;};
+		auto it = q.tasks.end();
+		if (back)
+		{
+			auto rit = std::find_if(q.tasks.rbegin(), q.tasks.rend(), matches);
+			if (rit != q.tasks.rend())
+				it = std::prev(rit.base());
+		}
+		else
+			it = std::find_if(q.tasks.begin(), q.tasks.end(), matches);
+
+		if (it == q.tasks.end())
+			return false;
+
+		t = std::move(*it);
+		q.tasks.erase(it);
+	}
+	else if (back)
+	{
+		t = std::move(q.tasks.back());
+		q.tasks.pop_back();
+	}
+	else
+	{
+		t = std::move(q.tasks.front());
+		q.tasks.pop_front();
+	}
+
+	m_queued--;
+	return true;
+}
+
+/**
+	\brief Runs a single task - from the own queue, the injection queue
+	or stolen from another worker.
+	\param group if not null, only tasks of this group are run
+	\returns false if there was nothing to do
+*/
+bool task_scheduler::try_run_task(int queue_index, const task_group *group)
+{
+	const int queue_count = m_queues.size();
+	const int injection_index = queue_count - 1;
+
+	task t;
+	bool found = pop_task(t, queue_index, true, group)
+		|| (queue_index != injection_index && pop_task(t, injection_index, false, group));
+
+	// Steal starting with the neighbour so thieves spread out
+	for (int i = 1; i < queue_count && !found; i++)
+		found = pop_task(t, (queue_index + i) % queue_count, false, group);
+
+	if (!found)
+		return false;
+
+	// The exception is passed to the waiting thread - the group can be
+	// destroyed as soon as the pending count drops, so it goes last
+	try
+	{
+		t.func();
+	}
+	catch (...)
+	{
+		t.group->set_exception(std::current_exception());
+	}
+
+	t.group->m_pending--;
+	return true;
+}
+
+/**
+	\brief Waits for all tasks in the group - executes pending tasks in the meantime
+	\throws the first exception thrown by a task of the group
+*/
+void task_scheduler::wait(task_group &group)
+{
+	wait_for_tasks(group);
+
+	std::exception_ptr ex;
+	{
+		std::lock_guard lock{group.m_exception_mutex};
+		std::swap(ex, group.m_exception);
+	}
+
+	if (ex)
+		std::rethrow_exception(ex);
+}
+
+void task_scheduler::wait_for_tasks(task_group &group)
+{
+	// Threads from outside of the pool don't pick up unrelated work
+	int queue_index = get_queue_index();
+	const task_group *only = tls_scheduler == this ? nullptr : &group;
+
+	while (!group.done())
+		if (!try_run_task(queue_index, only))
+			std::this_thread::yield();
+}
+
+void task_scheduler::worker_loop(int id)
+{
+	tls_scheduler = this;
+	tls_queue_index = id;
+
+	while (m_active)
+	{
+		if (try_run_task(id))
+			continue;
+
+		std::unique_lock lock{m_sleep_mutex};
+		m_sleep_cv.wait(lock, [this]{return m_queued > 0 || !m_active;});
+	}
+}
@@ -0,0 +1,134 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace bu {
+
+class task_scheduler;
+
+/**
+	\brief Tracks completion of tasks submitted to a task_scheduler
+
+	The first exception thrown by a task of the group is kept and rethrown
+	by task_scheduler::wait().
+*/
+class task_group
+{
+	friend class task_scheduler;
+
+public:
+	task_group() = default;
+	task_group(const task_group &) = delete;
+	task_group &operator=(const task_group &) = delete;
+	~task_group();
+
+	bool done() const
+	{
+		return m_pending == 0;
+	}
+
+private:
+	void set_exception(std::exception_ptr ex);
+
+	std::atomic<int> m_pending = 0;
+	task_scheduler *m_scheduler = nullptr; //!< Scheduler the tasks were submitted to
+	std::mutex m_exception_mutex;
+	std::exception_ptr m_exception;
+};
+
+/**
+	\brief Work-stealing task scheduler
+
+	Each worker thread owns a task deque. Workers take tasks from the back of their
+	own deques and steal from the front of others' when they run out of work. Tasks
+	submitted from outside of the pool land in a shared injection queue.
+
+	Threads waiting for a task_group execute pending tasks instead of blocking,
+	so tasks can safely spawn and wait for other tasks (fork-join). Threads from
+	outside of the pool only execute tasks of the group they wait for, so they
+	are never held up by unrelated work (e.g. a whole BLAS build).
+*/
+class task_scheduler
+{
+	friend class task_group;
+
+public:
+	using task_func = std::function<void()>;
+
+	explicit task_scheduler(int thread_count = 0);
+	task_scheduler(const task_scheduler &) = delete;
+	task_scheduler &operator=(const task_scheduler &) = delete;
+	~task_scheduler();
+
+	void run(task_group &group, task_func func);
+	void wait(task_group &group);
+
+	template <typename F>
+	void parallel_for(int begin, int end, int grain, F &&func);
+
+	int get_thread_count() const
+	{
+		return m_threads.size();
+	}
+
+	static task_scheduler &get();
+
+private:
+	struct task
+	{
+		task_func func;
+		task_group *group;
+	};
+
+	struct task_queue
+	{
+		std::mutex mutex;
+		std::deque<task> tasks;
+	};
+
+	void worker_loop(int id);
+	int get_queue_index() const;
+	bool pop_task(task &t, int queue_index, bool back, const task_group *group);
+	bool try_run_task(int queue_index, const task_group *group = nullptr);
+	void wait_for_tasks(task_group &group);
+
+	std::vector<std::unique_ptr<task_queue>> m_queues; //!< One per worker and the injection queue at the end
+	std::vector<std::thread> m_threads;
+	std::atomic<bool> m_active = true;
+	std::atomic<int> m_queued = 0;
+	std::mutex m_sleep_mutex;
+	std::condition_variable m_sleep_cv;
+};
+
+/**
+	\brief Calls func(range_begin, range_end) on chunks of [begin, end) no larger than grain
+	and waits for all of them to finish.
+*/
+template <typename F>
+void task_scheduler::parallel_for(int begin, int end, int grain, F &&func)
+{
+	grain = std::max(grain, 1);
+	if (end - begin <= grain)
+	{
+		if (begin < end) func(begin, end);
+		return;
+	}
+
+	task_group group;
+	for (int b = begin + grain; b < end; b += grain)
+		run(group, [&func, b, end, grain]{func(b, std::min(b + grain, end));});
+
+	// If this throws, the group's destructor still waits for the other chunks
+	func(begin, begin + grain);
+	wait(group);
+}
+
+}
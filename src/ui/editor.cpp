@@ -31,7 +31,7 @@ bunsen_editor::bunsen_editor() :
 	scene(std::make_shared<bu::scene>()),
 	preview_ctx(std::make_shared<bu::preview_context>()),
 	albedo_ctx(std::make_shared<bu::albedo_context>()),
-	rt_ctx(std::make_shared<bu::rt_context>(*scene->event_bus, preview_ctx))
+	rt_ctx(std::make_shared<bu::rt_context>(*scene->event_bus, preview_ctx, bu::bunsen::get().config.rt))
 {
 	windows.push_back(std::make_unique<ui::rendered_view_window>(*this, -1, scene->event_bus));
 	windows.push_back(std::make_unique<ui::scene_editor_window>(*this, scene->event_bus));
@@ -92,9 +92,9 @@ void bunsen_editor::draw(const bu::bunsen &main_state)
 	}
 
 
-	// TEMP update BVH
+	// TEMP update BVH - pending transforms are handled with interactive builds
 	bool tp = scene->layout_ed.is_transform_pending();
-	rt_ctx->update_from_scene(*scene, !tp);
+	rt_ctx->update_from_scene(*scene, tp);
 
 	// static auto events = scene->event_bus->make_connection();
 	// bu::event ev;
@@ -90,6 +90,9 @@ void layout_editor::update(
 	// Mouse position and delta in pixels
 	auto mouse_pos = bu::to_vec2(ImGui::GetMousePos()) + mouse_offset;
 
+	// Used to detect changes of the pending transform
+	auto old_transform_matrix = transform_matrix;
+
 	switch (state)
 	{
 		case action_state::IDLE:
@@ -254,6 +257,12 @@ void layout_editor::update(
 			abort();
 			break;		
 	}
+
+	// Transform nodes only reference the matrix, so they have to be
+	// marked as modified explicitly
+	if (transform_matrix != old_transform_matrix)
+		for (const auto &tn : transform_nodes)
+			tn->mark_as_modified();
 }
 
 void layout_editor::start(
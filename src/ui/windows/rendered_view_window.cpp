@@ -158,6 +158,57 @@ void rendered_view_window::update()
 		m_renderer->update();
 }
 
+/**
+	\brief Draws widgets for the path tracer settings - the running render restarts on any change
+*/
+void rendered_view_window::draw_rt_settings()
+{
+	auto settings = m_editor.rt_ctx->get_settings();
+
+	ImGui::PushItemWidth(120);
+	ImGui::InputInt("Threads (0 = auto)", &settings.thread_count);
+	ImGui::InputInt("Tile size", &settings.tile_size, 8, 32);
+	ImGui::InputInt("Buckets (0 = auto)", &settings.bucket_count);
+	ImGui::Separator();
+
+	ImGui::SliderInt("Max bounces", &settings.max_bounces, 1, 64);
+	ImGui::SliderInt("Roulette depth", &settings.roulette_depth, 0, 16);
+
+	const char *integrators[] = {"Megakernel", "Ray streams", "Wavefront"};
+	int integrator = static_cast<int>(settings.integrator);
+	if (ImGui::Combo("Integrator", &integrator, integrators, IM_ARRAYSIZE(integrators)))
+		settings.integrator = static_cast<bu::rt::integrator_type>(integrator);
+
+	const char *samplers[] = {"Random", "Sobol"};
+	int sampler = static_cast<int>(settings.sampler);
+	if (ImGui::Combo("Sampler", &sampler, samplers, IM_ARRAYSIZE(samplers)))
+		settings.sampler = static_cast<bu::rt::sampler_type>(sampler);
+	ImGui::Checkbox("Packet primary rays", &settings.packet_tracing);
+	ImGui::Separator();
+
+	ImGui::InputInt("Target spp (0 = none)", &settings.target_samples, 16, 256);
+	ImGui::InputFloat("Time budget [s] (0 = none)", &settings.time_budget, 1.f, 10.f, "%.1f");
+	ImGui::SliderFloat("Adaptive threshold", &settings.adaptive_threshold, 0.f, 0.5f, "%.3f");
+	ImGui::InputInt("Adaptive min spp", &settings.adaptive_min_samples, 4, 16);
+	ImGui::Checkbox("Denoise", &settings.denoise);
+	ImGui::Separator();
+
+	const char *bvh_build_modes[] = {"Sweep SAH", "Binned SAH", "LBVH", "SBVH"};
+	int bvh_build_mode = static_cast<int>(settings.bvh_build_mode);
+	if (ImGui::Combo("BVH build", &bvh_build_mode, bvh_build_modes, IM_ARRAYSIZE(bvh_build_modes)))
+		settings.bvh_build_mode = static_cast<bu::rt::bvh_build_mode>(bvh_build_mode);
+
+	const char *bvh_formats[] = {"Full", "Quantized"};
+	int bvh_format = static_cast<int>(settings.bvh_format);
+	if (ImGui::Combo("BVH nodes", &bvh_format, bvh_formats, IM_ARRAYSIZE(bvh_formats)))
+		settings.bvh_format = static_cast<bu::rt::bvh_node_format>(bvh_format);
+	ImGui::PopItemWidth();
+
+	settings.sanitize();
+	if (settings != m_editor.rt_ctx->get_settings())
+		m_editor.rt_ctx->set_settings(settings);
+}
+
 void rendered_view_window::draw()
 {
 	ImGui::SetNextWindowSizeConstraints(ImVec2(100, 100), ImVec2(10000, 10000));
@@ -212,6 +263,12 @@ void rendered_view_window::draw()
 			ImGui::EndMenu();
 		}
 
+		if (ImGui::BeginMenu("Path tracing"))
+		{
+			draw_rt_settings();
+			ImGui::EndMenu();
+		}
+
 		ImGui::EndMenuBar();
 	}
 
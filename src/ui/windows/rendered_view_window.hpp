@@ -60,6 +60,9 @@ protected:
 	bu::bunsen_editor &m_editor;
 
 	bool m_camera_drag_pending = false;
+
+private:
+	void draw_rt_settings();
 };
 
 }
\ No newline at end of file